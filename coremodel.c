@@ -6,10 +6,12 @@
  */
 
 #define _DEFAULT_SOURCE 1
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <time.h>
@@ -18,11 +20,22 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 #include <alloca.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "coremodel.h"
 
@@ -102,41 +115,205 @@ struct coremodel_packet {
 
 #define RX_BUF                  4096
 #define MAX_PKT                 2048
+#define SPI_XFR_DFLT            256     /* bytes per SPI xfr call unless set at attach */
+#define MAX_SPI_XFR             (0xFFFF - 8)    /* data in the largest packet */
+#define RX_RING_MIN             65536   /* a runtime-sized ring holds any packet */
+
+#ifdef IOV_MAX
+#define TX_IOV                  IOV_MAX
+#else
+#define TX_IOV                  1024
+#endif
+
+#define CONN_MAP_SHIFT          8       /* connection index lookup: 256 pages of 256 entries */
+#define CONN_MAP_SIZE           (1u << CONN_MAP_SHIFT)
+
+#define POOL_MIN_SHIFT          6       /* smallest packet buffer class is 64 bytes */
+#define POOL_CLASSES            7       /* largest is 4 KiB, enough for MAX_PKT */
+#define POOL_CLASS_BYTES        65536   /* bytes kept on each free list at most */
+
+#define LOOPBACK_BUF            65536   /* bytes queued in each direction of a loopback pair */
+#define BATCH_BUF               4000    /* staging buffer of a batch; with its headers, a 4 KiB pool buffer */
+
+#define WHEEL_SHIFT             6       /* timer wheel: 64 slots per level, */
+#define WHEEL_SLOTS             (1u << WHEEL_SHIFT)
+#define WHEEL_LEVELS            11      /* enough levels for any 64-bit microsecond time */
+
+struct coremodel_pbuf {
+    union {
+        struct coremodel_pbuf *next;    /* while on free list */
+        unsigned cls;                   /* while in use */
+        uint64_t align[2];
+    };
+    uint8_t buf[0];
+};
+
+struct coremodel;
+
+/* Timer, linked into a slot of the timer wheel while armed. */
+struct coremodel_timer {
+    struct coremodel *cm;
+    struct coremodel_timer *next, **pprev;  /* pprev is NULL while disarmed */
+    struct coremodel_timer *tnext, **tpprev;
+    uint8_t level, slot;
+    uint64_t expires;               /* nanoseconds */
+    uint64_t period;                /* nanoseconds, or 0 for a one-shot timer */
+    void (*cb)(void *priv);
+    void *priv;
+};
+
+/* Hierarchical timer wheel in microseconds. A timer expiring at t sits at the
+ * level of the highest 6-bit digit in which t differs from now, in the slot of
+ * that digit of t; so every armed slot lies ahead of now within its level, and
+ * the lowest armed level holds the earliest timers. When now reaches the start
+ * of a slot above level 0, its timers are moved down to where they belong. */
+struct coremodel_wheel {
+    uint64_t now;                   /* everything before now has expired */
+    uint64_t sleep_us;              /* when the loop is due to wake, or 0 while it is awake */
+    uint64_t used[WHEEL_LEVELS];    /* bitmap of armed slots per level */
+    struct coremodel_timer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct coremodel_timer *timers; /* every timer, for disconnect */
+};
+
+/* GPIO pins attached together. Each pin is an ordinary GPIO interface whose
+ * updates are collected here, to be reported together once the received data
+ * has been dispatched. */
+struct coremodel_gpio_bank {
+    struct coremodel *cm;
+    const coremodel_gpio_bank_func_t *func;
+    void *priv;
+    unsigned count, words;
+    unsigned pending;               /* on the list of banks with updates */
+    struct coremodel_gpio_bank *pnext;
+    uint64_t *changed;              /* pins updated since the last report */
+    uint64_t *report;               /* pins passed to the current report */
+    int *mvolt;
+    struct coremodel_gpio_bank_pin {
+        struct coremodel_gpio_bank *bank;
+        struct coremodel_if *cif;
+        unsigned idx;
+    } pin[0];
+};
+
+/* CAN frames queued by coremodel_can_rx behind the one the VM has not
+ * acknowledged yet; each is a PKT_CAN_RX packet in a pool buffer, sent as the
+ * previous one is acknowledged. */
+struct coremodel_can_ring {
+    unsigned depth, head, num;
+    struct coremodel_packet *pkt[0];
+};
+
+/* Byte transport under a connection; the calls behave like read(2), writev(2)
+ * and close(2) on a non-blocking socket. */
+struct coremodel_xport {
+    ssize_t (*read)(struct coremodel *cm, void *buf, size_t len);
+    ssize_t (*writev)(struct coremodel *cm, const struct iovec *iov, int niov);
+    void (*close)(struct coremodel *cm);
+};
+
+/* In-process connection: a byte queue in each direction, shared by the
+ * instance and the peer handle, and freed once both have closed it. */
+struct coremodel_loopback {
+    pthread_mutex_t lock;
+    struct coremodel *cm;           /* NULL once the instance has closed */
+    unsigned peer_open;
+    struct coremodel_lbq {
+        uint32_t wp, rp;
+        uint8_t buf[LOOPBACK_BUF];
+    } up, down;                     /* up: instance to peer, down: peer to instance */
+};
 
 struct coremodel {
     int fd;
+    const struct coremodel_xport *xport;
+    struct coremodel_loopback *lb;
+
+    int family;
+    unsigned quickack;
+
+    /* Connection attempt in progress: remaining addresses and deadline */
+    unsigned connecting;
+    struct addrinfo *conn_ai, *conn_next;
+    uint64_t conn_deadline;
+
+    /* Reconnect mode: where to connect again, and the state of an outage */
+    char *target;
+    unsigned conn_ai_local;         /* conn_ai was not made by getaddrinfo */
+    coremodel_connect_opts_t opts;
+    uint64_t down_since, up_since, reconnect_at;
+    unsigned reattach_left;         /* replayed attach requests still unanswered */
+    int timer_fd;
+
+    uint64_t active_us;             /* busy-poll mode: last time data moved */
+    struct coremodel_wheel *wheel;  /* allocated with the first timer */
 
     struct coremodel_txbuf {
         struct coremodel_txbuf *next;
         unsigned size, rptr;
         uint8_t buf[0];
     } *txbufs, **etxbufs;
+    struct coremodel_txbuf *subq;   /* packets submitted without the mutex, newest first */
+    unsigned tx_qbytes, tx_qpkts;   /* queued or submitted and not yet written */
+    unsigned tx_blocked;            /* a producer packet was refused */
+    unsigned tx_wrpend;             /* writable is due */
+    unsigned batch_depth;           /* nesting of the batch open on the thread holding the mutex */
+    unsigned batch_pkts;
+    struct coremodel_txbuf *batch;  /* packets staged by the batch, sent as one */
 
     int txflag;
-    uint8_t rxq[RX_BUF];
+    uint8_t *rxq;
+    uint32_t rxq_size;
+    unsigned rxq_mirror;
     uint32_t rxqwp;
     uint32_t rxqrp;
+    uint32_t rxq_skip;              /* rest of a packet too large for the ring */
+    uint8_t rxq_dflt[RX_BUF];
 
     coremodel_device_list_t *device_list;
     unsigned device_list_size;
     struct coremodel_packet *device_list_pkt;
 
-    unsigned query;
+    unsigned query;                 /* number of queries in flight */
     unsigned defer_pkt;
 
     pthread_mutexattr_t coremodel_mutex_attr;
     pthread_mutex_t coremodel_mutex;
-    int coremodel_wake_fd[2];
+    int coremodel_wake_fd[2];       /* the same eventfd twice on Linux */
+    unsigned wake_pending;
     unsigned coremodel_need_wake;
 
+    /* Callbacks run without the mutex, from one thread at a time: the owner,
+     * which may re-enter from inside a callback. Others that need to dispatch
+     * wait on cb_cond, or leave ready calls on rdy_ifs for the owner. */
+    unsigned cb_depth;
+    pthread_t cb_owner;
+    pthread_cond_t cb_cond;
+    struct coremodel_if *rdy_ifs;
+    struct coremodel_gpio_bank *gpio_pend;  /* banks with updates to report */
+    int tx_err;                     /* write error hit by a producer, for the loop to report */
+
+    int epfd;
+    unsigned epmask;
+
+    struct coremodel_pool {
+        struct coremodel_pbuf *free;
+        unsigned nfree;
+    } pool[POOL_CLASSES];
+
+    coremodel_stats_t stats;
 
+    /* Allocated with a read buffer only for I2C and USB host interfaces;
+     * see coremodel_if_rdlen. */
     struct coremodel_if {
         struct coremodel *cm;
-        struct coremodel_if *next;
+        struct coremodel_if *next, *qnext, *rnext;
         uint16_t conn, trnidx;
-        unsigned type;
+        uint8_t type;
+        uint8_t defer_pkt, attaching, detached;
+        uint8_t rdy, rdy_busy;          /* deferred ready call: on rdy_ifs, clear busy */
         unsigned cred, busy, offs;
-        unsigned defer_pkt;
+        uint64_t rdy_ebusy;             /* and ebusy bits to clear */
+        struct coremodel_packet *req;   /* attach request, kept for reconnect */
         uint64_t ebusy;
         union {
             const void *func;
@@ -153,13 +330,49 @@ struct coremodel {
         struct coremodel_rxbuf {
             struct coremodel_rxbuf *next;
             struct coremodel_packet pkt;
-        } *rxbufs, **erxbufs;
-        uint8_t rdbuf[512];
-    } *ifs, *conn_if;
+        } *rxbufs, **erxbufs, **rxscan;
+        union {
+            uint8_t *xfrbuf;            /* SPI: response to the packet in progress */
+            struct coremodel_can_ring *rxring;  /* CAN: frames waiting to be sent */
+        };
+        unsigned xfrmax;                /* SPI: most bytes per xfr call */
+        unsigned rdlen;
+        uint8_t rdbuf[0];               /* rdlen bytes */
+    } *ifs, *conn_if, **econn_if;   /* conn_if: attach requests awaiting a response, oldest first */
+
+    /* Interfaces indexed by connection index, allocated a page at a time */
+    struct coremodel_if **conn_map[65536 / CONN_MAP_SIZE];
 };
 
 static int coremodel_mainloop_int(struct coremodel *cm, long long usec, unsigned query);
 static void coremodel_advance_if(struct coremodel_if *cif);
+static void coremodel_epoll_update(struct coremodel *cm);
+static void coremodel_wake_close(struct coremodel *cm);
+static uint64_t coremodel_get_microtime(void);
+static void coremodel_discard_tx(struct coremodel *cm);
+static void coremodel_drain_submit(struct coremodel *cm);
+static int coremodel_push_packet(void *priv, struct coremodel_packet *pkt, void *data);
+static void coremodel_attach_queue(struct coremodel *cm, struct coremodel_if *cif);
+static int coremodel_attach_queued(struct coremodel *cm, struct coremodel_if *cif);
+static void coremodel_link_up(struct coremodel *cm);
+static void coremodel_wake(struct coremodel *cm);
+static void coremodel_cb_enter(struct coremodel *cm);
+static void coremodel_cb_exit(struct coremodel *cm);
+static void coremodel_flush_producer(struct coremodel *cm);
+static const struct coremodel_xport coremodel_xport_sock;
+static struct coremodel_if *coremodel_conn_lookup(struct coremodel *cm, unsigned conn);
+static int coremodel_conn_map_set(struct coremodel *cm, unsigned conn, struct coremodel_if *cif);
+static void coremodel_free_rx(struct coremodel *cm, struct coremodel_if *cif);
+static int coremodel_connect_next(struct coremodel *cm, int err);
+static void coremodel_timer_expire(struct coremodel *cm);
+static long long coremodel_timer_clamp(struct coremodel *cm, long long timeout);
+static void coremodel_timer_free_all(struct coremodel *cm);
+
+/* Whether there is a connection, or one is being re-established. */
+static int coremodel_online(struct coremodel *cm)
+{
+    return cm->fd >= 0 || cm->lb || cm->down_since;
+}
 
 static void *coremodel_init(void)
 {
@@ -170,7 +383,13 @@ static void *coremodel_init(void)
         return NULL;
 
     cm->fd = -1;
+    cm->xport = &coremodel_xport_sock;
+    cm->epfd = -1;
+    cm->timer_fd = -1;
     cm->etxbufs = &cm->txbufs;
+    cm->econn_if = &cm->conn_if;
+    cm->rxq = cm->rxq_dflt;
+    cm->rxq_size = RX_BUF;
     cm->coremodel_wake_fd[0] = cm->coremodel_wake_fd[1] = -1;
     cm->coremodel_need_wake = 0;
     return cm;
@@ -178,808 +397,2513 @@ static void *coremodel_init(void)
 
 static void coremodel_fini(void *priv)
 {
+    struct coremodel *cm = priv;
+
+    if(cm->rxq_mirror)
+        munmap(cm->rxq, 2 * cm->rxq_size);
+    else if(cm->rxq != cm->rxq_dflt)
+        free(cm->rxq);
     free(priv);
 }
 
-int coremodel_connect(void **priv, const char *target)
+#ifdef __linux__
+/* Map a memfd twice back-to-back, so that every packet in the ring is
+ * contiguous in memory regardless of where it wraps. */
+static int coremodel_rxq_mirror(struct coremodel *cm, uint32_t size)
 {
-    struct coremodel *cm = NULL;
-    char *strp = NULL;
-    char *port = NULL;
-    unsigned portn;
-    struct hostent *hent;
-    struct sockaddr_in saddr;
-    int res, ret = -1;
+    uint8_t *base;
+    int fd;
 
-    cm = coremodel_init();
-    if(!cm){
-        fprintf(stderr, "[coremodel] Memory allocation error.\n");
-        errno = ENOMEM;
-        goto cleanup;
+    fd = memfd_create("coremodel-rxq", MFD_CLOEXEC);
+    if(fd < 0)
+        return -errno;
+    if(ftruncate(fd, size))
+        goto err_fd;
+
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        goto err_fd;
+    if(mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * size);
+        goto err_fd;
     }
+    close(fd);
 
-    if(pthread_mutexattr_init(&cm->coremodel_mutex_attr) || pthread_mutexattr_settype(&cm->coremodel_mutex_attr, PTHREAD_MUTEX_RECURSIVE) || pthread_mutex_init(&cm->coremodel_mutex, &cm->coremodel_mutex_attr)) {
-        fprintf(stderr, "[coremodel] Failed to initialize mutex: %s.\n", strerror(errno));
-        goto err_entry;
-    }
+    cm->rxq = base;
+    cm->rxq_size = size;
+    cm->rxq_mirror = 1;
+    return 0;
 
-    if(pipe(cm->coremodel_wake_fd)) {
-        fprintf(stderr, "[coremodel] Failed to create wake-up pipe: %s.\n", strerror(errno));
-        goto err_mutex;
-    }
-    if(fcntl(cm->coremodel_wake_fd[0], F_SETFL, fcntl(cm->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-        fprintf(stderr, "[coremodel] Failed to set pipe non-blocking: %s.\n", strerror(errno));
-        goto err_pipe;
-    }
+err_fd:
+    close(fd);
+    return -errno;
+}
+#endif
 
-    if(!target)
-        target = getenv("COREMODEL_VM");
-    if(!target) {
-        fprintf(stderr, "[coremodel] Set environment variable COREMODEL_VM to the address:port of the Corellium VM and try again.\n");
-        errno = EINVAL;
-        goto err_pipe;
-    }
+/* Set up the receive ring; size 0 keeps the built-in RX_BUF ring. */
+static int coremodel_rxq_init(struct coremodel *cm, uint32_t size)
+{
+    uint32_t rsize;
 
-    strp = malloc(strlen(target) + 1);
-    if(!strp) {
-        fprintf(stderr, "[coremodel] Memory allocation error.\n");
-        errno = ENOMEM;
-        goto err_pipe;
-    }
-    strcpy(strp, target);
+    if(!size)
+        return 0;
+    for(rsize=RX_RING_MIN; rsize<size; rsize<<=1)
+        if(rsize >= 0x40000000u)
+            return -EINVAL;
 
-    port = strchr(strp, ':');
-    if(port) {
-        *(port++) = 0;
-        portn = strtol(port, NULL, 0);
-    } else
-        portn = COREMODEL_DFLT_PORT;
+#ifdef __linux__
+    if(!coremodel_rxq_mirror(cm, rsize))
+        return 0;
+#endif
 
-    hent = gethostbyname(strp);
-    if(!hent) {
-        fprintf(stderr, "[coremodel] Failed to resolve host %s: %s.\n", strp, hstrerror(h_errno));
-        errno = ENOENT;
-        goto err_pipe;
+    cm->rxq = malloc(rsize);
+    if(!cm->rxq) {
+        cm->rxq = cm->rxq_dflt;
+        return -ENOMEM;
     }
+    cm->rxq_size = rsize;
+    return 0;
+}
 
-    cm->fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(cm->fd < 0) {
-        perror("[coremodel] Failed to create socket");
-        goto err_pipe;
-    }
+static unsigned coremodel_buf_class(unsigned size)
+{
+    unsigned cls;
+
+    size += sizeof(struct coremodel_pbuf);
+    for(cls=0; cls<POOL_CLASSES; cls++)
+        if(size <= (1u << (POOL_MIN_SHIFT + cls)))
+            break;
+    return cls;
+}
 
-    memset(&saddr, 0, sizeof(saddr));
-    saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(portn);
-    saddr.sin_addr = *(struct in_addr *)hent->h_addr;
+/* Allocate a buffer without touching the pool, so it can be called without
+ * the connection mutex. The buffer still goes to the pool when freed. */
+static void *coremodel_buf_malloc(unsigned size)
+{
+    struct coremodel_pbuf *pb;
+    unsigned cls = coremodel_buf_class(size);
 
-    if(connect(cm->fd, (struct sockaddr *)&saddr, sizeof(saddr)) != 0) {
-        fprintf(stderr, "[coremodel] Failed to connect to %s:%d: %s.\n", strp, portn, strerror(errno));
-        goto err_socket;
-    }
+    pb = malloc(cls < POOL_CLASSES ? (1u << (POOL_MIN_SHIFT + cls)) : sizeof(*pb) + size);
+    if(!pb)
+        return NULL;
+    pb->cls = cls;
+    return pb->buf;
+}
 
-    if(fcntl(cm->fd, F_SETFL, fcntl(cm->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-        fprintf(stderr, "[coremodel] Failed to set non-blocking: %s.\n", strerror(errno));
-        goto err_socket;
+/* Allocate a packet buffer from the per-connection pool; must be called with
+ * coremodel_mutex held. Contents are not cleared. */
+static void *coremodel_buf_alloc(struct coremodel *cm, unsigned size)
+{
+    struct coremodel_pbuf *pb;
+    unsigned cls = coremodel_buf_class(size);
+
+    if(cls < POOL_CLASSES && cm->pool[cls].free) {
+        pb = cm->pool[cls].free;
+        cm->pool[cls].free = pb->next;
+        cm->pool[cls].nfree --;
+        cm->stats.pool_hits ++;
+        return pb->buf;
     }
 
-    res = 1;
-    setsockopt(cm->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&res, sizeof(res));
+    cm->stats.pool_misses ++;
+    return coremodel_buf_malloc(size);
+}
 
-    ret = 0;
-    *priv = cm;
+static void coremodel_buf_free(struct coremodel *cm, void *buf)
+{
+    struct coremodel_pbuf *pb = (struct coremodel_pbuf *)buf - 1;
+    unsigned cls = pb->cls;
 
-    return 0;
+    if(cls >= POOL_CLASSES || cm->pool[cls].nfree >= (POOL_CLASS_BYTES >> (POOL_MIN_SHIFT + cls))) {
+        free(pb);
+        return;
+    }
 
+    pb->next = cm->pool[cls].free;
+    cm->pool[cls].free = pb;
+    cm->pool[cls].nfree ++;
+}
 
-err_socket:
-    close(cm->fd);
-    cm->fd = -1;
-err_pipe:
-    close(cm->coremodel_wake_fd[0]);
-    close(cm->coremodel_wake_fd[1]);
-    cm->coremodel_wake_fd[0] = cm->coremodel_wake_fd[1] = -1;
-err_mutex:
-    pthread_mutex_destroy(&cm->coremodel_mutex);
-    pthread_mutexattr_destroy(&cm->coremodel_mutex_attr);
-cleanup:
-    if(ret && cm){
-        if(cm->fd){
-            close(cm->fd);
-                cm->fd = -1;
+static void coremodel_pool_drain(struct coremodel *cm)
+{
+    struct coremodel_pbuf *pb;
+    unsigned cls;
+
+    for(cls=0; cls<POOL_CLASSES; cls++) {
+        while(cm->pool[cls].free) {
+            pb = cm->pool[cls].free;
+            cm->pool[cls].free = pb->next;
+            free(pb);
         }
-        coremodel_fini(cm);
-        cm = NULL;
+        cm->pool[cls].nfree = 0;
     }
-    if(strp)
-        free(strp);
-err_entry:
-    return -errno;
 }
 
-static int coremodel_push_packet(void *priv, struct coremodel_packet *pkt, void *data)
+int coremodel_connect(void **priv, const char *target)
 {
-    struct coremodel *cm = priv;
-    unsigned len = pkt->len, dlen = (len + 3) & ~3;
-    struct coremodel_txbuf *txb = calloc(1, sizeof(struct coremodel_txbuf) + dlen);
-    char wake;
-    int res;
+    return coremodel_connect_ex(priv, target, NULL);
+}
 
-    if(!txb)
-        return 1;
-    txb->size = dlen;
-    if(data) {
-        memcpy(txb->buf, pkt, 8);
-        memcpy(txb->buf + 8, data, len - 8);
-    } else
-        memcpy(txb->buf, pkt, len);
+/* Arm the connection timer for an absolute coremodel_get_microtime() value,
+ * or disarm it for zero. */
+static void coremodel_timer_arm(struct coremodel *cm, uint64_t when)
+{
+#ifdef __linux__
+    struct itimerspec its = { .it_value = { .tv_sec = when / 1000000, .tv_nsec = (when % 1000000) * 1000 } };
 
-    *cm->etxbufs = txb;
-    cm->etxbufs = &txb->next;
-    cm->txflag = 1;
-    if(cm->coremodel_need_wake) {
-        wake = 0;
-        while(1) {
-            res = write(cm->coremodel_wake_fd[1], &wake, 1);
-            if(res >= 0)
-                break;
-            if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
-                break;
-        }
-    }
+    if(cm->timer_fd >= 0)
+        timerfd_settime(cm->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+static void coremodel_free_ai(struct coremodel *cm)
+{
+    if(cm->conn_ai_local)
+        free(cm->conn_ai);
+    else if(cm->conn_ai)
+        freeaddrinfo(cm->conn_ai);
+    cm->conn_ai = cm->conn_next = NULL;
+    cm->conn_ai_local = 0;
+}
+
+/* Make the single address of a "unix:/path" target. */
+static int coremodel_resolve_unix(struct coremodel *cm, const char *path)
+{
+    struct addrinfo *ai;
+    struct sockaddr_un *sun;
+
+    if(strlen(path) >= sizeof(sun->sun_path))
+        return EAI_NONAME;
+    ai = calloc(1, sizeof(*ai) + sizeof(*sun));
+    if(!ai)
+        return EAI_MEMORY;
+    sun = (struct sockaddr_un *)(ai + 1);
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    ai->ai_family = AF_UNIX;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *)sun;
+    ai->ai_addrlen = sizeof(*sun);
+
+    cm->conn_ai = cm->conn_next = ai;
+    cm->conn_ai_local = 1;
     return 0;
 }
 
-coremodel_device_list_t *coremodel_list(void *priv)
+/* Resolve cm->target into the list of addresses to try. Returns 0 or a
+ * getaddrinfo(3) error code. */
+static int coremodel_resolve(struct coremodel *cm)
 {
-    struct coremodel *cm = priv;
-    struct coremodel_packet pkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_LIST };
-    coremodel_device_list_t *res;
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_family = cm->opts.family };
+    char *strp, *host, *port, dflt_port[8];
+    int res;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    if(cm->query) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
-    }
-    if(coremodel_push_packet(cm, &pkt, NULL)) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+    if(!strncmp(cm->target, "unix:", 5)) {
+        res = coremodel_resolve_unix(cm, cm->target + 5);
+        goto done;
     }
-    cm->query = 1;
 
-    if(coremodel_mainloop_int(cm, -1, 1)) {
-        coremodel_free_list(cm->device_list);
-        cm->device_list = NULL;
-        cm->query = 0;
+    strp = strdup(cm->target);
+    if(!strp)
+        return EAI_MEMORY;
+
+    /* "host:port", "[v6addr]:port", or a bare host or IPv6 address */
+    host = strp;
+    port = NULL;
+    if(*host == '[' && (port = strchr(host, ']'))) {
+        host ++;
+        *(port++) = 0;
+        port = (*port == ':') ? port + 1 : NULL;
+    } else if((port = strchr(host, ':')) && !strchr(port + 1, ':'))
+        *(port++) = 0;
+    else
+        port = NULL;
+    if(!port || !*port) {
+        snprintf(dflt_port, sizeof(dflt_port), "%d", COREMODEL_DFLT_PORT);
+        port = dflt_port;
     }
 
-    res = cm->device_list;
-    cm->device_list = NULL;
-    cm->device_list_size = 0;
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    res = getaddrinfo(host, port, &hints, &cm->conn_ai);
+    free(strp);
+    cm->conn_next = cm->conn_ai;
 
-    return res;
+done:
+    if(res)
+        return res;
+    cm->conn_deadline = 0;
+    if(cm->opts.timeout_ms)
+        cm->conn_deadline = coremodel_get_microtime() + cm->opts.timeout_ms * 1000ull;
+    return 0;
 }
 
-coremodel_device_list_t *coremodel_list_subdevices(void *priv, int type, const char *name)
+/* Connected again after an outage: replay the connection request of every
+ * interface, the ones that were still waiting for an answer first so that
+ * responses stay in request order. The new connection indices are filled in
+ * by coremodel_process_conn_response. */
+static void coremodel_reattach(struct coremodel *cm)
 {
-    struct coremodel *cm = priv;
-    unsigned nlen = strlen(name);
-    struct coremodel_packet *pkt;
-    coremodel_device_list_t *res;
+    struct coremodel_if *cif;
 
-    pkt = alloca(sizeof(*pkt) + 4 + nlen);
-    memset(pkt, 0, sizeof(*pkt));
-    pkt->len = 12 + nlen;
-    pkt->conn = CONN_QUERY;
-    pkt->pkt = PKT_QUERY_REQ_LIST;
-    pkt->hflag = 0x8000;
-    *(uint16_t *)pkt->data = type;
-    *(uint16_t *)(pkt->data + 2) = nlen;
-    memcpy(pkt->data + 4, name, nlen);
+    cm->up_since = coremodel_get_microtime();
+    cm->reattach_left = 0;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    if(cm->query) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+    /* Anything queued while down was either already dropped or is one of the
+     * requests replayed below */
+    coremodel_drain_submit(cm);
+    coremodel_discard_tx(cm);
+
+    for(cif=cm->conn_if; cif; cif=cif->qnext) {
+        coremodel_push_packet(cm, cif->req, NULL);
+        cm->reattach_left ++;
     }
-    if(coremodel_push_packet(cm, pkt, NULL)) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+    for(cif=cm->ifs; cif; cif=cif->next) {
+        if(!cif->req || coremodel_attach_queued(cm, cif))
+            continue;
+        coremodel_push_packet(cm, cif->req, NULL);
+        coremodel_attach_queue(cm, cif);
+        cm->reattach_left ++;
     }
-    cm->query = 1;
-    cm->device_list_pkt = pkt;
 
-    if(coremodel_mainloop_int(cm, -1, 1)) {
-        coremodel_free_list(cm->device_list);
-        cm->device_list = NULL;
-        cm->query = 0;
+    if(!cm->reattach_left)
+        coremodel_link_up(cm);
+}
+
+static void coremodel_link_up(struct coremodel *cm)
+{
+    uint64_t now = coremodel_get_microtime();
+
+    cm->stats.reconnects ++;
+    cm->stats.last_outage_us = now - cm->down_since;
+    cm->stats.last_reattach_us = now - cm->up_since;
+    cm->down_since = 0;
+    if(cm->opts.link) {
+        coremodel_cb_enter(cm);
+        cm->opts.link(cm->opts.link_priv, 1, 0);
+        coremodel_cb_exit(cm);
+    }
+}
+
+/* The connection failed in reconnect mode. Forget everything that belonged
+ * to it, keep the interfaces, and schedule the next connection attempt. */
+static void coremodel_drop(struct coremodel *cm, int err)
+{
+    struct coremodel_if *cif;
+    uint64_t now = coremodel_get_microtime();
+    unsigned first = !cm->down_since;
+
+    cm->xport->close(cm);
+    cm->epmask = 0;
+    cm->connecting = 0;
+    coremodel_free_ai(cm);
+
+    coremodel_drain_submit(cm);
+    coremodel_discard_tx(cm);
+    cm->tx_err = 0;
+    cm->rxqwp = cm->rxqrp = cm->rxq_skip = 0;
+    cm->defer_pkt = 0;
+
+    for(cif=cm->ifs; cif; cif=cif->next) {
+        if(cif->conn != CONN_QUERY && coremodel_conn_lookup(cm, cif->conn) == cif)
+            coremodel_conn_map_set(cm, cif->conn, NULL);
+        cif->conn = CONN_QUERY;
+        coremodel_free_rx(cm, cif);
+        cif->cred = cif->busy = cif->offs = cif->defer_pkt = 0;
+        __atomic_store_n(&cif->ebusy, 0, __ATOMIC_RELAXED);
     }
 
-    res = cm->device_list;
+    /* Attach requests stay queued to be replayed; a device list query fails */
+    cm->query = 0;
+    for(cif=cm->conn_if; cif; cif=cif->qnext)
+        cm->query ++;
+    coremodel_free_list(cm->device_list);
     cm->device_list = NULL;
     cm->device_list_size = 0;
-    cm->device_list_pkt = NULL;
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    cm->reattach_left = 0;
 
-    return res;
+    if(first)
+        cm->down_since = now;
+    cm->reconnect_at = now + cm->opts.reconnect_ms * 1000ull;
+    coremodel_timer_arm(cm, cm->reconnect_at);
+
+    if(first && cm->opts.link) {
+        coremodel_cb_enter(cm);
+        cm->opts.link(cm->opts.link_priv, 0, -err);
+        coremodel_cb_exit(cm);
+    }
 }
 
-void coremodel_free_list(coremodel_device_list_t *list)
+/* Start a new connection attempt once the reconnect delay has passed. */
+static void coremodel_reconnect(struct coremodel *cm)
 {
-    unsigned idx;
+    int res;
 
-    if(!list)
+    if(coremodel_get_microtime() < cm->reconnect_at)
         return;
 
-    for(idx=0; list[idx].type!=COREMODEL_INVALID; idx++)
-        free(list[idx].name);
-    free(list);
+    if(coremodel_resolve(cm)) {
+        coremodel_drop(cm, ENOENT);
+        return;
+    }
+    res = coremodel_connect_next(cm, ENOENT);
+    if(res < 0)
+        coremodel_drop(cm, -res);
+    else if(res > 0 && cm->conn_deadline)
+        coremodel_timer_arm(cm, cm->conn_deadline);
 }
 
-static int coremodel_process_list_response(void *priv, struct coremodel_packet *pkt)
+static int coremodel_connect_done(struct coremodel *cm)
 {
-    struct coremodel *cm = priv;
-    struct coremodel_packet npkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_LIST };
-    unsigned offs, len, step, num, base;
-    uint8_t *ptr;
-    void *prev;
+    int one = 1;
+
+    cm->connecting = 0;
+    coremodel_free_ai(cm);
+    if(cm->conn_deadline)
+        coremodel_timer_arm(cm, 0);
+
+    /* Fails harmlessly on a unix socket */
+    setsockopt(cm->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+    if(cm->down_since)
+        coremodel_reattach(cm);
+    coremodel_epoll_update(cm);
+    return 0;
+}
 
-    if(pkt->len == 8) {
-        cm->query = 0;
-        return 0;
-    }
+static const struct {
+    const char *name;
+    size_t offs;
+} coremodel_sockopts_env[] = {
+    { "COREMODEL_SNDBUF",       offsetof(coremodel_sockopts_t, sndbuf) },
+    { "COREMODEL_RCVBUF",       offsetof(coremodel_sockopts_t, rcvbuf) },
+    { "COREMODEL_BUSY_POLL",    offsetof(coremodel_sockopts_t, busy_poll) },
+    { "COREMODEL_QUICKACK",     offsetof(coremodel_sockopts_t, quickack) },
+    { "COREMODEL_PRIORITY",     offsetof(coremodel_sockopts_t, priority) },
+    { "COREMODEL_TOS",          offsetof(coremodel_sockopts_t, tos) },
+};
 
-    len = pkt->len - 8;
-    base = pkt->hflag & 0x7FFF;
-    for(offs=0,num=base; offs<len; offs+=step,num++) {
-        ptr = pkt->data + offs;
-        step = (11 + *(uint16_t *)(ptr + 2)) & ~3;
-    }
+static void coremodel_sockopts_getenv(coremodel_sockopts_t *sock)
+{
+    const char *val;
+    char *end;
+    long num;
+    unsigned idx;
 
-    prev = cm->device_list;
-    cm->device_list = realloc(prev, sizeof(coremodel_device_list_t) * (num + 1));
-    if(!cm->device_list) {
-        free(prev);
-        cm->query = 0;
-        return 0;
+    for(idx=0; idx<sizeof(coremodel_sockopts_env)/sizeof(coremodel_sockopts_env[0]); idx++) {
+        val = getenv(coremodel_sockopts_env[idx].name);
+        if(!val || !*val)
+            continue;
+        num = strtol(val, &end, 0);
+        if(*end) {
+            fprintf(stderr, "[coremodel] Ignoring %s=%s: not a number.\n", coremodel_sockopts_env[idx].name, val);
+            continue;
+        }
+        *(int *)((char *)sock + coremodel_sockopts_env[idx].offs) = num;
     }
-    if(cm->device_list_size < num + 1)
-        memset(cm->device_list + cm->device_list_size, 0, sizeof(coremodel_device_list_t) * (num + 1 - cm->device_list_size));
-    cm->device_list_size = num + 1;
+}
 
-    for(offs=0,num=base; offs<len; offs+=step,num++) {
-        ptr = pkt->data + offs;
-        step = *(uint16_t *)(ptr + 2);
-        cm->device_list[num].type = *(uint16_t *)ptr;
-        cm->device_list[num].name = calloc(step + 1, 1);
-        if(!cm->device_list[num].name) {
-            coremodel_free_list(cm->device_list);
-            cm->device_list = NULL;
-            cm->query = 0;
-            return 0;
-        }
-        memcpy(cm->device_list[num].name, ptr + 8, step);
-        cm->device_list[num].num = *(uint32_t *)(ptr + 4);
-        step = (11 + step) & ~3;
+/* Apply socket tuning before connecting, so that buffer sizes are taken into
+ * account for the TCP window. Failures are not fatal; what was granted can be
+ * read back with coremodel_get_sockopts. */
+static void coremodel_sockopts_apply(struct coremodel *cm, int family)
+{
+    const coremodel_sockopts_t *sock = &cm->opts.sock;
+    unsigned inet = (family == AF_INET || family == AF_INET6);
+
+    cm->family = family;
+    cm->quickack = 0;
+
+    if(sock->sndbuf)
+        setsockopt(cm->fd, SOL_SOCKET, SO_SNDBUF, (void *)&sock->sndbuf, sizeof(int));
+    if(sock->rcvbuf)
+        setsockopt(cm->fd, SOL_SOCKET, SO_RCVBUF, (void *)&sock->rcvbuf, sizeof(int));
+
+    if(inet) {
+#ifdef SO_BUSY_POLL
+        if(sock->busy_poll)
+            setsockopt(cm->fd, SOL_SOCKET, SO_BUSY_POLL, (void *)&sock->busy_poll, sizeof(int));
+#endif
+        if(sock->tos && family == AF_INET6)
+            setsockopt(cm->fd, IPPROTO_IPV6, IPV6_TCLASS, (void *)&sock->tos, sizeof(int));
+        else if(sock->tos)
+            setsockopt(cm->fd, IPPROTO_IP, IP_TOS, (void *)&sock->tos, sizeof(int));
+#ifdef TCP_QUICKACK
+        cm->quickack = !!sock->quickack;
+#endif
     }
-    cm->device_list[num].type = COREMODEL_INVALID;
 
-    if(cm->device_list_pkt) {
-        cm->device_list_pkt->hflag = num | 0x8000;
-        return coremodel_push_packet(cm, cm->device_list_pkt, NULL);
-    }
-    npkt.hflag = num;
-    return coremodel_push_packet(cm, &npkt, NULL);
+    /* After IP_TOS, which sets the priority from the TOS on Linux */
+#ifdef SO_PRIORITY
+    if(sock->priority)
+        setsockopt(cm->fd, SOL_SOCKET, SO_PRIORITY, (void *)&sock->priority, sizeof(int));
+#endif
 }
 
-static void *coremodel_attach_int(void *priv, unsigned type, const char *name, unsigned addr, const char *subname, const void *func, void *ifpriv, uint16_t flags)
+int coremodel_get_sockopts(void *priv, coremodel_sockopts_t *sock)
 {
     struct coremodel *cm = priv;
-    struct coremodel_if *cif;
-    struct coremodel_packet *pkt;
-    unsigned nlen = strlen(name), snlen = subname ? strlen(subname) : 0;
+    socklen_t len;
+
+    memset(sock, 0, sizeof(*sock));
 
     pthread_mutex_lock(&cm->coremodel_mutex);
-    if(cm->query) {
+    if(cm->fd < 0 || cm->connecting) {
         pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+        return -ENOTCONN;
     }
 
-    cif = calloc(1, sizeof(struct coremodel_if));
-    if(!cif) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+    len = sizeof(int);
+    getsockopt(cm->fd, SOL_SOCKET, SO_SNDBUF, (void *)&sock->sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(cm->fd, SOL_SOCKET, SO_RCVBUF, (void *)&sock->rcvbuf, &len);
+#ifdef SO_PRIORITY
+    len = sizeof(int);
+    getsockopt(cm->fd, SOL_SOCKET, SO_PRIORITY, (void *)&sock->priority, &len);
+#endif
+    if(cm->family == AF_INET || cm->family == AF_INET6) {
+#ifdef SO_BUSY_POLL
+        len = sizeof(int);
+        getsockopt(cm->fd, SOL_SOCKET, SO_BUSY_POLL, (void *)&sock->busy_poll, &len);
+#endif
+        len = sizeof(int);
+        if(cm->family == AF_INET6)
+            getsockopt(cm->fd, IPPROTO_IPV6, IPV6_TCLASS, (void *)&sock->tos, &len);
+        else
+            getsockopt(cm->fd, IPPROTO_IP, IP_TOS, (void *)&sock->tos, &len);
+        sock->quickack = cm->quickack;
     }
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return 0;
+}
 
-    if(subname) {
-        pkt = alloca(sizeof(*pkt) + 9 + nlen + snlen);
-        memset(pkt, 0, sizeof(*pkt));
-        pkt->len = 17 + nlen + snlen;
-        pkt->conn = CONN_QUERY;
-        pkt->pkt = PKT_QUERY_REQ_CONN;
-        pkt->hflag = flags | 0x8000u;
-        *(uint16_t *)pkt->data = type;
-        *(uint16_t *)(pkt->data + 2) = 1 + nlen + snlen;
-        *(uint32_t *)(pkt->data + 4) = addr;
-        memcpy(pkt->data + 8, name, nlen);
-        pkt->data[8 + nlen] = 0;
-        memcpy(pkt->data + 9 + nlen, subname, snlen);
-    } else {
-        pkt = alloca(sizeof(*pkt) + 8 + nlen);
-        memset(pkt, 0, sizeof(*pkt));
-        pkt->len = 16 + nlen;
-        pkt->conn = CONN_QUERY;
-        pkt->pkt = PKT_QUERY_REQ_CONN;
-        pkt->hflag = flags;
-        *(uint16_t *)pkt->data = type;
-        *(uint16_t *)(pkt->data + 2) = nlen;
-        *(uint32_t *)(pkt->data + 4) = addr;
-        memcpy(pkt->data + 8, name, nlen);
-    }
-    if(coremodel_push_packet(cm, pkt, NULL)) {
-        free(cif);
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+/* Start connecting to the next resolved address, err being the failure of the
+ * previous one. Returns 0 if connected, 1 if the attempt is in progress, or
+ * error flag once no address is left. */
+static int coremodel_connect_next(struct coremodel *cm, int err)
+{
+#ifdef __linux__
+    struct epoll_event eevt = { .events = EPOLLOUT };
+#endif
+    struct addrinfo *ai;
+    int res;
+
+    if(cm->fd >= 0) {
+        close(cm->fd);
+        cm->fd = -1;
     }
 
-    cif->cm = cm;
-    cif->conn = CONN_QUERY;
-    cif->type = type;
-    cif->func = func;
-    cif->priv = ifpriv;
-    cif->erxbufs = &cif->rxbufs;
-    cif->defer_pkt = 1;
-    cm->conn_if = cif;
-    cm->query = 1;
+    while((ai = cm->conn_next)) {
+        cm->conn_next = ai->ai_next;
 
-    if(coremodel_mainloop_int(cm, -1, 1)) {
-        cm->query = 0;
-        cm->conn_if = NULL;
-        cif->conn = CONN_QUERY;
-    }
+        cm->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(cm->fd < 0) {
+            err = errno;
+            continue;
+        }
+        if(fcntl(cm->fd, F_SETFL, fcntl(cm->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+            err = errno;
+            close(cm->fd);
+            cm->fd = -1;
+            continue;
+        }
+        coremodel_sockopts_apply(cm, ai->ai_family);
 
-    if(cif->conn == CONN_QUERY) {
-        free(cm->conn_if);
-        cm->conn_if = NULL;
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return NULL;
+        res = connect(cm->fd, ai->ai_addr, ai->ai_addrlen);
+        if(res && errno != EINPROGRESS) {
+            err = errno;
+            close(cm->fd);
+            cm->fd = -1;
+            continue;
+        }
+
+#ifdef __linux__
+        eevt.data.fd = cm->fd;
+        if(cm->epfd >= 0 && !epoll_ctl(cm->epfd, EPOLL_CTL_ADD, cm->fd, &eevt))
+            cm->epmask = EPOLLOUT;
+#endif
+        if(!res)
+            return coremodel_connect_done(cm);
+        cm->connecting = 1;
+        return 1;
     }
-    cm->conn_if = NULL;
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return cif;
+
+    cm->connecting = 0;
+    coremodel_free_ai(cm);
+    errno = err;
+    return -errno;
 }
 
-static int coremodel_process_conn_response(void *priv, struct coremodel_packet *pkt)
+/* Check on a connection attempt in progress; ready is set when the socket
+ * polled writable or failed. Returns as coremodel_connect_next. */
+static int coremodel_connect_poll(struct coremodel *cm, unsigned ready)
 {
-    struct coremodel *cm = priv;
-
-    if(cm->conn_if) {
-        cm->conn_if->conn = pkt->hflag;
-        if(pkt->len >= 12)
-            cm->conn_if->cred = *(uint32_t *)pkt->data;
-        if(pkt->hflag != CONN_QUERY) {
-            cm->conn_if->next = cm->ifs;
-            cm->ifs = cm->conn_if;
-        }
-        cm->query = 0;
+    socklen_t len = sizeof(int);
+    int err;
+
+    if(ready) {
+        if(getsockopt(cm->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+            err = errno;
+        if(!err)
+            return coremodel_connect_done(cm);
+    } else {
+        if(!cm->conn_deadline || coremodel_get_microtime() < cm->conn_deadline)
+            return 1;
+        err = ETIMEDOUT;
+        cm->conn_next = NULL;
     }
-    return 0;
+
+    return coremodel_connect_next(cm, err);
 }
 
-void *coremodel_attach_uart(void *priv, const char *name, const coremodel_uart_func_t *func, void *ifpriv)
+/* When the connection next needs the loop without its socket becoming ready:
+ * the connect deadline, or the next reconnect attempt. Returns UINT64_MAX if
+ * neither applies. */
+static uint64_t coremodel_connect_due(struct coremodel *cm)
 {
-    return coremodel_attach_int(priv, COREMODEL_UART, name, 0, NULL, func, ifpriv, 0);
+    if(cm->connecting && cm->conn_deadline)
+        return cm->conn_deadline;
+    if(cm->fd < 0 && cm->down_since)
+        return cm->reconnect_at;
+    return UINT64_MAX;
 }
-void *coremodel_attach_i2c(void *priv, const char *name, uint8_t addr, const coremodel_i2c_func_t *func, void *ifpriv, uint16_t flags)
+
+/* Clamp a poll timeout in microseconds (-1 for none) to the connect deadline,
+ * or to the next reconnect attempt. */
+static long long coremodel_connect_wait(struct coremodel *cm, long long timeout)
 {
-    return coremodel_attach_int(priv, COREMODEL_I2C, name, addr, NULL, func, ifpriv, flags);
+    long long left;
+    uint64_t when;
+
+    when = coremodel_connect_due(cm);
+    if(when == UINT64_MAX)
+        return timeout;
+    left = (long long)when - (long long)coremodel_get_microtime();
+    if(left < 0)
+        left = 0;
+    return (timeout < 0 || left < timeout) ? left : timeout;
 }
-void *coremodel_attach_spi(void *priv, const char *name, unsigned csel, const coremodel_spi_func_t *func, void *ifpriv, uint16_t flags)
+
+/* Allocate an instance with its mutex, wake-up fd and receive ring. Returns
+ * NULL with errno set on failure. */
+static struct coremodel *coremodel_create(const coremodel_connect_opts_t *opts)
 {
-    return coremodel_attach_int(priv, COREMODEL_SPI, name, csel, NULL, func, ifpriv, flags);
+    struct coremodel *cm;
+    int res;
+
+    cm = coremodel_init();
+    if(!cm){
+        fprintf(stderr, "[coremodel] Memory allocation error.\n");
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(pthread_mutexattr_init(&cm->coremodel_mutex_attr) || pthread_mutexattr_settype(&cm->coremodel_mutex_attr, PTHREAD_MUTEX_RECURSIVE) || pthread_mutex_init(&cm->coremodel_mutex, &cm->coremodel_mutex_attr)) {
+        fprintf(stderr, "[coremodel] Failed to initialize mutex: %s.\n", strerror(errno));
+        goto err_cm;
+    }
+    if(pthread_cond_init(&cm->cb_cond, NULL)) {
+        fprintf(stderr, "[coremodel] Failed to initialize condition variable: %s.\n", strerror(errno));
+        goto err_mutex;
+    }
+
+#ifdef __linux__
+    cm->coremodel_wake_fd[0] = cm->coremodel_wake_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(cm->coremodel_wake_fd[0] < 0) {
+        fprintf(stderr, "[coremodel] Failed to create wake-up eventfd: %s.\n", strerror(errno));
+        goto err_cond;
+    }
+#else
+    if(pipe(cm->coremodel_wake_fd)) {
+        fprintf(stderr, "[coremodel] Failed to create wake-up pipe: %s.\n", strerror(errno));
+        goto err_cond;
+    }
+    if(fcntl(cm->coremodel_wake_fd[0], F_SETFL, fcntl(cm->coremodel_wake_fd[0], F_GETFL, 0) | O_NONBLOCK) < 0 ||
+       fcntl(cm->coremodel_wake_fd[1], F_SETFL, fcntl(cm->coremodel_wake_fd[1], F_GETFL, 0) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "[coremodel] Failed to set pipe non-blocking: %s.\n", strerror(errno));
+        goto err_wake;
+    }
+#endif
+
+    res = coremodel_rxq_init(cm, opts->rx_ring_size);
+    if(res) {
+        fprintf(stderr, "[coremodel] Failed to set up receive ring: %s.\n", strerror(-res));
+        errno = -res;
+        goto err_wake;
+    }
+
+    return cm;
+
+err_wake:
+    coremodel_wake_close(cm);
+err_cond:
+    pthread_cond_destroy(&cm->cb_cond);
+err_mutex:
+    pthread_mutex_destroy(&cm->coremodel_mutex);
+    pthread_mutexattr_destroy(&cm->coremodel_mutex_attr);
+err_cm:
+    coremodel_fini(cm);
+    return NULL;
 }
-void *coremodel_attach_spi_name(void *priv, const char *name, const char *cselname, const coremodel_spi_func_t *func, void *ifpriv, uint16_t flags)
+
+static void coremodel_destroy(struct coremodel *cm)
 {
-    return coremodel_attach_int(priv, COREMODEL_SPI, name, 0, cselname, func, ifpriv, flags);
+    coremodel_wake_close(cm);
+    pthread_cond_destroy(&cm->cb_cond);
+    pthread_mutex_destroy(&cm->coremodel_mutex);
+    pthread_mutexattr_destroy(&cm->coremodel_mutex_attr);
+    coremodel_fini(cm);
 }
-void *coremodel_attach_gpio(void *priv, const char *name, unsigned pin, const coremodel_gpio_func_t *func, void *ifpriv)
+
+static ssize_t coremodel_sock_read(struct coremodel *cm, void *buf, size_t len)
 {
-    return coremodel_attach_int(priv, COREMODEL_GPIO, name, pin, NULL, func, ifpriv, 0);
+    ssize_t res = read(cm->fd, buf, len);
+#ifdef TCP_QUICKACK
+    int one = 1;
+
+    /* The kernel drops out of quick ACK mode on its own; keep it on */
+    if(res > 0 && cm->quickack)
+        setsockopt(cm->fd, IPPROTO_TCP, TCP_QUICKACK, (void *)&one, sizeof(one));
+#endif
+    return res;
 }
-void *coremodel_attach_gpio_name(void *priv, const char *name, const char *pinname, const coremodel_gpio_func_t *func, void *ifpriv)
+
+static ssize_t coremodel_sock_writev(struct coremodel *cm, const struct iovec *iov, int niov)
 {
-    return coremodel_attach_int(priv, COREMODEL_GPIO, name, 0, pinname, func, ifpriv, 0);
+    return writev(cm->fd, iov, niov);
 }
-void *coremodel_attach_usbh(void *priv, const char *name, unsigned port, const coremodel_usbh_func_t *func, void *ifpriv, unsigned speed)
+
+static void coremodel_sock_close(struct coremodel *cm)
 {
-    return coremodel_attach_int(priv, COREMODEL_USBH, name, port, NULL, func, ifpriv, speed);
+    if(cm->fd >= 0)
+        close(cm->fd);
+    cm->fd = -1;
 }
-void *coremodel_attach_can(void *priv, const char *name, const coremodel_can_func_t *func, void *ifpriv)
+
+static const struct coremodel_xport coremodel_xport_sock = {
+    .read = coremodel_sock_read,
+    .writev = coremodel_sock_writev,
+    .close = coremodel_sock_close,
+};
+
+static size_t coremodel_lbq_put(struct coremodel_lbq *q, const void *buf, size_t len)
 {
-    return coremodel_attach_int(priv, COREMODEL_CAN, name, 0, NULL, func, ifpriv, 0);
+    uint32_t offs = q->wp & (LOOPBACK_BUF - 1), step;
+
+    if(len > LOOPBACK_BUF - (q->wp - q->rp))
+        len = LOOPBACK_BUF - (q->wp - q->rp);
+    step = LOOPBACK_BUF - offs;
+    if(step > len)
+        step = len;
+    memcpy(q->buf + offs, buf, step);
+    memcpy(q->buf, (const uint8_t *)buf + step, len - step);
+    q->wp += len;
+    return len;
 }
-void *coremodel_attach_eth(void *priv, const char *name, const coremodel_eth_func_t *func, void *ifpriv)
+
+static size_t coremodel_lbq_get(struct coremodel_lbq *q, void *buf, size_t len)
 {
-    return coremodel_attach_int(priv, COREMODEL_ETH, name, 0, NULL, func, ifpriv, 0);
+    uint32_t offs = q->rp & (LOOPBACK_BUF - 1), step;
+
+    if(len > q->wp - q->rp)
+        len = q->wp - q->rp;
+    step = LOOPBACK_BUF - offs;
+    if(step > len)
+        step = len;
+    memcpy(buf, q->buf + offs, step);
+    memcpy((uint8_t *)buf + step, q->buf, len - step);
+    q->rp += len;
+    return len;
 }
-void *coremodel_attach_event_name(void *priv, const char *evtname, const coremodel_event_func_t *func, void *ifpriv)
+
+static ssize_t coremodel_lb_read(struct coremodel *cm, void *buf, size_t len)
 {
-    return coremodel_attach_int(priv, COREMODEL_EVENT, "event", 0, evtname, func, ifpriv, 0);
+    struct coremodel_loopback *lb = cm->lb;
+    size_t res;
+    unsigned open;
+
+    pthread_mutex_lock(&lb->lock);
+    res = coremodel_lbq_get(&lb->down, buf, len);
+    open = lb->peer_open;
+    pthread_mutex_unlock(&lb->lock);
+
+    if(res || !open)
+        return res;
+    errno = EAGAIN;
+    return -1;
 }
 
-static void coremodel_ready_int(void *handle)
+static ssize_t coremodel_lb_writev(struct coremodel *cm, const struct iovec *iov, int niov)
 {
-    struct coremodel_if *cif = handle;
-
-    if(cif) {
-        cif->busy = 0;
-        coremodel_advance_if(cif);
+    struct coremodel_loopback *lb = cm->lb;
+    size_t res = 0, step;
+    int idx;
+
+    pthread_mutex_lock(&lb->lock);
+    if(!lb->peer_open) {
+        pthread_mutex_unlock(&lb->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    for(idx=0; idx<niov; idx++) {
+        step = coremodel_lbq_put(&lb->up, iov[idx].iov_base, iov[idx].iov_len);
+        res += step;
+        if(step < iov[idx].iov_len)
+            break;
     }
+    pthread_mutex_unlock(&lb->lock);
+
+    if(res)
+        return res;
+    errno = EAGAIN;
+    return -1;
 }
 
-static int coremodel_advance_if_uart(struct coremodel_if *cif, struct coremodel_packet *pkt)
+static unsigned coremodel_lb_room(struct coremodel *cm)
 {
-    int res;
+    struct coremodel_loopback *lb = cm->lb;
+    unsigned res;
 
-    switch(pkt->pkt) {
-    case PKT_UART_TX:
-        if(cif->busy)
-            return 1;
-        if(cif->uartf->tx)
-            res = cif->uartf->tx(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
-        else
-            res = (pkt->len - 8) - cif->offs;
-        if(!res) {
-            cif->busy = 1;
-            break;
-        }
-        cif->offs += res;
-        if(cif->offs < pkt->len - 8)
-            return 1;
-        cif->offs = 0;
-        return 0;
+    pthread_mutex_lock(&lb->lock);
+    res = LOOPBACK_BUF - (lb->up.wp - lb->up.rp);
+    pthread_mutex_unlock(&lb->lock);
+    return res;
+}
 
-    case PKT_UART_RX_ACK:
-        if(!cif->cred) {
-            cif->cred += pkt->hflag;
-            if(cif->uartf->rxrdy)
-                cif->uartf->rxrdy(cif->priv);
-        } else
-            cif->cred += pkt->hflag;
-        return 0;
+static void coremodel_lb_release(struct coremodel_loopback *lb)
+{
+    pthread_mutex_destroy(&lb->lock);
+    free(lb);
+}
 
-    case PKT_UART_BRK:
-        if(cif->uartf->brk)
-            cif->uartf->brk(cif->priv);
-        return 0;
-    }
+static void coremodel_lb_close(struct coremodel *cm)
+{
+    struct coremodel_loopback *lb = cm->lb;
+    unsigned peer_open;
 
-    return 0;
+    if(!lb)
+        return;
+    pthread_mutex_lock(&lb->lock);
+    lb->cm = NULL;
+    peer_open = lb->peer_open;
+    pthread_mutex_unlock(&lb->lock);
+
+    if(!peer_open)
+        coremodel_lb_release(lb);
+    cm->lb = NULL;
 }
 
-int coremodel_uart_rx(void *uart, unsigned len, uint8_t *data)
+static const struct coremodel_xport coremodel_xport_loopback = {
+    .read = coremodel_lb_read,
+    .writev = coremodel_lb_writev,
+    .close = coremodel_lb_close,
+};
+
+int coremodel_connect_loopback(void **priv, void **peer, const coremodel_connect_opts_t *opts)
 {
-    struct coremodel_if *cif = uart;
-    struct coremodel_packet pkt = { .pkt = PKT_UART_RX };
+    static const coremodel_connect_opts_t dflt_opts = { 0 };
     struct coremodel *cm;
+    struct coremodel_loopback *lb;
 
-    if(!cif)
-        return 0;
-    cm = cif->cm;
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    if(!cif->cred) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return 0;
-    }
-    if(len > cif->cred)
-        len = cif->cred;
+    if(!opts)
+        opts = &dflt_opts;
 
-    pkt.len = 8 + len;
-    pkt.conn = cif->conn;
+    lb = calloc(1, sizeof(*lb));
+    if(!lb) {
+        fprintf(stderr, "[coremodel] Memory allocation error.\n");
+        errno = ENOMEM;
+        return -errno;
+    }
+    if(pthread_mutex_init(&lb->lock, NULL)) {
+        free(lb);
+        errno = ENOMEM;
+        return -errno;
+    }
 
-    if(coremodel_push_packet(cif->cm, &pkt, data)) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return 0;
+    cm = coremodel_create(opts);
+    if(!cm) {
+        coremodel_lb_release(lb);
+        return -errno;
     }
 
-    cif->cred -= len;
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return len;
+    /* There is no target to connect to again */
+    cm->opts = *opts;
+    cm->opts.reconnect_ms = 0;
+
+    lb->cm = cm;
+    lb->peer_open = 1;
+    cm->lb = lb;
+    cm->xport = &coremodel_xport_loopback;
+
+    *priv = cm;
+    *peer = lb;
+    return 0;
 }
 
-void coremodel_uart_txrdy(void *uart)
+int coremodel_loopback_read(void *peer, void *buf, unsigned len)
 {
-    struct coremodel_if *cif = uart;
-    struct coremodel *cm = cif->cm;
+    struct coremodel_loopback *lb = peer;
+    int res;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    coremodel_ready_int(uart);
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    pthread_mutex_lock(&lb->lock);
+    res = coremodel_lbq_get(&lb->up, buf, len);
+    if(!res && !lb->cm)
+        res = -ECONNRESET;
+    else if(res && lb->cm)
+        coremodel_wake(lb->cm);
+    pthread_mutex_unlock(&lb->lock);
+    return res;
 }
 
-static int coremodel_advance_if_i2c(struct coremodel_if *cif, struct coremodel_packet *pkt)
+int coremodel_loopback_write(void *peer, const void *buf, unsigned len)
 {
-    struct coremodel_packet npkt = { .len = 8, .conn = cif->conn, .pkt = PKT_I2C_DONE };
+    struct coremodel_loopback *lb = peer;
     int res;
 
-    if(cif->busy)
-        return 1;
-    cif->trnidx = pkt->hflag;
-    npkt.hflag = cif->trnidx;
+    pthread_mutex_lock(&lb->lock);
+    if(lb->cm) {
+        res = coremodel_lbq_put(&lb->down, buf, len);
+        if(res)
+            coremodel_wake(lb->cm);
+    } else
+        res = -ECONNRESET;
+    pthread_mutex_unlock(&lb->lock);
+    return res;
+}
 
-    switch(pkt->pkt) {
-    case PKT_I2C_START:
-        if(cif->i2cf->start)
-            res = cif->i2cf->start(cif->priv);
-        else
-            res = 1;
-        if(res == 0) {
-            cif->busy = 1;
-            return 1;
-        }
-        if(pkt->bflag & 1) {
-            npkt.bflag = (res < 0) ? 1 : 0;
-            coremodel_push_packet(cif->cm, &npkt, NULL);
-        }
-        return 0;
+void coremodel_loopback_close(void *peer)
+{
+    struct coremodel_loopback *lb = peer;
+    struct coremodel *cm;
 
-    case PKT_I2C_WRITE:
-        if(cif->i2cf->write)
-            res = cif->i2cf->write(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
-        else
-            res = -1;
-        if(res == 0) {
-            cif->busy = 1;
-            return 1;
-        }
-        if(res < 0) {
-            if(pkt->bflag & 1) {
-                npkt.bflag = 1;
-                coremodel_push_packet(cif->cm, &npkt, NULL);
-            }
-            return 0;
-        }
-        cif->offs += res;
-        if(cif->offs < pkt->len - 8)
-            return 1;
-        cif->offs = 0;
-        if(pkt->bflag & 1)
-            coremodel_push_packet(cif->cm, &npkt, NULL);
-        return 0;
+    pthread_mutex_lock(&lb->lock);
+    lb->peer_open = 0;
+    cm = lb->cm;
+    if(cm)
+        coremodel_wake(cm);
+    pthread_mutex_unlock(&lb->lock);
 
-    case PKT_I2C_READ:
-        if(cif->i2cf->read)
-            res = cif->i2cf->read(cif->priv, pkt->bflag - cif->offs, cif->rdbuf + cif->offs);
-        else
-            res = pkt->bflag - cif->offs;
-        if(res == 0) {
-            cif->busy = 1;
-            return 1;
+    if(!cm)
+        coremodel_lb_release(lb);
+}
+
+int coremodel_connect_ex(void **priv, const char *target, const coremodel_connect_opts_t *opts)
+{
+    static const coremodel_connect_opts_t dflt_opts = { 0 };
+    struct coremodel *cm = NULL;
+    struct pollfd pfd = { .events = POLLOUT };
+    long long tmo;
+    int res;
+
+    if(!opts)
+        opts = &dflt_opts;
+
+    cm = coremodel_create(opts);
+    if(!cm)
+        goto err_entry;
+
+    if(!target)
+        target = getenv("COREMODEL_VM");
+    if(!target) {
+        fprintf(stderr, "[coremodel] Set environment variable COREMODEL_VM to the address:port of the Corellium VM and try again.\n");
+        errno = EINVAL;
+        goto err_cm;
+    }
+
+    cm->opts = *opts;
+    coremodel_sockopts_getenv(&cm->opts.sock);
+    cm->target = strdup(target);
+    if(!cm->target) {
+        fprintf(stderr, "[coremodel] Memory allocation error.\n");
+        errno = ENOMEM;
+        goto err_cm;
+    }
+
+#ifdef __linux__
+    if(opts->reconnect_ms || opts->timeout_ms) {
+        cm->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(cm->timer_fd < 0) {
+            fprintf(stderr, "[coremodel] Failed to create connection timer: %s.\n", strerror(errno));
+            goto err_str;
         }
-        cif->offs += res;
-        if(cif->offs < pkt->bflag)
-            return 1;
-        cif->offs = 0;
-        npkt.len = 8 + pkt->bflag;
-        coremodel_push_packet(cif->cm, &npkt, cif->rdbuf);
-        return 0;
+    }
+#endif
 
-    case PKT_I2C_STOP:
-        if(cif->i2cf->stop)
-            cif->i2cf->stop(cif->priv);
-        return 0;
+    res = coremodel_resolve(cm);
+    if(res) {
+        fprintf(stderr, "[coremodel] Failed to resolve %s: %s.\n", target, gai_strerror(res));
+        errno = ENOENT;
+        goto err_timer;
     }
 
+    res = coremodel_connect_next(cm, ENOENT);
+    if(res > 0 && cm->conn_deadline)
+        coremodel_timer_arm(cm, cm->conn_deadline);
+    while(res > 0 && !opts->nonblock) {
+        pfd.fd = cm->fd;
+        tmo = coremodel_connect_wait(cm, -1);
+        if(poll(&pfd, 1, tmo >= 0 ? (tmo + 999) / 1000 : -1) < 0 && errno != EINTR) {
+            res = -errno;
+            break;
+        }
+        res = coremodel_connect_poll(cm, !!pfd.revents);
+        pfd.revents = 0;
+    }
+    if(res < 0) {
+        fprintf(stderr, "[coremodel] Failed to connect to %s: %s.\n", target, strerror(-res));
+        errno = -res;
+        goto err_socket;
+    }
+
+    *priv = cm;
     return 0;
+
+err_socket:
+    if(cm->fd >= 0)
+        close(cm->fd);
+    cm->fd = -1;
+    coremodel_free_ai(cm);
+err_timer:
+    if(cm->timer_fd >= 0)
+        close(cm->timer_fd);
+err_str:
+    free(cm->target);
+err_cm:
+    coremodel_destroy(cm);
+err_entry:
+    return -errno;
 }
 
-int coremodel_i2c_push_read(void *i2c, unsigned len, uint8_t *data)
+static void coremodel_wake_close(struct coremodel *cm)
 {
-    struct coremodel_if *cif = i2c;
-    struct coremodel_packet pkt = { .pkt = PKT_I2C_DONE };
-    struct coremodel *cm;
+    close(cm->coremodel_wake_fd[0]);
+    if(cm->coremodel_wake_fd[1] != cm->coremodel_wake_fd[0])
+        close(cm->coremodel_wake_fd[1]);
+    cm->coremodel_wake_fd[0] = cm->coremodel_wake_fd[1] = -1;
+}
 
-    if(!cif)
-        return 0;
-    cm = cif->cm;
+/* Signal the wake fd, unless a wake is already pending that the loop has not
+ * picked up yet; it will see everything queued up to now anyway. May be
+ * called from any thread. */
+static void coremodel_wake(struct coremodel *cm)
+{
+#ifdef __linux__
+    uint64_t wake = 1;
+#else
+    char wake = 0;
+#endif
+    int res;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    if(len > 255)
-        len = 255;
-    pkt.len = 8 + len;
-    pkt.conn = cif->conn;
-    pkt.hflag = cif->trnidx;
+    if(__atomic_exchange_n(&cm->wake_pending, 1, __ATOMIC_ACQ_REL)) {
+        __atomic_fetch_add(&cm->stats.wakes_elided, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&cm->stats.wakes, 1, __ATOMIC_RELAXED);
 
-    if(coremodel_push_packet(cif->cm, &pkt, data)) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return 0;
+    while(1) {
+        res = write(cm->coremodel_wake_fd[1], &wake, sizeof(wake));
+        if(res >= 0 || errno != EINTR)
+            break;
     }
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return len;
 }
 
-void coremodel_i2c_ready(void *i2c)
+/* Whether a callback is running on a thread other than the calling one; must
+ * be called with coremodel_mutex held. */
+static int coremodel_cb_other(struct coremodel *cm)
 {
-    struct coremodel_if *cif = i2c;
-    struct coremodel *cm = cif->cm;
+    return cm->cb_depth && !pthread_equal(cm->cb_owner, pthread_self());
+}
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    coremodel_ready_int(i2c);
+/* Bracket a model callback: the mutex is dropped for its duration, and other
+ * threads keep away from receive state until it returns. With the mutex held
+ * more than once, as while an attach waits for its answer, the callback runs
+ * with it still held. */
+static void coremodel_cb_enter(struct coremodel *cm)
+{
+    if(!cm->cb_depth++)
+        cm->cb_owner = pthread_self();
     pthread_mutex_unlock(&cm->coremodel_mutex);
 }
 
-static int coremodel_advance_if_spi(struct coremodel_if *cif, struct coremodel_packet *pkt)
+static void coremodel_cb_exit(struct coremodel *cm)
 {
-    int res;
-    struct coremodel_packet npkt = { .pkt = PKT_SPI_RX };
-
-    switch(pkt->pkt) {
-    case PKT_SPI_CS:
-        if(cif->spif->cs)
-            cif->spif->cs(cif->priv, pkt->bflag & 1);
-        return 0;
-    case PKT_SPI_TX:
-        if(cif->busy)
-            return 1;
-        cif->trnidx = pkt->hflag;
-        res = (pkt->len - 8) - cif->offs;
-        if(res > 256)
-            res = 256;
-        if(cif->spif->xfr)
-            res = cif->spif->xfr(cif->priv, res, pkt->data + cif->offs, cif->rdbuf + cif->offs);
-        if(!res) {
-            cif->busy = 1;
-            return 1;
-        }
-        cif->offs += res;
-        if(cif->offs < pkt->len - 8)
-            return 1;
-        cif->offs = 0;
-        npkt.len = pkt->len;
-        npkt.conn = cif->conn;
-        npkt.hflag = cif->trnidx;
-        coremodel_push_packet(cif->cm, &npkt, cif->rdbuf);
-        return 0;
-    }
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    if(!--cm->cb_depth)
+        pthread_cond_broadcast(&cm->cb_cond);
+}
 
-    return 0;
+/* Wait until no callback runs on another thread, before dispatching or
+ * freeing anything a callback may be using; must be called with
+ * coremodel_mutex held once. */
+static void coremodel_cb_wait(struct coremodel *cm)
+{
+    while(coremodel_cb_other(cm))
+        pthread_cond_wait(&cm->cb_cond, &cm->coremodel_mutex);
 }
 
-void coremodel_spi_ready(void *spi)
+static void coremodel_fill_pkt(uint8_t *buf, struct coremodel_packet *pkt, void *data)
 {
-    struct coremodel_if *cif = spi;
-    struct coremodel *cm = cif->cm;
+    unsigned len = pkt->len, dlen = (len + 3) & ~3;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    coremodel_ready_int(spi);
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    memset(buf + len, 0, dlen - len);
+    if(data) {
+        memcpy(buf, pkt, 8);
+        memcpy(buf + 8, data, len - 8);
+    } else
+        memcpy(buf, pkt, len);
 }
 
-static int coremodel_advance_if_gpio(struct coremodel_if *cif, struct coremodel_packet *pkt)
+static void coremodel_fill_txbuf(struct coremodel_txbuf *txb, struct coremodel_packet *pkt, void *data)
 {
-    switch(pkt->pkt) {
-    case PKT_GPIO_UPDATE:
-        if(cif->gpiof->notify)
-            cif->gpiof->notify(cif->priv, (int16_t)pkt->hflag);
-        return 0;
-    }
-    return 0;
+    txb->next = NULL;
+    txb->size = (pkt->len + 3) & ~3;
+    txb->rptr = 0;
+    coremodel_fill_pkt(txb->buf, pkt, data);
 }
 
-void coremodel_gpio_set(void *pin, unsigned drven, int mvolt)
+/* Account for a packet entering the transmit queue or the submission stack.
+ * May be called from any thread. */
+static void coremodel_tx_count(struct coremodel *cm, struct coremodel_txbuf *txb)
 {
-    struct coremodel_if *cif = pin;
-    struct coremodel_packet pkt = { .len = 8, .pkt = PKT_GPIO_FORCE };
-    struct coremodel *cm;
-
-    if(!cif)
-        return;
-    cm = cif->cm;
+    __atomic_fetch_add(&cm->tx_qbytes, txb->size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cm->tx_qpkts, 1, __ATOMIC_RELAXED);
+}
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    pkt.conn = cif->conn;
-    pkt.bflag = !!drven;
-    pkt.hflag = mvolt;
+/* Whether a producer packet of size bytes would take the transmit queue past
+ * its limits. A packet is never refused by the byte limit when the queue is
+ * empty, so one larger than the limit is still sent. */
+static int coremodel_tx_over(struct coremodel *cm, unsigned size)
+{
+    unsigned bytes = __atomic_load_n(&cm->tx_qbytes, __ATOMIC_RELAXED);
 
-    coremodel_push_packet(cif->cm, &pkt, NULL);
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    if(cm->opts.tx_limit && bytes && bytes + size > cm->opts.tx_limit)
+        return 1;
+    if(cm->opts.tx_limit_packets && __atomic_load_n(&cm->tx_qpkts, __ATOMIC_RELAXED) >= cm->opts.tx_limit_packets)
+        return 1;
+    return 0;
 }
 
-static int coremodel_advance_if_usbh(struct coremodel_if *cif, struct coremodel_packet *pkt)
+/* Check a producer packet of size bytes against the transmit queue limits.
+ * A refusal is recorded with the mutex held, so that it cannot miss the queue
+ * draining at the same time; writable is then called once the queue is down
+ * to its low watermarks. May be called from any thread.
+ * Returns 0 if the packet may be queued, 1 if the queue is full.
+ */
+static int coremodel_tx_full(struct coremodel *cm, unsigned size)
 {
-    struct coremodel_packet npkt = { .pkt = PKT_USBH_DONE };
-    uint8_t dev, ep, tkn, end;
-    uint16_t size;
     int res;
 
-    switch(pkt->pkt) {
-    case PKT_USBH_RESET:
-        if(!cif->busy) {
-            cif->busy = 1;
-            return -2;
-        }
-        cif->busy = 0;
-        cif->ebusy = 0;
-        if(cif->usbhf->rst)
-            cif->usbhf->rst(cif->priv);
+    if(!coremodel_tx_over(cm, size))
         return 0;
 
-    case PKT_USBH_XFR:
-        if(cif->busy)
-            return 0;
-        ep = (pkt->hflag >> 4) & 15;
-        tkn = pkt->hflag & 15;
-        if(tkn == USB_TKN_SETUP)
-            cif->ebusy &= ~(1ul << (ep * 4 + tkn));
-        if(cif->ebusy & (1ul << (ep * 4 + tkn)))
-            return -1;
-        dev = (pkt->hflag >> 8) & 127;
-        end = pkt->hflag >> 15;
-        if(cif->usbhf->xfr) {
-            if(tkn == USB_TKN_IN) {
-                if(pkt->len < 10)
-                    return 0;
-                size = *(uint16_t *)pkt->data;
-                if(size > sizeof(cif->rdbuf))
-                    size = sizeof(cif->rdbuf);
-                res = cif->usbhf->xfr(cif->priv, dev, ep, tkn, cif->rdbuf, size, end);
-            } else
-                res = cif->usbhf->xfr(cif->priv, dev, ep, tkn, pkt->data, pkt->len - 8, end);
-        } else
-            res = USB_XFR_NAK;
-        if(tkn == USB_TKN_SETUP)
-            return 0;
-        if(res == USB_XFR_NAK) {
-            cif->ebusy |= 1ul << (ep * 4 + tkn);
-            return -1;
-        }
-        npkt.conn = cif->conn;
-        npkt.bflag = pkt->bflag;
-        npkt.hflag = tkn | (ep << 4) | (dev << 8);
-        if(res < 0) {
-            npkt.len = (tkn == USB_TKN_IN) ? 8 : 10;
-            npkt.hflag |= 0x8000;
-            size = 0;
-            coremodel_push_packet(cif->cm, &npkt, &size);
-        } else {
-            if(tkn == USB_TKN_IN) {
-                npkt.len = 8 + res;
-                coremodel_push_packet(cif->cm, &npkt, cif->rdbuf);
-            } else {
-                npkt.len = 10;
-                size = res;
-                coremodel_push_packet(cif->cm, &npkt, &size);
-            }
-        }
-        return 0;
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    res = coremodel_tx_over(cm, size);
+    if(res) {
+        cm->tx_blocked = 1;
+        cm->stats.tx_full ++;
     }
-    return 0;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
 }
 
-void coremodel_usbh_ready(void *usb, uint8_t ep, uint8_t tkn)
+/* Free a packet that left the transmit queue; must be called with
+ * coremodel_mutex held, followed by coremodel_tx_drained. */
+static void coremodel_tx_free(struct coremodel *cm, struct coremodel_txbuf *txb)
 {
-    struct coremodel_if *cif = usb;
-    struct coremodel *cm = cif->cm;
+    __atomic_fetch_sub(&cm->tx_qbytes, txb->size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&cm->tx_qpkts, 1, __ATOMIC_RELAXED);
+    coremodel_buf_free(cm, txb);
+}
 
-    if(cif) {
-        pthread_mutex_lock(&cm->coremodel_mutex);
-        cif->ebusy &= ~(1ul << (ep * 4 + tkn));
-        coremodel_advance_if(cif);
-        pthread_mutex_unlock(&cm->coremodel_mutex);
+/* After packets left the transmit queue, make writable due if a producer was
+ * refused and the queue is down to both low watermarks, which default to half
+ * the limits. The loop makes the call once it is outside any callback; must
+ * be called with coremodel_mutex held. */
+static void coremodel_tx_drained(struct coremodel *cm)
+{
+    unsigned low = cm->opts.tx_low ? cm->opts.tx_low : cm->opts.tx_limit / 2;
+    unsigned lowp = cm->opts.tx_low_packets ? cm->opts.tx_low_packets : cm->opts.tx_limit_packets / 2;
+
+    if(!cm->tx_blocked)
+        return;
+    if(cm->opts.tx_limit && __atomic_load_n(&cm->tx_qbytes, __ATOMIC_RELAXED) > low)
+        return;
+    if(cm->opts.tx_limit_packets && __atomic_load_n(&cm->tx_qpkts, __ATOMIC_RELAXED) > lowp)
+        return;
+    cm->tx_blocked = 0;
+    cm->tx_wrpend = 1;
+    if(cm->cb_depth)
+        coremodel_wake(cm);
+}
+
+/* Call writable if it is due; must be called with coremodel_mutex held. */
+static void coremodel_tx_writable(struct coremodel *cm)
+{
+    if(!cm->tx_wrpend || cm->cb_depth)
+        return;
+    cm->tx_wrpend = 0;
+    if(cm->opts.writable) {
+        coremodel_cb_enter(cm);
+        cm->opts.writable(cm->opts.writable_priv);
+        coremodel_cb_exit(cm);
     }
 }
 
-static const unsigned coremodel_can_datalen[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+static void coremodel_queue_txbuf(struct coremodel *cm, struct coremodel_txbuf *txb)
+{
+    unsigned bytes;
 
-static int coremodel_advance_if_can(struct coremodel_if *cif, struct coremodel_packet *pkt)
+    *cm->etxbufs = txb;
+    cm->etxbufs = &txb->next;
+    cm->stats.tx_packets ++;
+    bytes = __atomic_load_n(&cm->tx_qbytes, __ATOMIC_RELAXED);
+    if(bytes > cm->stats.tx_queued_max)
+        cm->stats.tx_queued_max = bytes;
+    if(cm->txbufs == txb)
+        coremodel_epoll_update(cm);
+    if(cm->coremodel_need_wake)
+        coremodel_wake(cm);
+}
+
+/* Queue the packets staged by a batch as a single buffer; must be called with
+ * coremodel_mutex held. */
+static void coremodel_batch_queue(struct coremodel *cm)
 {
-    int res;
-    struct coremodel_packet npkt = { .len = 8, .pkt = PKT_CAN_TX_ACK };
-    void *data;
-    unsigned dlc, dlen;
+    struct coremodel_txbuf *txb = cm->batch;
 
-    switch(pkt->pkt) {
+    if(!txb)
+        return;
+    cm->batch = NULL;
+    coremodel_tx_count(cm, txb);
+    cm->txflag = 1;
+    coremodel_queue_txbuf(cm, txb);
+    cm->stats.tx_packets += cm->batch_pkts - 1;
+    cm->stats.tx_batches ++;
+    cm->batch_pkts = 0;
+
+    if(coremodel_cb_other(cm))
+        coremodel_flush_producer(cm);
+}
+
+/* Stage a packet in the open batch, starting another buffer when it is full. */
+static int coremodel_batch_push(struct coremodel *cm, struct coremodel_packet *pkt, void *data)
+{
+    unsigned dlen = (pkt->len + 3) & ~3;
+    struct coremodel_txbuf *txb;
+
+    if(cm->batch && cm->batch->size + dlen > BATCH_BUF)
+        coremodel_batch_queue(cm);
+    if(!cm->batch) {
+        txb = coremodel_buf_alloc(cm, sizeof(struct coremodel_txbuf) + BATCH_BUF);
+        if(!txb)
+            return 1;
+        txb->next = NULL;
+        txb->size = 0;
+        txb->rptr = 0;
+        cm->batch = txb;
+    }
+    coremodel_fill_pkt(cm->batch->buf + cm->batch->size, pkt, data);
+    cm->batch->size += dlen;
+    cm->batch_pkts ++;
+    return 0;
+}
+
+/* Write-through mode: with nothing queued ahead of it, write a packet to the
+ * socket straight from the caller's buffers, without waiting for the loop.
+ * An error is left for the loop to run into when it writes the packet again;
+ * must be called with coremodel_mutex held.
+ * Returns the number of bytes written, and the rest is to be queued.
+ */
+static unsigned coremodel_write_through(struct coremodel *cm, struct coremodel_packet *pkt, void *data, unsigned dlen)
+{
+    static const uint8_t pad[4];
+    struct iovec iov[3];
+    unsigned len = pkt->len;
+    int niov = 0;
+    ssize_t res;
+
+    if(!cm->opts.write_through)
+        return 0;
+    /* Packets submitted while another thread held the mutex, possibly by this
+     * one, go ahead of it */
+    coremodel_drain_submit(cm);
+    if(cm->txbufs || cm->tx_err || cm->connecting || (cm->fd < 0 && !cm->lb))
+        return 0;
+
+    if(data) {
+        iov[niov].iov_base = pkt;
+        iov[niov++].iov_len = 8;
+        iov[niov].iov_base = data;
+        iov[niov++].iov_len = len - 8;
+    } else {
+        iov[niov].iov_base = pkt;
+        iov[niov++].iov_len = len;
+    }
+    if(dlen > len) {
+        iov[niov].iov_base = (void *)pad;
+        iov[niov++].iov_len = dlen - len;
+    }
+
+    do
+        res = cm->xport->writev(cm, iov, niov);
+    while(res < 0 && errno == EINTR);
+    if(res <= 0)
+        return 0;
+    cm->stats.tx_writes ++;
+    return res;
+}
+
+static int coremodel_push_packet(void *priv, struct coremodel_packet *pkt, void *data)
+{
+    struct coremodel *cm = priv;
+    unsigned dlen = (pkt->len + 3) & ~3, done;
+    struct coremodel_txbuf *txb;
+
+    /* The mutex is held for a batch, so this is the thread that opened it; a
+     * packet too large to stage follows what was staged before it */
+    if(cm->batch_depth) {
+        if(dlen <= BATCH_BUF)
+            return coremodel_batch_push(cm, pkt, data);
+        coremodel_batch_queue(cm);
+    }
+
+    done = coremodel_write_through(cm, pkt, data, dlen);
+    if(done == dlen) {
+        cm->stats.tx_packets ++;
+        cm->stats.tx_direct ++;
+        return 0;
+    }
+
+    txb = coremodel_buf_alloc(cm, sizeof(struct coremodel_txbuf) + dlen);
+    if(!txb)
+        return 1;
+    coremodel_fill_txbuf(txb, pkt, data);
+    txb->rptr = done;
+    coremodel_tx_count(cm, txb);
+    cm->txflag = 1;
+    coremodel_queue_txbuf(cm, txb);
+
+    /* The thread that would send it is stuck in a callback */
+    if(coremodel_cb_other(cm))
+        coremodel_flush_producer(cm);
+    return 0;
+}
+
+static void coremodel_discard_tx(struct coremodel *cm)
+{
+    struct coremodel_txbuf *txb;
+
+    while(cm->txbufs) {
+        txb = cm->txbufs;
+        cm->txbufs = txb->next;
+        coremodel_tx_free(cm, txb);
+    }
+    cm->etxbufs = &cm->txbufs;
+    coremodel_tx_drained(cm);
+}
+
+static void coremodel_free_rx(struct coremodel *cm, struct coremodel_if *cif)
+{
+    struct coremodel_rxbuf *rxb;
+
+    while(cif->rxbufs) {
+        rxb = cif->rxbufs;
+        cif->rxbufs = rxb->next;
+        coremodel_buf_free(cm, rxb);
+    }
+    cif->erxbufs = cif->rxscan = &cif->rxbufs;
+    if(cif->type == COREMODEL_SPI && cif->xfrbuf) {
+        coremodel_buf_free(cm, cif->xfrbuf);
+        cif->xfrbuf = NULL;
+    }
+    /* Queued CAN frames would be answered by the old connection */
+    if(cif->type == COREMODEL_CAN && cif->rxring)
+        while(cif->rxring->num) {
+            coremodel_buf_free(cm, cif->rxring->pkt[cif->rxring->head]);
+            cif->rxring->head = (cif->rxring->head + 1) % cif->rxring->depth;
+            cif->rxring->num --;
+        }
+}
+
+/* Queue a packet from an interface API. Nothing is sent for an interface
+ * without a connection, as while it is being re-attached after a reconnect. */
+static int coremodel_push_if(struct coremodel_if *cif, struct coremodel_packet *pkt, void *data)
+{
+    if(cif->conn == CONN_QUERY)
+        return 1;
+    return coremodel_push_packet(cif->cm, pkt, data);
+}
+
+/* Move packets submitted by other threads to the transmit queue. Called with
+ * the mutex held, which makes the caller the only consumer of the stack. */
+static void coremodel_drain_submit(struct coremodel *cm)
+{
+    struct coremodel_txbuf *txb, *next, *fifo = NULL;
+
+    if(!__atomic_load_n(&cm->subq, __ATOMIC_RELAXED))
+        return;
+    txb = __atomic_exchange_n(&cm->subq, NULL, __ATOMIC_ACQUIRE);
+
+    /* The stack is newest first; reverse it to keep submission order */
+    while(txb) {
+        next = txb->next;
+        txb->next = fifo;
+        fifo = txb;
+        txb = next;
+    }
+
+    while(fifo) {
+        next = fifo->next;
+        fifo->next = NULL;
+        coremodel_queue_txbuf(cm, fifo);
+        cm->stats.tx_submitted ++;
+        fifo = next;
+    }
+}
+
+/* Queue a packet from a producer API on any thread. If the mutex is free, or
+ * already held by this thread, the packet is queued in place; otherwise it is
+ * pushed on the submission stack without blocking, and the loop thread is
+ * woken when the stack goes from empty to non-empty. A packet that does not
+ * fit in the transmit queue limits is refused. */
+static int coremodel_submit_packet(struct coremodel *cm, struct coremodel_packet *pkt, void *data)
+{
+    struct coremodel_txbuf *txb, *head;
+    int res;
+
+    if(pkt->conn == CONN_QUERY)
+        return 1;
+    if(coremodel_tx_full(cm, (pkt->len + 3) & ~3))
+        return 1;
+
+    if(!pthread_mutex_trylock(&cm->coremodel_mutex)) {
+        coremodel_drain_submit(cm);
+        res = coremodel_push_packet(cm, pkt, data);
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return res;
+    }
+
+    txb = coremodel_buf_malloc(sizeof(struct coremodel_txbuf) + ((pkt->len + 3) & ~3));
+    if(!txb)
+        return 1;
+    coremodel_fill_txbuf(txb, pkt, data);
+    coremodel_tx_count(cm, txb);
+
+    head = __atomic_load_n(&cm->subq, __ATOMIC_RELAXED);
+    do
+        txb->next = head;
+    while(!__atomic_compare_exchange_n(&cm->subq, &head, txb, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(!head)
+        coremodel_wake(cm);
+    return 0;
+}
+
+coremodel_device_list_t *coremodel_list(void *priv)
+{
+    struct coremodel *cm = priv;
+    struct coremodel_packet pkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_LIST };
+    coremodel_device_list_t *res;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    if(cm->query || cm->down_since) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return NULL;
+    }
+    if(coremodel_push_packet(cm, &pkt, NULL)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return NULL;
+    }
+    cm->query = 1;
+
+    if(coremodel_mainloop_int(cm, -1, 1)) {
+        coremodel_free_list(cm->device_list);
+        cm->device_list = NULL;
+        cm->query = 0;
+    }
+
+    res = cm->device_list;
+    cm->device_list = NULL;
+    cm->device_list_size = 0;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+
+    return res;
+}
+
+coremodel_device_list_t *coremodel_list_subdevices(void *priv, int type, const char *name)
+{
+    struct coremodel *cm = priv;
+    unsigned nlen = strlen(name);
+    struct coremodel_packet *pkt;
+    coremodel_device_list_t *res;
+
+    pkt = alloca(sizeof(*pkt) + 4 + nlen);
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->len = 12 + nlen;
+    pkt->conn = CONN_QUERY;
+    pkt->pkt = PKT_QUERY_REQ_LIST;
+    pkt->hflag = 0x8000;
+    *(uint16_t *)pkt->data = type;
+    *(uint16_t *)(pkt->data + 2) = nlen;
+    memcpy(pkt->data + 4, name, nlen);
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    if(cm->query || cm->down_since) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return NULL;
+    }
+    if(coremodel_push_packet(cm, pkt, NULL)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return NULL;
+    }
+    cm->query = 1;
+    cm->device_list_pkt = pkt;
+
+    if(coremodel_mainloop_int(cm, -1, 1)) {
+        coremodel_free_list(cm->device_list);
+        cm->device_list = NULL;
+        cm->query = 0;
+    }
+
+    res = cm->device_list;
+    cm->device_list = NULL;
+    cm->device_list_size = 0;
+    cm->device_list_pkt = NULL;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+
+    return res;
+}
+
+void coremodel_free_list(coremodel_device_list_t *list)
+{
+    unsigned idx;
+
+    if(!list)
+        return;
+
+    for(idx=0; list[idx].type!=COREMODEL_INVALID; idx++)
+        free(list[idx].name);
+    free(list);
+}
+
+static int coremodel_process_list_response(void *priv, struct coremodel_packet *pkt)
+{
+    struct coremodel *cm = priv;
+    struct coremodel_packet npkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_LIST };
+    unsigned offs, len, step, num, base;
+    uint8_t *ptr;
+    void *prev;
+
+    if(pkt->len == 8) {
+        cm->query = 0;
+        return 0;
+    }
+
+    len = pkt->len - 8;
+    base = pkt->hflag & 0x7FFF;
+    for(offs=0,num=base; offs<len; offs+=step,num++) {
+        ptr = pkt->data + offs;
+        step = (11 + *(uint16_t *)(ptr + 2)) & ~3;
+    }
+
+    prev = cm->device_list;
+    cm->device_list = realloc(prev, sizeof(coremodel_device_list_t) * (num + 1));
+    if(!cm->device_list) {
+        free(prev);
+        cm->query = 0;
+        return 0;
+    }
+    if(cm->device_list_size < num + 1)
+        memset(cm->device_list + cm->device_list_size, 0, sizeof(coremodel_device_list_t) * (num + 1 - cm->device_list_size));
+    cm->device_list_size = num + 1;
+
+    for(offs=0,num=base; offs<len; offs+=step,num++) {
+        ptr = pkt->data + offs;
+        step = *(uint16_t *)(ptr + 2);
+        cm->device_list[num].type = *(uint16_t *)ptr;
+        cm->device_list[num].name = calloc(step + 1, 1);
+        if(!cm->device_list[num].name) {
+            coremodel_free_list(cm->device_list);
+            cm->device_list = NULL;
+            cm->query = 0;
+            return 0;
+        }
+        memcpy(cm->device_list[num].name, ptr + 8, step);
+        cm->device_list[num].num = *(uint32_t *)(ptr + 4);
+        step = (11 + step) & ~3;
+    }
+    cm->device_list[num].type = COREMODEL_INVALID;
+
+    if(cm->device_list_pkt) {
+        cm->device_list_pkt->hflag = num | 0x8000;
+        return coremodel_push_packet(cm, cm->device_list_pkt, NULL);
+    }
+    npkt.hflag = num;
+    return coremodel_push_packet(cm, &npkt, NULL);
+}
+
+/* Queue an interface to be matched with the next unanswered connection
+ * response. */
+static void coremodel_attach_queue(struct coremodel *cm, struct coremodel_if *cif)
+{
+    *cm->econn_if = cif;
+    cm->econn_if = &cif->qnext;
+    cm->query ++;
+}
+
+static int coremodel_attach_queued(struct coremodel *cm, struct coremodel_if *cif)
+{
+    return cif->qnext || cm->econn_if == &cif->qnext;
+}
+
+/* Size of the read buffer an interface of a type needs: an I2C read is at most
+ * 255 bytes, and a USB host IN transfer is returned from rdbuf in one packet.
+ * SPI responses are the size of the packet they answer, and are built in a
+ * packet buffer instead. */
+static unsigned coremodel_if_rdlen(unsigned type)
+{
+    switch(type) {
+    case COREMODEL_I2C:
+        return 256;
+    case COREMODEL_USBH:
+        return 512;
+    }
+    return 0;
+}
+
+/* Send a connection request and queue its interface for the response. Called
+ * with the mutex held; the caller waits with coremodel_attach_wait. */
+static struct coremodel_if *coremodel_attach_send(struct coremodel *cm, unsigned type, const char *name, unsigned addr, const char *subname, const void *func, void *ifpriv, uint16_t flags)
+{
+    struct coremodel_if *cif;
+    struct coremodel_packet *pkt;
+    unsigned nlen = strlen(name), snlen = subname ? strlen(subname) : 0, rdlen;
+
+    rdlen = coremodel_if_rdlen(type);
+    cif = calloc(1, sizeof(struct coremodel_if) + rdlen);
+    if(!cif)
+        return NULL;
+    cif->rdlen = rdlen;
+
+    if(subname) {
+        pkt = alloca(sizeof(*pkt) + 9 + nlen + snlen);
+        memset(pkt, 0, sizeof(*pkt));
+        pkt->len = 17 + nlen + snlen;
+        pkt->conn = CONN_QUERY;
+        pkt->pkt = PKT_QUERY_REQ_CONN;
+        pkt->hflag = flags | 0x8000u;
+        *(uint16_t *)pkt->data = type;
+        *(uint16_t *)(pkt->data + 2) = 1 + nlen + snlen;
+        *(uint32_t *)(pkt->data + 4) = addr;
+        memcpy(pkt->data + 8, name, nlen);
+        pkt->data[8 + nlen] = 0;
+        memcpy(pkt->data + 9 + nlen, subname, snlen);
+    } else {
+        pkt = alloca(sizeof(*pkt) + 8 + nlen);
+        memset(pkt, 0, sizeof(*pkt));
+        pkt->len = 16 + nlen;
+        pkt->conn = CONN_QUERY;
+        pkt->pkt = PKT_QUERY_REQ_CONN;
+        pkt->hflag = flags;
+        *(uint16_t *)pkt->data = type;
+        *(uint16_t *)(pkt->data + 2) = nlen;
+        *(uint32_t *)(pkt->data + 4) = addr;
+        memcpy(pkt->data + 8, name, nlen);
+    }
+    if(cm->opts.reconnect_ms) {
+        cif->req = malloc(pkt->len);
+        if(!cif->req) {
+            free(cif);
+            return NULL;
+        }
+        memcpy(cif->req, pkt, pkt->len);
+    }
+    if(coremodel_push_packet(cm, pkt, NULL)) {
+        free(cif->req);
+        free(cif);
+        return NULL;
+    }
+
+    cif->cm = cm;
+    cif->conn = CONN_QUERY;
+    cif->type = type;
+    cif->func = func;
+    cif->priv = ifpriv;
+    cif->erxbufs = cif->rxscan = &cif->rxbufs;
+    cif->defer_pkt = 1;
+    cif->attaching = 1;
+    coremodel_attach_queue(cm, cif);
+    return cif;
+}
+
+/* Run the loop until every queued connection request has been answered. The
+ * VM answers requests in order, so responses are matched to the oldest one. */
+static void coremodel_attach_wait(struct coremodel *cm)
+{
+    struct coremodel_if *cif;
+
+    if(!cm->query || !coremodel_mainloop_int(cm, -1, 1))
+        return;
+
+    /* Connection failed; requests still waiting will never be answered */
+    while(cm->conn_if) {
+        cif = cm->conn_if;
+        cm->conn_if = cif->qnext;
+        cif->qnext = NULL;
+    }
+    cm->econn_if = &cm->conn_if;
+    cm->query = 0;
+}
+
+/* Settle an interface after coremodel_attach_wait. Returns it, or NULL if it
+ * was refused, in which case it is freed. */
+static struct coremodel_if *coremodel_attach_finish(struct coremodel *cm, struct coremodel_if *cif)
+{
+    if(cif->conn == CONN_QUERY) {
+        free(cif->req);
+        free(cif);
+        return NULL;
+    }
+    cif->attaching = 0;
+    cm->defer_pkt |= cif->defer_pkt;
+    return cif;
+}
+
+static void *coremodel_attach_int(void *priv, unsigned type, const char *name, unsigned addr, const char *subname, const void *func, void *ifpriv, uint16_t flags, unsigned xfrmax)
+{
+    struct coremodel *cm = priv;
+    struct coremodel_if *cif;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    if(cm->query) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return NULL;
+    }
+
+    cif = coremodel_attach_send(cm, type, name, addr, subname, func, ifpriv, flags);
+    if(cif) {
+        cif->xfrmax = xfrmax;
+        coremodel_attach_wait(cm);
+        cif = coremodel_attach_finish(cm, cif);
+    }
+
+    /* Packets that arrived during attach are only delivered on the next loop
+     * iteration; make sure there is one even if the caller polls an external
+     * event loop. */
+    if(cm->defer_pkt)
+        coremodel_wake(cm);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return cif;
+}
+
+int coremodel_attach_batch(void *priv, coremodel_attach_req_t *reqs, unsigned count)
+{
+    struct coremodel *cm = priv;
+    coremodel_attach_req_t *req;
+    unsigned idx;
+    int num = 0;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    if(cm->query) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return -EBUSY;
+    }
+
+    for(idx=0; idx<count; idx++) {
+        req = &reqs[idx];
+        if(req->type == COREMODEL_EVENT)
+            req->handle = coremodel_attach_send(cm, req->type, "event", 0, req->name, req->func, req->priv, req->flags);
+        else
+            req->handle = coremodel_attach_send(cm, req->type, req->name, req->addr, req->subname, req->func, req->priv, req->flags);
+    }
+
+    coremodel_attach_wait(cm);
+
+    for(idx=0; idx<count; idx++) {
+        req = &reqs[idx];
+        if(req->handle)
+            req->handle = coremodel_attach_finish(cm, req->handle);
+        if(req->handle)
+            num ++;
+    }
+
+    if(cm->defer_pkt)
+        coremodel_wake(cm);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return num;
+}
+
+static struct coremodel_if *coremodel_conn_lookup(struct coremodel *cm, unsigned conn)
+{
+    struct coremodel_if **page = cm->conn_map[conn >> CONN_MAP_SHIFT];
+
+    return page ? page[conn & (CONN_MAP_SIZE - 1)] : NULL;
+}
+
+static int coremodel_conn_map_set(struct coremodel *cm, unsigned conn, struct coremodel_if *cif)
+{
+    struct coremodel_if ***ppage = &cm->conn_map[conn >> CONN_MAP_SHIFT];
+
+    if(!*ppage) {
+        if(!cif)
+            return 0;
+        *ppage = calloc(CONN_MAP_SIZE, sizeof(**ppage));
+        if(!*ppage)
+            return 1;
+    }
+    (*ppage)[conn & (CONN_MAP_SIZE - 1)] = cif;
+    return 0;
+}
+
+static int coremodel_process_conn_response(void *priv, struct coremodel_packet *pkt)
+{
+    struct coremodel *cm = priv;
+    struct coremodel_packet npkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_DISC };
+    struct coremodel_if *cif = cm->conn_if;
+
+    if(!cif)
+        return 0;
+
+    cm->conn_if = cif->qnext;
+    if(!cm->conn_if)
+        cm->econn_if = &cm->conn_if;
+    cif->qnext = NULL;
+    cm->query --;
+
+    if(cif->detached) {
+        /* Detached while its request was being replayed after a reconnect */
+        if(pkt->hflag != CONN_QUERY) {
+            npkt.hflag = pkt->hflag;
+            coremodel_push_packet(cm, &npkt, NULL);
+        }
+        free(cif->req);
+        free(cif);
+    } else {
+        cif->conn = pkt->hflag;
+        if(pkt->len >= 12)
+            cif->cred = *(uint32_t *)pkt->data;
+        if(pkt->hflag != CONN_QUERY) {
+            if(coremodel_conn_map_set(cm, pkt->hflag, cif)) {
+                npkt.hflag = pkt->hflag;
+                coremodel_push_packet(cm, &npkt, NULL);
+                cif->conn = CONN_QUERY;
+            } else if(cif->attaching) {
+                cif->next = cm->ifs;
+                cm->ifs = cif;
+            }
+        }
+    }
+
+    if(cm->reattach_left && !--cm->reattach_left)
+        coremodel_link_up(cm);
+    return 0;
+}
+
+void *coremodel_attach_uart(void *priv, const char *name, const coremodel_uart_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_UART, name, 0, NULL, func, ifpriv, 0, 0);
+}
+void *coremodel_attach_i2c(void *priv, const char *name, uint8_t addr, const coremodel_i2c_func_t *func, void *ifpriv, uint16_t flags)
+{
+    return coremodel_attach_int(priv, COREMODEL_I2C, name, addr, NULL, func, ifpriv, flags, 0);
+}
+void *coremodel_attach_spi(void *priv, const char *name, unsigned csel, const coremodel_spi_func_t *func, void *ifpriv, uint16_t flags)
+{
+    return coremodel_attach_int(priv, COREMODEL_SPI, name, csel, NULL, func, ifpriv, flags, 0);
+}
+void *coremodel_attach_spi_name(void *priv, const char *name, const char *cselname, const coremodel_spi_func_t *func, void *ifpriv, uint16_t flags)
+{
+    return coremodel_attach_int(priv, COREMODEL_SPI, name, 0, cselname, func, ifpriv, flags, 0);
+}
+void *coremodel_attach_spi_ex(void *priv, const char *name, unsigned csel, const char *cselname, const coremodel_spi_func_t *func, void *ifpriv, uint16_t flags, unsigned max_xfr)
+{
+    if(max_xfr > MAX_SPI_XFR)
+        max_xfr = MAX_SPI_XFR;
+    return coremodel_attach_int(priv, COREMODEL_SPI, name, csel, cselname, func, ifpriv, flags, max_xfr);
+}
+void *coremodel_attach_gpio(void *priv, const char *name, unsigned pin, const coremodel_gpio_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_GPIO, name, pin, NULL, func, ifpriv, 0, 0);
+}
+void *coremodel_attach_gpio_name(void *priv, const char *name, const char *pinname, const coremodel_gpio_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_GPIO, name, 0, pinname, func, ifpriv, 0, 0);
+}
+void *coremodel_attach_usbh(void *priv, const char *name, unsigned port, const coremodel_usbh_func_t *func, void *ifpriv, unsigned speed)
+{
+    return coremodel_attach_int(priv, COREMODEL_USBH, name, port, NULL, func, ifpriv, speed, 0);
+}
+void *coremodel_attach_can(void *priv, const char *name, const coremodel_can_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_CAN, name, 0, NULL, func, ifpriv, 0, 0);
+}
+void *coremodel_attach_eth(void *priv, const char *name, const coremodel_eth_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_ETH, name, 0, NULL, func, ifpriv, 0, 0);
+}
+void *coremodel_attach_event_name(void *priv, const char *evtname, const coremodel_event_func_t *func, void *ifpriv)
+{
+    return coremodel_attach_int(priv, COREMODEL_EVENT, "event", 0, evtname, func, ifpriv, 0, 0);
+}
+
+/* Apply the ready calls that were left for this thread while it was in a
+ * callback. Only done outside any callback, where no dispatch is half-way
+ * through; must be called with coremodel_mutex held. */
+static void coremodel_ready_flush(struct coremodel *cm)
+{
+    struct coremodel_if *cif;
+
+    if(cm->cb_depth)
+        return;
+    while(cm->rdy_ifs) {
+        cif = cm->rdy_ifs;
+        cm->rdy_ifs = cif->rnext;
+        cif->rnext = NULL;
+        cif->rdy = 0;
+        if(cif->rdy_busy)
+            cif->busy = 0;
+        if(cif->rdy_ebusy)
+            cif->ebusy &= ~cif->rdy_ebusy;
+        cif->rdy_busy = 0;
+        cif->rdy_ebusy = 0;
+        coremodel_advance_if(cif);
+    }
+}
+
+/* A model is ready to take more packets: clear busy, or the ebusy bits in
+ * ebusy, and dispatch what was held up. If another thread is in a callback,
+ * leave it for that thread, which keeps the interface's packets in order and
+ * the caller from waiting for the callback; must be called with
+ * coremodel_mutex held. */
+static void coremodel_release_if(struct coremodel_if *cif, unsigned busy, uint64_t ebusy)
+{
+    struct coremodel *cm = cif->cm;
+
+    if(coremodel_cb_other(cm)) {
+        cif->rdy_busy |= busy;
+        cif->rdy_ebusy |= ebusy;
+        if(!cif->rdy) {
+            cif->rdy = 1;
+            cif->rnext = cm->rdy_ifs;
+            cm->rdy_ifs = cif;
+        }
+        return;
+    }
+
+    if(busy)
+        cif->busy = 0;
+    if(ebusy)
+        cif->ebusy &= ~ebusy;
+    coremodel_advance_if(cif);
+    coremodel_ready_flush(cm);
+}
+
+static void coremodel_ready_int(void *handle)
+{
+    struct coremodel_if *cif = handle;
+
+    if(cif)
+        coremodel_release_if(cif, 1, 0);
+}
+
+static int coremodel_advance_if_uart(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    int res;
+
+    switch(pkt->pkt) {
+    case PKT_UART_TX:
+        if(cif->busy)
+            return 1;
+        if(cif->uartf->tx) {
+            coremodel_cb_enter(cif->cm);
+            res = cif->uartf->tx(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
+            coremodel_cb_exit(cif->cm);
+        } else
+            res = (pkt->len - 8) - cif->offs;
+        if(!res) {
+            cif->busy = 1;
+            break;
+        }
+        cif->offs += res;
+        if(cif->offs < pkt->len - 8)
+            return 1;
+        cif->offs = 0;
+        return 0;
+
+    case PKT_UART_RX_ACK:
+        if(!__atomic_fetch_add(&cif->cred, pkt->hflag, __ATOMIC_RELEASE) && cif->uartf->rxrdy) {
+            coremodel_cb_enter(cif->cm);
+            cif->uartf->rxrdy(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+
+    case PKT_UART_BRK:
+        if(cif->uartf->brk) {
+            coremodel_cb_enter(cif->cm);
+            cif->uartf->brk(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+    }
+
+    return 0;
+}
+
+/* Take up to want credits from an interface; returns the number taken. */
+static unsigned coremodel_take_cred(struct coremodel_if *cif, unsigned want)
+{
+    unsigned cred, take;
+
+    cred = __atomic_load_n(&cif->cred, __ATOMIC_RELAXED);
+    do {
+        if(!cred)
+            return 0;
+        take = (want > cred) ? cred : want;
+    } while(!__atomic_compare_exchange_n(&cif->cred, &cred, cred - take, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return take;
+}
+
+int coremodel_uart_rx(void *uart, unsigned len, uint8_t *data)
+{
+    struct coremodel_if *cif = uart;
+    struct coremodel_packet pkt = { .pkt = PKT_UART_RX };
+
+    if(!cif)
+        return 0;
+    len = coremodel_take_cred(cif, len);
+    if(!len)
+        return 0;
+
+    pkt.len = 8 + len;
+    pkt.conn = cif->conn;
+
+    if(coremodel_submit_packet(cif->cm, &pkt, data)) {
+        __atomic_fetch_add(&cif->cred, len, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return len;
+}
+
+void coremodel_uart_txrdy(void *uart)
+{
+    struct coremodel_if *cif = uart;
+    struct coremodel *cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_ready_int(uart);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+static int coremodel_advance_if_i2c(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    struct coremodel_packet npkt = { .len = 8, .conn = cif->conn, .pkt = PKT_I2C_DONE };
+    int res;
+
+    if(cif->busy)
+        return 1;
+    cif->trnidx = pkt->hflag;
+    npkt.hflag = cif->trnidx;
+
+    switch(pkt->pkt) {
+    case PKT_I2C_START:
+        if(cif->i2cf->start) {
+            coremodel_cb_enter(cif->cm);
+            res = cif->i2cf->start(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        } else
+            res = 1;
+        if(res == 0) {
+            cif->busy = 1;
+            return 1;
+        }
+        if(pkt->bflag & 1) {
+            npkt.bflag = (res < 0) ? 1 : 0;
+            coremodel_push_packet(cif->cm, &npkt, NULL);
+        }
+        return 0;
+
+    case PKT_I2C_WRITE:
+        if(cif->i2cf->write) {
+            coremodel_cb_enter(cif->cm);
+            res = cif->i2cf->write(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
+            coremodel_cb_exit(cif->cm);
+        } else
+            res = -1;
+        if(res == 0) {
+            cif->busy = 1;
+            return 1;
+        }
+        if(res < 0) {
+            if(pkt->bflag & 1) {
+                npkt.bflag = 1;
+                coremodel_push_packet(cif->cm, &npkt, NULL);
+            }
+            return 0;
+        }
+        cif->offs += res;
+        if(cif->offs < pkt->len - 8)
+            return 1;
+        cif->offs = 0;
+        if(pkt->bflag & 1)
+            coremodel_push_packet(cif->cm, &npkt, NULL);
+        return 0;
+
+    case PKT_I2C_READ:
+        if(cif->i2cf->read) {
+            coremodel_cb_enter(cif->cm);
+            res = cif->i2cf->read(cif->priv, pkt->bflag - cif->offs, cif->rdbuf + cif->offs);
+            coremodel_cb_exit(cif->cm);
+        } else
+            res = pkt->bflag - cif->offs;
+        if(res == 0) {
+            cif->busy = 1;
+            return 1;
+        }
+        cif->offs += res;
+        if(cif->offs < pkt->bflag)
+            return 1;
+        cif->offs = 0;
+        npkt.len = 8 + pkt->bflag;
+        coremodel_push_packet(cif->cm, &npkt, cif->rdbuf);
+        return 0;
+
+    case PKT_I2C_STOP:
+        if(cif->i2cf->stop) {
+            coremodel_cb_enter(cif->cm);
+            cif->i2cf->stop(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+    }
+
+    return 0;
+}
+
+int coremodel_i2c_push_read(void *i2c, unsigned len, uint8_t *data)
+{
+    struct coremodel_if *cif = i2c;
+    struct coremodel_packet pkt = { .pkt = PKT_I2C_DONE };
+    struct coremodel *cm;
+
+    if(!cif)
+        return 0;
+    cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    if(len > 255)
+        len = 255;
+    pkt.len = 8 + len;
+    pkt.conn = cif->conn;
+    pkt.hflag = cif->trnidx;
+
+    if(coremodel_push_if(cif, &pkt, data)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return len;
+}
+
+void coremodel_i2c_ready(void *i2c)
+{
+    struct coremodel_if *cif = i2c;
+    struct coremodel *cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_ready_int(i2c);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+static int coremodel_advance_if_spi(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    int res, max;
+    struct coremodel_packet npkt = { .pkt = PKT_SPI_RX };
+    uint8_t bounce[SPI_XFR_DFLT], *rd;
+
+    switch(pkt->pkt) {
+    case PKT_SPI_CS:
+        if(cif->spif->cs) {
+            coremodel_cb_enter(cif->cm);
+            cif->spif->cs(cif->priv, pkt->bflag & 1);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+    case PKT_SPI_TX:
+        if(cif->busy)
+            return 1;
+        cif->trnidx = pkt->hflag;
+        /* Without memory for the response, it is built over the write data
+         * already consumed, through a bounce buffer of the default size; a
+         * packet started that way is finished that way */
+        if(!cif->xfrbuf && !cif->offs)
+            cif->xfrbuf = coremodel_buf_alloc(cif->cm, pkt->len - 8);
+        max = cif->xfrbuf ? (cif->xfrmax ? cif->xfrmax : SPI_XFR_DFLT) : SPI_XFR_DFLT;
+        /* Nothing else would bring the loop back to a partly transferred
+         * packet, so keep going until it is done or the model stalls */
+        while(cif->offs < pkt->len - 8) {
+            res = (pkt->len - 8) - cif->offs;
+            if(res > max)
+                res = max;
+            rd = cif->xfrbuf ? cif->xfrbuf + cif->offs : bounce;
+            if(cif->spif->xfr) {
+                coremodel_cb_enter(cif->cm);
+                res = cif->spif->xfr(cif->priv, res, pkt->data + cif->offs, rd);
+                coremodel_cb_exit(cif->cm);
+            } else
+                memset(rd, 0, res);
+            if(!res) {
+                cif->busy = 1;
+                return 1;
+            }
+            if(!cif->xfrbuf)
+                memcpy(pkt->data + cif->offs, bounce, res);
+            cif->offs += res;
+        }
+        cif->offs = 0;
+        npkt.len = pkt->len;
+        npkt.conn = cif->conn;
+        npkt.hflag = cif->trnidx;
+        coremodel_push_packet(cif->cm, &npkt, cif->xfrbuf ? cif->xfrbuf : pkt->data);
+        if(cif->xfrbuf)
+            coremodel_buf_free(cif->cm, cif->xfrbuf);
+        cif->xfrbuf = NULL;
+        return 0;
+    }
+
+    return 0;
+}
+
+void coremodel_spi_ready(void *spi)
+{
+    struct coremodel_if *cif = spi;
+    struct coremodel *cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_ready_int(spi);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+/* Callbacks of the pins of a bank, which are never called: updates of these
+ * pins go to the bank. */
+static const coremodel_gpio_func_t coremodel_gpio_bank_pin_func;
+
+static void coremodel_gpio_bank_update(struct coremodel_gpio_bank_pin *bpin, int mvolt)
+{
+    struct coremodel_gpio_bank *bank = bpin->bank;
+    struct coremodel *cm = bank->cm;
+
+    bank->mvolt[bpin->idx] = mvolt;
+    bank->changed[bpin->idx >> 6] |= 1ull << (bpin->idx & 63);
+    if(!bank->pending) {
+        bank->pending = 1;
+        bank->pnext = cm->gpio_pend;
+        cm->gpio_pend = bank;
+    }
+}
+
+/* Report the pins of each bank that were updated since the last report. Done
+ * once the received data has been dispatched, outside any callback; must be
+ * called with coremodel_mutex held. */
+static void coremodel_gpio_bank_flush(struct coremodel *cm)
+{
+    struct coremodel_gpio_bank *bank;
+
+    if(cm->cb_depth)
+        return;
+    while(cm->gpio_pend) {
+        bank = cm->gpio_pend;
+        cm->gpio_pend = bank->pnext;
+        bank->pnext = NULL;
+        bank->pending = 0;
+        memcpy(bank->report, bank->changed, bank->words * sizeof(uint64_t));
+        memset(bank->changed, 0, bank->words * sizeof(uint64_t));
+        if(bank->func->notify) {
+            coremodel_cb_enter(cm);
+            bank->func->notify(bank->priv, bank->report, bank->mvolt);
+            coremodel_cb_exit(cm);
+        }
+    }
+}
+
+static int coremodel_advance_if_gpio(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    switch(pkt->pkt) {
+    case PKT_GPIO_UPDATE:
+        if(cif->gpiof == &coremodel_gpio_bank_pin_func)
+            coremodel_gpio_bank_update(cif->priv, (int16_t)pkt->hflag);
+        else if(cif->gpiof->notify) {
+            coremodel_cb_enter(cif->cm);
+            cif->gpiof->notify(cif->priv, (int16_t)pkt->hflag);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int coremodel_gpio_set(void *pin, unsigned drven, int mvolt)
+{
+    struct coremodel_if *cif = pin;
+    struct coremodel_packet pkt = { .len = 8, .pkt = PKT_GPIO_FORCE };
+
+    if(!cif)
+        return 1;
+
+    pkt.conn = cif->conn;
+    pkt.bflag = !!drven;
+    pkt.hflag = mvolt;
+
+    return coremodel_submit_packet(cif->cm, &pkt, NULL);
+}
+
+void *coremodel_attach_gpio_bank(void *priv, const char *name, const unsigned *pins, unsigned count, const coremodel_gpio_bank_func_t *func, void *ifpriv)
+{
+    struct coremodel *cm = priv;
+    struct coremodel_gpio_bank *bank;
+    unsigned idx, words = (count + 63) / 64, failed = 0;
+
+    if(!count)
+        return NULL;
+    bank = calloc(1, sizeof(*bank) + count * sizeof(bank->pin[0]) + 2 * words * sizeof(uint64_t) + count * sizeof(int));
+    if(!bank)
+        return NULL;
+    bank->cm = cm;
+    bank->func = func;
+    bank->priv = ifpriv;
+    bank->count = count;
+    bank->words = words;
+    bank->changed = (uint64_t *)&bank->pin[count];
+    bank->report = bank->changed + words;
+    bank->mvolt = (int *)(bank->report + words);
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    if(cm->query) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        free(bank);
+        return NULL;
+    }
+
+    /* Send every request before waiting for the first answer */
+    for(idx=0; idx<count; idx++) {
+        bank->pin[idx].bank = bank;
+        bank->pin[idx].idx = idx;
+        bank->pin[idx].cif = coremodel_attach_send(cm, COREMODEL_GPIO, name, pins[idx], NULL, &coremodel_gpio_bank_pin_func, &bank->pin[idx], 0);
+    }
+    coremodel_attach_wait(cm);
+    for(idx=0; idx<count; idx++) {
+        if(bank->pin[idx].cif)
+            bank->pin[idx].cif = coremodel_attach_finish(cm, bank->pin[idx].cif);
+        if(!bank->pin[idx].cif)
+            failed = 1;
+    }
+
+    if(cm->defer_pkt)
+        coremodel_wake(cm);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+
+    if(failed) {
+        for(idx=0; idx<count; idx++)
+            coremodel_detach(bank->pin[idx].cif);
+        free(bank);
+        return NULL;
+    }
+    return bank;
+}
+
+void coremodel_detach_gpio_bank(void *handle)
+{
+    struct coremodel_gpio_bank *bank = handle, **pbank;
+    struct coremodel *cm;
+    unsigned idx;
+
+    if(!bank)
+        return;
+    cm = bank->cm;
+
+    for(idx=0; idx<bank->count; idx++)
+        coremodel_detach(bank->pin[idx].cif);
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    for(pbank=&cm->gpio_pend; *pbank; pbank=&(*pbank)->pnext)
+        if(*pbank == bank) {
+            *pbank = bank->pnext;
+            break;
+        }
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    free(bank);
+}
+
+int coremodel_gpio_set_multi(void *handle, const uint64_t *mask, const uint64_t *drven, const int *mvolt)
+{
+    struct coremodel_gpio_bank *bank = handle;
+    struct coremodel_packet pkt = { .len = 8, .pkt = PKT_GPIO_FORCE };
+    struct coremodel *cm;
+    unsigned idx, num = 0;
+
+    if(!bank)
+        return 1;
+    cm = bank->cm;
+
+    for(idx=0; idx<bank->count; idx++)
+        if(mask[idx >> 6] & (1ull << (idx & 63)))
+            num ++;
+    if(!num)
+        return 0;
+
+    /* All pins or none, in one write */
+    coremodel_batch_begin(cm);
+    if(coremodel_tx_full(cm, num * 8)) {
+        coremodel_batch_commit(cm);
+        return 1;
+    }
+    for(idx=0; idx<bank->count; idx++)
+        if(mask[idx >> 6] & (1ull << (idx & 63))) {
+            pkt.conn = bank->pin[idx].cif->conn;
+            pkt.bflag = !!(drven[idx >> 6] & (1ull << (idx & 63)));
+            pkt.hflag = mvolt[idx];
+            coremodel_push_if(bank->pin[idx].cif, &pkt, NULL);
+        }
+    coremodel_batch_commit(cm);
+    return 0;
+}
+
+static int coremodel_advance_if_usbh(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    struct coremodel_packet npkt = { .pkt = PKT_USBH_DONE };
+    uint8_t dev, ep, tkn, end;
+    uint16_t size;
+    int res;
+
+    switch(pkt->pkt) {
+    case PKT_USBH_RESET:
+        if(!cif->busy) {
+            cif->busy = 1;
+            return -2;
+        }
+        cif->busy = 0;
+        cif->ebusy = 0;
+        if(cif->usbhf->rst) {
+            coremodel_cb_enter(cif->cm);
+            cif->usbhf->rst(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        }
+        return 0;
+
+    case PKT_USBH_XFR:
+        if(cif->busy)
+            return 0;
+        ep = (pkt->hflag >> 4) & 15;
+        tkn = pkt->hflag & 15;
+        if(tkn == USB_TKN_SETUP)
+            cif->ebusy &= ~(1ul << (ep * 4 + tkn));
+        if(cif->ebusy & (1ul << (ep * 4 + tkn)))
+            return -1;
+        dev = (pkt->hflag >> 8) & 127;
+        end = pkt->hflag >> 15;
+        if(cif->usbhf->xfr) {
+            if(tkn == USB_TKN_IN) {
+                if(pkt->len < 10)
+                    return 0;
+                size = *(uint16_t *)pkt->data;
+                if(size > cif->rdlen)
+                    size = cif->rdlen;
+                coremodel_cb_enter(cif->cm);
+                res = cif->usbhf->xfr(cif->priv, dev, ep, tkn, cif->rdbuf, size, end);
+                coremodel_cb_exit(cif->cm);
+            } else {
+                coremodel_cb_enter(cif->cm);
+                res = cif->usbhf->xfr(cif->priv, dev, ep, tkn, pkt->data, pkt->len - 8, end);
+                coremodel_cb_exit(cif->cm);
+            }
+        } else
+            res = USB_XFR_NAK;
+        if(tkn == USB_TKN_SETUP)
+            return 0;
+        if(res == USB_XFR_NAK) {
+            cif->ebusy |= 1ul << (ep * 4 + tkn);
+            return -1;
+        }
+        npkt.conn = cif->conn;
+        npkt.bflag = pkt->bflag;
+        npkt.hflag = tkn | (ep << 4) | (dev << 8);
+        if(res < 0) {
+            npkt.len = (tkn == USB_TKN_IN) ? 8 : 10;
+            npkt.hflag |= 0x8000;
+            size = 0;
+            coremodel_push_packet(cif->cm, &npkt, &size);
+        } else {
+            if(tkn == USB_TKN_IN) {
+                npkt.len = 8 + res;
+                coremodel_push_packet(cif->cm, &npkt, cif->rdbuf);
+            } else {
+                npkt.len = 10;
+                size = res;
+                coremodel_push_packet(cif->cm, &npkt, &size);
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+void coremodel_usbh_ready(void *usb, uint8_t ep, uint8_t tkn)
+{
+    struct coremodel_if *cif = usb;
+    struct coremodel *cm = cif->cm;
+
+    if(cif) {
+        pthread_mutex_lock(&cm->coremodel_mutex);
+        coremodel_release_if(cif, 0, 1ul << (ep * 4 + tkn));
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+    }
+}
+
+static const unsigned coremodel_can_datalen[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+
+/* Send a queued CAN frame as the next transaction; must be called with
+ * coremodel_mutex held. */
+static int coremodel_can_rx_send(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    pkt->conn = cif->conn;
+    pkt->bflag = (cif->trnidx + 1) & 255;
+    __atomic_store_n(&cif->trnidx, pkt->bflag, __ATOMIC_RELEASE);
+    __atomic_store_n(&cif->ebusy, 1, __ATOMIC_RELEASE);
+    if(coremodel_push_packet(cif->cm, pkt, pkt->data)) {
+        __atomic_store_n(&cif->ebusy, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+
+/* Send the frame at the head of the queue. If it cannot be sent, it stays
+ * there and the bus is left idle, to be retried when the model sends the next
+ * frame; must be called with coremodel_mutex held. */
+static int coremodel_can_rx_next(struct coremodel_if *cif)
+{
+    struct coremodel_can_ring *ring = cif->rxring;
+    struct coremodel_packet *pkt = ring->pkt[ring->head];
+
+    if(coremodel_can_rx_send(cif, pkt))
+        return 1;
+    ring->head = (ring->head + 1) % ring->depth;
+    ring->num --;
+    coremodel_buf_free(cif->cm, pkt);
+    return 0;
+}
+
+static int coremodel_advance_if_can(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    int res;
+    struct coremodel_packet npkt = { .len = 8, .pkt = PKT_CAN_TX_ACK };
+    void *data;
+    unsigned dlc, dlen;
+
+    switch(pkt->pkt) {
     case PKT_CAN_TX:
         if(cif->busy)
             return -1;
@@ -990,543 +2914,1644 @@ static int coremodel_advance_if_can(struct coremodel_if *cif, struct coremodel_p
         if(pkt->len < 16 + dlen)
             return 0;
         data = pkt->data + 16;
-        if(cif->canf->tx)
+        if(cif->canf->tx) {
+            coremodel_cb_enter(cif->cm);
             res = cif->canf->tx(cif->priv, (uint64_t *)pkt->data, data);
-        else
+            coremodel_cb_exit(cif->cm);
+        } else
             res = CAN_NAK;
         if(res == CAN_STALL) {
             cif->busy = 1;
             return 1;
         }
-        npkt.conn = cif->conn;
-        npkt.bflag = pkt->bflag;
-        npkt.hflag = !!res;
-        coremodel_push_packet(cif->cm, &npkt, NULL);
+        npkt.conn = cif->conn;
+        npkt.bflag = pkt->bflag;
+        npkt.hflag = !!res;
+        coremodel_push_packet(cif->cm, &npkt, NULL);
+        return 0;
+    case PKT_CAN_RX_ACK:
+        if(pkt->bflag == __atomic_load_n(&cif->trnidx, __ATOMIC_ACQUIRE)) {
+            /* Keep the bus busy while the model hears about this frame */
+            if(cif->rxring && cif->rxring->num)
+                coremodel_can_rx_next(cif);
+            else
+                __atomic_store_n(&cif->ebusy, 0, __ATOMIC_RELEASE);
+            if(cif->canf->rxcomplete) {
+                coremodel_cb_enter(cif->cm);
+                cif->canf->rxcomplete(cif->priv, pkt->hflag);
+                coremodel_cb_exit(cif->cm);
+            }
+        }
+        return 0;
+    }
+
+    return 0;
+}
+
+int coremodel_can_rx_busy(void *can)
+{
+    struct coremodel_if *cif = can;
+    struct coremodel *cm = cif->cm;
+    int res;
+
+    if(!cif->rxring)
+        return !!__atomic_load_n(&cif->ebusy, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    res = cif->ebusy && cif->rxring->num >= cif->rxring->depth;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
+}
+
+int coremodel_can_set_rx_depth(void *can, unsigned depth)
+{
+    struct coremodel_if *cif = can;
+    struct coremodel *cm;
+    struct coremodel_can_ring *ring = NULL;
+
+    if(!cif)
+        return 1;
+    cm = cif->cm;
+
+    if(depth) {
+        ring = calloc(1, sizeof(*ring) + depth * sizeof(ring->pkt[0]));
+        if(!ring)
+            return 1;
+        ring->depth = depth;
+    }
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    if(cif->rxring && cif->rxring->num) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        free(ring);
+        return 1;
+    }
+    free(cif->rxring);
+    cif->rxring = ring;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return 0;
+}
+
+/* Send a frame now if the bus is idle, or queue it behind the frame in
+ * flight. */
+static int coremodel_can_rx_queue(struct coremodel_if *cif, uint64_t *ctrl, uint8_t *data, unsigned dlen)
+{
+    struct coremodel *cm = cif->cm;
+    struct coremodel_can_ring *ring;
+    struct coremodel_packet *pkt;
+    unsigned len = sizeof(*pkt) + 16 + dlen;
+    int res = 1;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    ring = cif->rxring;
+    if(cif->conn == CONN_QUERY)
+        goto out;
+    /* A frame left queued by a failed send goes first */
+    if(!cif->ebusy && ring->num && coremodel_can_rx_next(cif))
+        goto out;
+    if(cif->ebusy && ring->num >= ring->depth)
+        goto out;
+    if(!cif->ebusy && coremodel_tx_full(cm, (len + 3) & ~3))
+        goto out;
+
+    pkt = coremodel_buf_alloc(cm, len);
+    if(!pkt)
+        goto out;
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->len = len;
+    pkt->pkt = PKT_CAN_RX;
+    memcpy(pkt->data, ctrl, 16);
+    if(dlen)
+        memcpy(pkt->data + 16, data, dlen);
+
+    if(cif->ebusy) {
+        ring->pkt[(ring->head + ring->num) % ring->depth] = pkt;
+        ring->num ++;
+        res = 0;
+    } else {
+        res = coremodel_can_rx_send(cif, pkt);
+        coremodel_buf_free(cm, pkt);
+    }
+
+out:
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
+}
+
+int coremodel_can_rx(void *can, uint64_t *ctrl, uint8_t *data)
+{
+    struct coremodel_if *cif = can;
+    unsigned dlc, dlen;
+    uint64_t idle = 0;
+    struct coremodel_packet pkt = { .pkt = PKT_CAN_RX };
+    struct { uint64_t ctrl[2]; uint8_t data[2048]; } edata;
+
+    if(!cif)
+        return 1;
+
+    dlc = (ctrl[0] & CAN_CTRL_DLC_MASK) >> CAN_CTRL_DLC_SHIFT;
+    dlen = (dlc < 16) ? coremodel_can_datalen[dlc] : dlc + 1;
+
+    if(dlen && !data)
+        return 1;
+    if(cif->rxring)
+        return coremodel_can_rx_queue(cif, ctrl, data, dlen);
+    if(!__atomic_compare_exchange_n(&cif->ebusy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 1;
+
+    memcpy(&edata.ctrl, ctrl, sizeof(edata.ctrl));
+    if(dlen)
+        memcpy(edata.data, data, dlen);
+
+    pkt.len = sizeof(pkt) + sizeof(edata.ctrl) + dlen;
+    pkt.conn = cif->conn;
+    pkt.bflag = (cif->trnidx + 1) & 255;
+    pkt.hflag = 0;
+    __atomic_store_n(&cif->trnidx, pkt.bflag, __ATOMIC_RELEASE);
+    if(coremodel_submit_packet(cif->cm, &pkt, (void *)&edata)) {
+        __atomic_store_n(&cif->ebusy, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+
+void coremodel_can_ready(void *can)
+{
+    struct coremodel_if *cif = can;
+    struct coremodel *cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_ready_int(can);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+static int coremodel_advance_if_event(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    uint64_t *data;
+
+    switch(pkt->pkt) {
+    case PKT_EVENT_UPDATE:
+        data = (void *)(pkt + 1);
+        switch(pkt->bflag) {
+        case EVENT_UPDATE_NORMAL:
+        case EVENT_UPDATE_INITIAL:
+            if(cif->eventf->update && pkt->len >= 16) {
+                coremodel_cb_enter(cif->cm);
+                cif->eventf->update(cif->priv, data[0], data[1], pkt->bflag == EVENT_UPDATE_INITIAL);
+                coremodel_cb_exit(cif->cm);
+            }
+            break;
+        case EVENT_UPDATE_ATOMIC:
+            if(cif->eventf->atresp && pkt->len >= 16) {
+                coremodel_cb_enter(cif->cm);
+                cif->eventf->atresp(cif->priv, data[0], data[1]);
+                coremodel_cb_exit(cif->cm);
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int coremodel_event_signal(void *evt, uint64_t data0, uint64_t data1, unsigned chgonly)
+{
+    struct coremodel_if *cif = evt;
+    struct coremodel_packet pkt = { .len = 24, .pkt = PKT_EVENT_SIGNAL };
+    uint64_t data[2] = { data0, data1 };
+
+    if(!cif)
+        return 1;
+
+    pkt.conn = cif->conn;
+    pkt.bflag = chgonly ? EVENT_SIGNAL_CHANGE : 0;
+
+    return coremodel_submit_packet(cif->cm, &pkt, data);
+}
+
+int coremodel_event_atomic(void *evt, uint64_t data0, uint64_t data1, unsigned op)
+{
+    struct coremodel_if *cif = evt;
+    struct coremodel_packet pkt = { .len = 24, .pkt = PKT_EVENT_SIGNAL };
+    uint64_t data[2] = { data0, data1 };
+
+    if(!cif)
+        return 1;
+
+    pkt.conn = cif->conn;
+    pkt.bflag = op | EVENT_SIGNAL_ATOMIC;
+
+    return coremodel_submit_packet(cif->cm, &pkt, data);
+}
+
+int event_signal_wire(void *evt, unsigned val)
+{
+    struct coremodel_if *cif = evt;
+    struct coremodel_packet pkt = { .len = 8, .pkt = PKT_EVENT_SIGNAL, .hflag = val };
+
+    if(!cif)
+        return 1;
+
+    pkt.conn = cif->conn;
+
+    return coremodel_submit_packet(cif->cm, &pkt, NULL);
+}
+
+static int coremodel_advance_if_eth(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    int res;
+
+    switch(pkt->pkt) {
+    case PKT_ETH_TX:
+        if(cif->busy)
+            return 1;
+        if(cif->ethf->tx) {
+            coremodel_cb_enter(cif->cm);
+            res = cif->ethf->tx(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
+            coremodel_cb_exit(cif->cm);
+        } else
+            res = (pkt->len - 8) - cif->offs;
+        if(!res) {
+            cif->busy = 1;
+            break;
+        }
+        cif->offs += res;
+        if(cif->offs < pkt->len - 8)
+            return 1;
+        cif->offs = 0;
+        break;
+    case PKT_ETH_RX_ACK:
+        if(!__atomic_fetch_add(&cif->cred, pkt->hflag, __ATOMIC_RELEASE) && cif->ethf->rxrdy) {
+            coremodel_cb_enter(cif->cm);
+            cif->ethf->rxrdy(cif->priv);
+            coremodel_cb_exit(cif->cm);
+        }
+        break;
+    }
+
+    return 0;
+}
+
+int coremodel_eth_rx(void *eth, unsigned len, uint8_t *data)
+{
+    struct coremodel_if *cif = eth;
+    struct coremodel_packet pkt = {
+        .len = sizeof(pkt) + len,
+        .pkt = PKT_ETH_RX,
+        .conn = cif->conn
+    };
+
+    if(!cif || !coremodel_take_cred(cif, 1))
         return 0;
-    case PKT_CAN_RX_ACK:
-        if(pkt->bflag == cif->trnidx) {
-            cif->ebusy = 0;
-            if(cif->canf->rxcomplete)
-                cif->canf->rxcomplete(cif->priv, pkt->hflag);
+
+    if(coremodel_submit_packet(cif->cm, &pkt, data)) {
+        __atomic_fetch_add(&cif->cred, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return 0;
+}
+
+void coremodel_eth_ready(void *eth)
+{
+    struct coremodel_if *cif = eth;
+    struct coremodel *cm = cif->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_ready_int(eth);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+static int coremodel_dispatch_if(struct coremodel_if *cif, struct coremodel_packet *pkt)
+{
+    switch(cif->type) {
+    case COREMODEL_UART:
+        return coremodel_advance_if_uart(cif, pkt);
+    case COREMODEL_I2C:
+        return coremodel_advance_if_i2c(cif, pkt);
+    case COREMODEL_SPI:
+        return coremodel_advance_if_spi(cif, pkt);
+    case COREMODEL_GPIO:
+        return coremodel_advance_if_gpio(cif, pkt);
+    case COREMODEL_USBH:
+        return coremodel_advance_if_usbh(cif, pkt);
+    case COREMODEL_CAN:
+        return coremodel_advance_if_can(cif, pkt);
+    case COREMODEL_ETH:
+        return coremodel_advance_if_eth(cif, pkt);
+    case COREMODEL_EVENT:
+        return coremodel_advance_if_event(cif, pkt);
+    }
+    return 0;
+}
+
+/* Dispatch queued packets starting at prxb. The link where the pass stops is
+ * remembered, so a newly arrived packet does not rescan the ones before it. */
+static void coremodel_advance_if_from(struct coremodel_if *cif, struct coremodel_rxbuf **prxb)
+{
+    struct coremodel_rxbuf *rxb;
+    unsigned busy;
+    uint64_t ebusy;
+    int res;
+
+    /* Defer processing packets on this cif */
+    if(cif->defer_pkt)
+        return;
+
+    while(*prxb) {
+        rxb = *prxb;
+        busy = cif->busy;
+        ebusy = cif->ebusy;
+        res = coremodel_dispatch_if(cif, &rxb->pkt);
+        if(res > 0)
+            break;
+        if(res == -1) {
+            prxb = &rxb->next;
+            continue;
+        }
+        if(res == 0) {
+            if(!rxb->next)
+                cif->erxbufs = prxb;
+            *prxb = rxb->next;
+            coremodel_buf_free(cif->cm, rxb);
+        }
+        /* Packets skipped so far only need another look if this one
+         * released what they were waiting on; otherwise keep going from
+         * here so a deep queue drains in a single pass. */
+        if(res == -2 || (busy & ~cif->busy) || (ebusy & ~cif->ebusy))
+            prxb = &cif->rxbufs;
+    }
+    cif->rxscan = prxb;
+}
+
+static void coremodel_advance_if(struct coremodel_if *cif)
+{
+    coremodel_advance_if_from(cif, &cif->rxbufs);
+}
+
+static int coremodel_process_packet(struct coremodel *cm, struct coremodel_packet *pkt)
+{
+    struct coremodel_if *cif;
+    struct coremodel_rxbuf *rxb;
+    uint64_t bounce[MAX_PKT / 8];
+    unsigned direct;
+    int res;
+
+    if(pkt->conn == CONN_QUERY) {
+        if(cm->query)
+            switch(pkt->pkt) {
+            case PKT_QUERY_RSP_LIST:
+                return coremodel_process_list_response(cm, pkt);
+            case PKT_QUERY_RSP_CONN:
+                return coremodel_process_conn_response(cm, pkt);
+            }
+        return 0;
+    }
+
+    cif = coremodel_conn_lookup(cm, pkt->conn);
+    if(!cif)
+        return 0;
+
+    /* Idle interface: hand the packet to the model straight from the receive
+     * buffer, and only queue a copy if it could not be fully consumed. */
+    direct = !cif->rxbufs && !cif->defer_pkt && !cif->attaching;
+    /* CAN and event payloads are read as 64-bit words, and the stream only
+     * guarantees 4-byte alignment. A packet too large to bounce here is
+     * dispatched from its queued copy instead. */
+    if(direct && ((uintptr_t)pkt & 7) &&
+       (cif->type == COREMODEL_CAN || cif->type == COREMODEL_EVENT)) {
+        if(pkt->len <= sizeof(bounce)) {
+            memcpy(bounce, pkt, pkt->len);
+            pkt = (void *)bounce;
+        } else
+            direct = 0;
+    }
+    if(direct) {
+        do
+            res = coremodel_dispatch_if(cif, pkt);
+        while(res == -2);
+        if(!res)
+            return 0;
+    }
+
+    rxb = coremodel_buf_alloc(cm, sizeof(*rxb) + pkt->len - 8);
+    if(!rxb)
+        return 1;
+    rxb->next = NULL;
+    memcpy(&rxb->pkt, pkt, pkt->len);
+    *cif->erxbufs = rxb;
+    cif->erxbufs = &(rxb->next);
+    cm->stats.rx_copies ++;
+
+    if(direct) {
+        cif->rxscan = (res < 0) ? &rxb->next : &cif->rxbufs;
+        return 0;
+    }
+    cm->defer_pkt |= cif->defer_pkt = cif->attaching;
+    /* Packets ahead of the last stopping point were skipped, and nothing that
+     * would let them through has happened since, so only look from there. */
+    coremodel_advance_if_from(cif, cif->rxscan);
+    return 0;
+}
+
+static void coremodel_process_rxq(void *priv)
+{
+    struct coremodel *cm = priv;
+    unsigned len, dlen, offs, step;
+    uint8_t pkt[MAX_PKT], *buf, *big;
+    int res;
+
+    while(cm->rxqwp - cm->rxqrp >= 8 || cm->rxq_skip) {
+        /* A packet that cannot fit in the ring is dropped as it arrives */
+        if(cm->rxq_skip) {
+            step = cm->rxqwp - cm->rxqrp;
+            if(step > cm->rxq_skip)
+                step = cm->rxq_skip;
+            cm->rxqrp += step;
+            cm->rxq_skip -= step;
+            if(cm->rxq_skip)
+                break;
+            continue;
+        }
+
+        /* Packets are 4-byte aligned, so the length never wraps */
+        offs = cm->rxqrp & (cm->rxq_size - 1);
+        len = *(uint16_t *)(cm->rxq + offs);
+        dlen = (len + 3) & ~3;
+        if(dlen > cm->rxq_size) {
+            cm->rxq_skip = dlen;
+            cm->stats.rx_dropped ++;
+            continue;
+        }
+        if(cm->rxqwp - cm->rxqrp < dlen)
+            break;
+
+        step = cm->rxq_size - offs;
+        big = NULL;
+        if(step < dlen && !cm->rxq_mirror) {
+            /* Reassemble a packet that wraps around the end of the ring */
+            if(dlen > MAX_PKT) {
+                big = malloc(dlen);
+                if(!big)
+                    break;
+                buf = big;
+            } else
+                buf = pkt;
+            memcpy(buf, cm->rxq + offs, step);
+            memcpy(buf + step, cm->rxq, dlen - step);
+        } else
+            buf = cm->rxq + offs;
+        res = coremodel_process_packet(cm, (void *)buf);
+        free(big);
+        if(res)
+            break;
+        cm->stats.rx_packets ++;
+
+        cm->rxqrp += dlen;
+    }
+}
+
+static void coremodel_defer_pkt_flush(struct coremodel *cm)
+{
+    struct coremodel_if *cif;
+
+    cif = cm->ifs;
+    while(cif){
+        if(cif->defer_pkt && !cif->attaching){
+            cif->defer_pkt = 0;
+            coremodel_advance_if(cif);
+        }
+
+        cif = cif->next;
+    }
+}
+
+static void coremodel_prepare_int(struct coremodel *cm)
+{
+    coremodel_cb_wait(cm);
+    cm->coremodel_need_wake = 1;
+    cm->txflag = 0;
+    coremodel_drain_submit(cm);
+
+    /* A loopback queue cannot be polled for room; if there is some, make sure
+     * the loop comes back to fill it */
+    if(cm->lb && cm->txbufs && coremodel_lb_room(cm))
+        coremodel_wake(cm);
+
+    /* If we deferred some packets, flush them */
+    if(cm->defer_pkt){
+        coremodel_defer_pkt_flush(cm);
+        cm->defer_pkt = 0;
+    }
+    coremodel_ready_flush(cm);
+}
+
+int coremodel_preparefds(void *priv, int nfds, fd_set *readfds, fd_set *writefds)
+{
+    struct coremodel *cm = priv;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+
+    if(!coremodel_online(cm)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return nfds;
+    }
+
+    FD_SET(cm->coremodel_wake_fd[0], readfds);
+    if(cm->coremodel_wake_fd[0] >= nfds)
+        nfds = cm->coremodel_wake_fd[0] + 1;
+    if(cm->timer_fd >= 0) {
+        FD_SET(cm->timer_fd, readfds);
+        if(cm->timer_fd >= nfds)
+            nfds = cm->timer_fd + 1;
+    }
+
+    if(cm->fd >= 0 && cm->rxqwp - cm->rxqrp < cm->rxq_size && !cm->connecting) {
+        FD_SET(cm->fd, readfds);
+        if(cm->fd >= nfds)
+            nfds = cm->fd + 1;
+    }
+    if(cm->fd >= 0 && (cm->txbufs || cm->connecting)) {
+        FD_SET(cm->fd, writefds);
+        if(cm->fd >= nfds)
+            nfds = cm->fd + 1;
+    }
+
+    coremodel_prepare_int(cm);
+
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return nfds;
+}
+
+/* Write as much of the transmit queue as the socket accepts, gathering up to
+ * TX_IOV queued packets per writev(2); must be called with coremodel_mutex
+ * held.
+ * Returns error flag.
+ */
+static int coremodel_flush_tx(struct coremodel *cm)
+{
+    struct iovec iov[TX_IOV];
+    struct coremodel_txbuf *txb;
+    size_t total;
+    ssize_t res;
+    int niov, partial;
+
+    while(cm->txbufs) {
+        total = 0;
+        for(niov=0,txb=cm->txbufs; txb && niov<TX_IOV; niov++,txb=txb->next) {
+            iov[niov].iov_base = txb->buf + txb->rptr;
+            iov[niov].iov_len = txb->size - txb->rptr;
+            total += iov[niov].iov_len;
+        }
+
+        res = cm->xport->writev(cm, iov, niov);
+        if(res == 0) {
+            cm->xport->close(cm);
+            errno = ECONNRESET;
+            return -errno;
+        }
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            res = errno;
+            cm->xport->close(cm);
+            errno = res;
+            return -errno;
+        }
+        cm->stats.tx_writes ++;
+
+        /* A short write means the socket buffer is full */
+        partial = (res < total);
+        while(res) {
+            txb = cm->txbufs;
+            if(res < txb->size - txb->rptr) {
+                txb->rptr += res;
+                break;
+            }
+            res -= txb->size - txb->rptr;
+            cm->txbufs = txb->next;
+            if(!cm->txbufs)
+                cm->etxbufs = &cm->txbufs;
+            coremodel_tx_free(cm, txb);
+        }
+        coremodel_tx_drained(cm);
+
+        if(partial)
+            break;
+    }
+
+    return 0;
+}
+
+/* Write the transmit queue from a producer while the thread servicing the
+ * connection is in a callback on another thread; must be called with
+ * coremodel_mutex held. A write error is left for the loop to report. */
+static void coremodel_flush_producer(struct coremodel *cm)
+{
+    int res;
+
+    if(cm->tx_err || cm->connecting || (cm->fd < 0 && !cm->lb))
+        return;
+    res = coremodel_flush_tx(cm);
+    if(res) {
+        cm->tx_err = res;
+        coremodel_wake(cm);
+    } else
+        coremodel_epoll_update(cm);
+}
+
+static int coremodel_process_io(struct coremodel *cm, unsigned rdflag, unsigned wrflag, unsigned wkflag)
+{
+    unsigned offs;
+    int step, res;
+    char tmp[16];
+
+    if(wkflag) {
+        /* Re-arm before draining, so a wake racing with this is not lost */
+        __atomic_store_n(&cm->wake_pending, 0, __ATOMIC_RELEASE);
+        while(1) {
+            res = read(cm->coremodel_wake_fd[0], &tmp, sizeof(tmp));
+            if(res <= 0)
+                break;
         }
+        if(cm->timer_fd >= 0)
+            res = read(cm->timer_fd, &tmp, sizeof(tmp));
+    }
+    coremodel_drain_submit(cm);
+
+    if(cm->tx_err) {
+        res = cm->tx_err;
+        cm->tx_err = 0;
+        return res;
+    }
+    if(cm->fd < 0 && !cm->lb)
         return 0;
+
+    /* A loopback queue has no readiness to poll; it wakes the loop instead */
+    if(cm->lb)
+        rdflag = wrflag = 1;
+
+    if(cm->connecting) {
+        res = coremodel_connect_poll(cm, rdflag || wrflag);
+        if(res < 0 && !cm->opts.reconnect_ms)
+            fprintf(stderr, "[coremodel] Failed to connect: %s.\n", strerror(-res));
+        if(res)
+            return res < 0 ? res : 0;
+        rdflag = 0;
+        wrflag = 1;
+    }
+
+    if(rdflag)
+        while(1) {
+            step = cm->rxq_size - (cm->rxqwp - cm->rxqrp);
+            if(!step)
+                break;
+            offs = cm->rxqwp & (cm->rxq_size - 1);
+            if(step > cm->rxq_size - offs && !cm->rxq_mirror)
+                step = cm->rxq_size - offs;
+            res = cm->xport->read(cm, cm->rxq + offs, step);
+            if(res == 0) {
+                cm->xport->close(cm);
+                errno = ECONNRESET;
+                return -errno;
+            }
+            if(res < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+
+                res = errno;
+                cm->xport->close(cm);
+                errno = res;
+                return -errno;
+            }
+            cm->rxqwp += res;
+            cm->stats.rx_reads ++;
+        }
+
+    coremodel_process_rxq(cm);
+
+    if(wrflag || (cm->txbufs && !cm->txflag)) {
+        res = coremodel_flush_tx(cm);
+        if(res)
+            return res;
     }
 
+    coremodel_epoll_update(cm);
     return 0;
 }
 
-int coremodel_can_rx_busy(void *can)
+/* Service the connection; must be called with coremodel_mutex held.
+ *  rdflag      socket is readable
+ *  wrflag      socket is writable
+ *  wkflag      wake-up pipe or reconnect timer is readable
+ * In reconnect mode a failed connection is dropped and retried instead of
+ * being reported. Timers that are due run last.
+ * Returns error flag.
+ */
+static int coremodel_process_int(struct coremodel *cm, unsigned rdflag, unsigned wrflag, unsigned wkflag)
 {
-    struct coremodel_if *cif = can;
-    return cif->ebusy;
+    uint64_t moved;
+    int res;
+
+    /* Another thread may be in a callback, dispatching from the receive ring */
+    coremodel_cb_wait(cm);
+    moved = cm->stats.rx_reads + cm->stats.tx_writes;
+    if(cm->wheel)
+        cm->wheel->sleep_us = 0;
+    res = coremodel_process_io(cm, rdflag, wrflag, wkflag);
+    if(cm->opts.spin_us && cm->stats.rx_reads + cm->stats.tx_writes != moved)
+        cm->active_us = coremodel_get_microtime();
+    if(res && cm->opts.reconnect_ms) {
+        coremodel_drop(cm, -res);
+        res = 0;
+    }
+    if(cm->fd < 0 && cm->down_since)
+        coremodel_reconnect(cm);
+    coremodel_gpio_bank_flush(cm);
+    if(!res && cm->wheel)
+        coremodel_timer_expire(cm);
+    coremodel_ready_flush(cm);
+    coremodel_tx_writable(cm);
+    return res;
 }
 
-int coremodel_can_rx(void *can, uint64_t *ctrl, uint8_t *data)
+int coremodel_processfds(void *priv, fd_set *readfds, fd_set *writefds)
 {
-    struct coremodel_if *cif = can;
-    struct coremodel *cm;
-    unsigned dlc, dlen;
-    struct coremodel_packet pkt = { .pkt = PKT_CAN_RX };
-    struct { uint64_t ctrl[2]; uint8_t data[2048]; } edata;
-
-    if(!cif)
-        return 1;
-    cm = cif->cm;
-
-    dlc = (ctrl[0] & CAN_CTRL_DLC_MASK) >> CAN_CTRL_DLC_SHIFT;
-    dlen = (dlc < 16) ? coremodel_can_datalen[dlc] : dlc + 1;
+    struct coremodel *cm = priv;
+    unsigned rdflag = 0, wrflag = 0, wkflag;
+    int res;
 
     pthread_mutex_lock(&cm->coremodel_mutex);
-    if(cif->ebusy || (dlen && !data)){
+
+    cm->coremodel_need_wake = 0;
+    if(!coremodel_online(cm)) {
         pthread_mutex_unlock(&cm->coremodel_mutex);
-        return 1;
+        errno = ENOTCONN;
+        return -errno;
     }
 
-    cif->trnidx = (cif->trnidx + 1) & 255;
-    memcpy(&edata.ctrl, ctrl, sizeof(edata.ctrl));
-    if(dlen)
-        memcpy(edata.data, data, dlen);
-
-    pkt.len = sizeof(pkt) + sizeof(edata.ctrl) + dlen;
-    pkt.conn = cif->conn;
-    pkt.bflag = cif->trnidx;
-    pkt.hflag = 0;
-    coremodel_push_packet(cif->cm, &pkt, (void *)&edata);
+    if(cm->fd >= 0) {
+        rdflag = FD_ISSET(cm->fd, readfds);
+        wrflag = FD_ISSET(cm->fd, writefds);
+    }
+    wkflag = FD_ISSET(cm->coremodel_wake_fd[0], readfds) || (cm->timer_fd >= 0 && FD_ISSET(cm->timer_fd, readfds));
+    res = coremodel_process_int(cm, rdflag, wrflag, wkflag);
 
-    cif->ebusy = 1;
     pthread_mutex_unlock(&cm->coremodel_mutex);
-    return 0;
+    return res;
 }
 
-void coremodel_can_ready(void *can)
+#ifdef __linux__
+/* epoll_wait(2) with a timeout in microseconds (-1 for none); rounded up to
+ * milliseconds where epoll_pwait2(2) is not available. */
+static int coremodel_epoll_wait(int epfd, struct epoll_event *eevts, int maxevts, long long timeout)
 {
-    struct coremodel_if *cif = can;
-    struct coremodel *cm = cif->cm;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+    static unsigned no_pwait2;
+    struct timespec tsp;
+    int res;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    coremodel_ready_int(can);
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+    if(timeout >= 0 && !__atomic_load_n(&no_pwait2, __ATOMIC_RELAXED)) {
+        tsp.tv_sec = timeout / 1000000;
+        tsp.tv_nsec = (timeout % 1000000) * 1000;
+        res = epoll_pwait2(epfd, eevts, maxevts, &tsp, NULL);
+        if(res >= 0 || errno != ENOSYS)
+            return res;
+        __atomic_store_n(&no_pwait2, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    if(timeout >= 0)
+        timeout = (timeout + 999) / 1000;
+    return epoll_wait(epfd, eevts, maxevts, timeout > INT_MAX ? INT_MAX : timeout);
 }
 
-static int coremodel_advance_if_event(struct coremodel_if *cif, struct coremodel_packet *pkt)
+/* Update epoll interest of the socket to match queue state; must be called
+ * with coremodel_mutex held. EPOLLOUT is only requested while there is
+ * something to transmit. */
+static void coremodel_epoll_update(struct coremodel *cm)
 {
-    uint64_t *data;
+    struct epoll_event eevt = { 0 };
+    unsigned mask = 0;
 
-    switch(pkt->pkt) {
-    case PKT_EVENT_UPDATE:
-        data = (void *)(pkt + 1);
-        switch(pkt->bflag) {
-        case EVENT_UPDATE_NORMAL:
-        case EVENT_UPDATE_INITIAL:
-            if(cif->eventf->update && pkt->len >= 16)
-                cif->eventf->update(cif->priv, data[0], data[1], pkt->bflag == EVENT_UPDATE_INITIAL);
-            break;
-        case EVENT_UPDATE_ATOMIC:
-            if(cif->eventf->atresp && pkt->len >= 16)
-                cif->eventf->atresp(cif->priv, data[0], data[1]);
-        }
+    if(cm->epfd < 0 || cm->fd < 0)
+        return;
+
+    if(cm->rxqwp - cm->rxqrp < cm->rxq_size && !cm->connecting)
+        mask |= EPOLLIN;
+    if(cm->txbufs || cm->connecting)
+        mask |= EPOLLOUT;
+    if(mask == cm->epmask)
+        return;
+
+    eevt.events = mask;
+    eevt.data.fd = cm->fd;
+    if(!epoll_ctl(cm->epfd, EPOLL_CTL_MOD, cm->fd, &eevt))
+        cm->epmask = mask;
+}
+
+static int coremodel_epoll_init(struct coremodel *cm)
+{
+    struct epoll_event eevt = { .events = EPOLLIN };
+
+    if(cm->epfd >= 0)
         return 0;
+    if(!coremodel_online(cm))
+        return -ENOTCONN;
+
+    cm->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(cm->epfd < 0)
+        return -errno;
+
+    eevt.data.fd = cm->coremodel_wake_fd[0];
+    if(epoll_ctl(cm->epfd, EPOLL_CTL_ADD, cm->coremodel_wake_fd[0], &eevt))
+        goto err_epfd;
+
+    if(cm->timer_fd >= 0) {
+        eevt.data.fd = cm->timer_fd;
+        if(epoll_ctl(cm->epfd, EPOLL_CTL_ADD, cm->timer_fd, &eevt))
+            goto err_epfd;
+    }
+
+    if(cm->fd >= 0) {
+        eevt.data.fd = cm->fd;
+        if(epoll_ctl(cm->epfd, EPOLL_CTL_ADD, cm->fd, &eevt))
+            goto err_epfd;
+        cm->epmask = EPOLLIN;
     }
+
+    coremodel_epoll_update(cm);
     return 0;
+
+err_epfd:
+    close(cm->epfd);
+    cm->epfd = -1;
+    return -errno;
 }
 
-void coremodel_event_signal(void *evt, uint64_t data0, uint64_t data1, unsigned chgonly)
+int coremodel_epoll_fd(void *priv)
 {
-    struct coremodel_if *cif = evt;
-    struct coremodel *cm;
-    struct coremodel_packet pkt = { .len = 24, .pkt = PKT_EVENT_SIGNAL };
-    uint64_t data[2] = { data0, data1 };
-
-    if(!cif)
-        return;
-    cm = cif->cm;
+    struct coremodel *cm = priv;
+    int res;
 
     pthread_mutex_lock(&cm->coremodel_mutex);
-    pkt.conn = cif->conn;
-    pkt.bflag = chgonly ? EVENT_SIGNAL_CHANGE : 0;
-
-    coremodel_push_packet(cif->cm, &pkt, data);
+    res = coremodel_epoll_init(cm);
+    if(!res)
+        res = cm->epfd;
     pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
 }
 
-void coremodel_event_atomic(void *evt, uint64_t data0, uint64_t data1, unsigned op)
+/* Wait up to timeout microseconds (-1 for none), or until the next timer, and
+ * service the connection. Returns error flag. */
+static int coremodel_wait_events(struct coremodel *cm, long long timeout)
 {
-    struct coremodel_if *cif = evt;
-    struct coremodel *cm;
-    struct coremodel_packet pkt = { .len = 24, .pkt = PKT_EVENT_SIGNAL };
-    uint64_t data[2] = { data0, data1 };
+    struct epoll_event eevts[3];
+    unsigned rdflag = 0, wrflag = 0, wkflag = 0;
+    int idx, nevts, res;
 
-    if(!cif)
-        return;
-    cm = cif->cm;
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    if(!coremodel_online(cm)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return -ENOTCONN;
+    }
+    res = coremodel_epoll_init(cm);
+    if(res) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return res;
+    }
+    coremodel_prepare_int(cm);
+    timeout = coremodel_timer_clamp(cm, timeout);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+
+    nevts = coremodel_epoll_wait(cm->epfd, eevts, 3, timeout);
 
     pthread_mutex_lock(&cm->coremodel_mutex);
-    pkt.conn = cif->conn;
-    pkt.bflag = op | EVENT_SIGNAL_ATOMIC;
+    cm->coremodel_need_wake = 0;
+    if(!coremodel_online(cm)) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        return -ENOTCONN;
+    }
+
+    for(idx=0; idx<nevts; idx++)
+        if(eevts[idx].data.fd == cm->coremodel_wake_fd[0] || eevts[idx].data.fd == cm->timer_fd)
+            wkflag = 1;
+        else {
+            if(eevts[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                rdflag = 1;
+            if(eevts[idx].events & EPOLLOUT)
+                wrflag = 1;
+        }
+
+    res = coremodel_process_int(cm, rdflag, wrflag, wkflag);
 
-    coremodel_push_packet(cif->cm, &pkt, data);
     pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
 }
 
-void event_signal_wire(void *evt, unsigned val)
+int coremodel_process_events(void *priv)
 {
-    struct coremodel_if *cif = evt;
-    struct coremodel *cm;
-    struct coremodel_packet pkt = { .len = 8, .pkt = PKT_EVENT_SIGNAL, .hflag = val };
+    return coremodel_wait_events(priv, 0);
+}
+#else
+static void coremodel_epoll_update(struct coremodel *cm)
+{
+}
+#endif
 
-    if(!cif)
-        return;
-    cm = cif->cm;
+static uint64_t coremodel_get_microtime(void)
+{
+    struct timespec tsp;
+    clock_gettime(CLOCK_MONOTONIC, &tsp);
+    return tsp.tv_sec * 1000000ul + (tsp.tv_nsec / 1000ul);
+}
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
-    pkt.conn = cif->conn;
+uint64_t coremodel_time_ns(void)
+{
+    struct timespec tsp;
+    clock_gettime(CLOCK_MONOTONIC, &tsp);
+    return tsp.tv_sec * 1000000000ull + tsp.tv_nsec;
+}
 
-    coremodel_push_packet(cif->cm, &pkt, NULL);
-    pthread_mutex_unlock(&cm->coremodel_mutex);
+static void coremodel_timer_link(struct coremodel_wheel *w, struct coremodel_timer *tmr)
+{
+    uint64_t key = (tmr->expires + 999) / 1000;
+    struct coremodel_timer **head;
+    unsigned level, slot;
+
+    /* A timer that is already due fires on the next pass */
+    if(key <= w->now)
+        key = w->now + 1;
+    level = (63 - __builtin_clzll(key ^ w->now)) / WHEEL_SHIFT;
+    slot = (key >> (level * WHEEL_SHIFT)) & (WHEEL_SLOTS - 1);
+
+    head = &w->slot[level][slot];
+    tmr->level = level;
+    tmr->slot = slot;
+    tmr->next = *head;
+    if(tmr->next)
+        tmr->next->pprev = &tmr->next;
+    tmr->pprev = head;
+    *head = tmr;
+    w->used[level] |= 1ull << slot;
 }
 
-static int coremodel_advance_if_eth(struct coremodel_if *cif, struct coremodel_packet *pkt)
+static void coremodel_timer_unlink(struct coremodel_wheel *w, struct coremodel_timer *tmr)
 {
-    int res;
+    if(!tmr->pprev)
+        return;
+    *tmr->pprev = tmr->next;
+    if(tmr->next)
+        tmr->next->pprev = tmr->pprev;
+    tmr->pprev = NULL;
+    if(tmr->level < WHEEL_LEVELS && !w->slot[tmr->level][tmr->slot])
+        w->used[tmr->level] &= ~(1ull << tmr->slot);
+}
 
-    switch(pkt->pkt) {
-    case PKT_ETH_TX:
-        if(cif->busy)
-            return 1;
-        if(cif->ethf->tx)
-            res = cif->ethf->tx(cif->priv, (pkt->len - 8) - cif->offs, pkt->data + cif->offs);
-        else
-            res = (pkt->len - 8) - cif->offs;
-        if(!res) {
-            cif->busy = 1;
-            break;
+/* Find the earliest armed slot. Returns its start in microseconds, a lower
+ * bound for the next expiry, or 0 if no timer is armed. */
+static uint64_t coremodel_timer_first(struct coremodel_wheel *w, unsigned *plevel)
+{
+    unsigned level, shift;
+    uint64_t base;
+
+    for(level=0; level<WHEEL_LEVELS; level++)
+        if(w->used[level]) {
+            shift = level * WHEEL_SHIFT;
+            base = (shift + WHEEL_SHIFT < 64) ? w->now & ~((1ull << (shift + WHEEL_SHIFT)) - 1) : 0;
+            *plevel = level;
+            return base | ((uint64_t)__builtin_ctzll(w->used[level]) << shift);
         }
-        cif->offs += res;
-        if(cif->offs < pkt->len - 8)
-            return 1;
-        cif->offs = 0;
-        break;
-    case PKT_ETH_RX_ACK:
-        if(!cif->cred) {
-            cif->cred += pkt->hflag;
-            if(cif->ethf->rxrdy)
-                cif->ethf->rxrdy(cif->priv);
-        } else
-            cif->cred += pkt->hflag;
-        break;
-    }
-
     return 0;
 }
 
-int coremodel_eth_rx(void *eth, unsigned len, uint8_t *data)
+/* Run the timers that are due, moving the others down the wheel as their
+ * slots come up; must be called with coremodel_mutex held. A periodic timer
+ * that fell behind skips the periods it missed. */
+static void coremodel_timer_expire(struct coremodel *cm)
 {
-    struct coremodel_if *cif = eth;
-    struct coremodel_packet pkt = {
-        .len = sizeof(pkt) + len,
-        .pkt = PKT_ETH_RX,
-        .conn = cif->conn
-    };
-    struct coremodel *cm;
+    struct coremodel_wheel *w = cm->wheel;
+    uint64_t now = coremodel_get_microtime(), first, late;
+    struct coremodel_timer *pend, *tmr;
+    unsigned level, slot;
+
+    while((first = coremodel_timer_first(w, &level)) && first <= now) {
+        w->now = first;
+        slot = (first >> (level * WHEEL_SHIFT)) & (WHEEL_SLOTS - 1);
+        pend = w->slot[level][slot];
+        w->slot[level][slot] = NULL;
+        w->used[level] &= ~(1ull << slot);
+
+        /* Callbacks may delete or re-arm timers still on this list */
+        pend->pprev = &pend;
+        for(tmr=pend; tmr; tmr=tmr->next)
+            tmr->level = WHEEL_LEVELS;
+
+        while(pend) {
+            tmr = pend;
+            coremodel_timer_unlink(w, tmr);
+            if((tmr->expires + 999) / 1000 > w->now) {
+                coremodel_timer_link(w, tmr);
+                continue;
+            }
+            if(tmr->period) {
+                tmr->expires += tmr->period;
+                if(tmr->expires <= now * 1000) {
+                    late = (now * 1000 - tmr->expires) / tmr->period + 1;
+                    tmr->expires += late * tmr->period;
+                    cm->stats.timer_overruns += late;
+                }
+                coremodel_timer_link(w, tmr);
+            }
+            cm->stats.timers_fired ++;
+            coremodel_cb_enter(cm);
+            tmr->cb(tmr->priv);
+            coremodel_cb_exit(cm);
+        }
+    }
+    if(now > w->now)
+        w->now = now;
+}
 
-    if(!cif || !cif->cred)
-        return 0;
-    cm = cif->cm;
+/* Clamp a wait in microseconds (-1 for none) to the earliest timer, and note
+ * when the loop will wake up, so that arming an earlier timer meanwhile wakes
+ * it; must be called with coremodel_mutex held. */
+static long long coremodel_timer_clamp(struct coremodel *cm, long long timeout)
+{
+    struct coremodel_wheel *w = cm->wheel;
+    uint64_t now, first;
+    unsigned level;
+    long long left;
+
+    if(!w)
+        return timeout;
+    now = coremodel_get_microtime();
+    first = coremodel_timer_first(w, &level);
+    if(first) {
+        left = first > now ? first - now : 0;
+        if(timeout < 0 || left < timeout)
+            timeout = left;
+    }
+    w->sleep_us = timeout < 0 ? UINT64_MAX : now + timeout;
+    return timeout;
+}
+
+/* Optionally run due timers, then return when the next one is due in
+ * microseconds, or UINT64_MAX if none is armed; for loops that service the
+ * connection only when it is ready. Arming an earlier timer meanwhile wakes
+ * the connection. Without a timer fd, a connect deadline or reconnect attempt
+ * counts as a timer too. */
+static uint64_t coremodel_timer_service(struct coremodel *cm, unsigned expire)
+{
+    uint64_t due = UINT64_MAX, when;
+    unsigned level;
 
     pthread_mutex_lock(&cm->coremodel_mutex);
-    if(coremodel_push_packet(cif->cm, &pkt, data)) {
-        pthread_mutex_unlock(&cm->coremodel_mutex);
-        return 1;
+    if(cm->wheel) {
+        if(expire) {
+            coremodel_cb_wait(cm);
+            coremodel_timer_expire(cm);
+            coremodel_ready_flush(cm);
+        }
+        due = coremodel_timer_first(cm->wheel, &level);
+        if(!due)
+            due = UINT64_MAX;
+        cm->wheel->sleep_us = due;
+    }
+    if(cm->timer_fd < 0) {
+        when = coremodel_connect_due(cm);
+        if(when < due)
+            due = when;
     }
-
-    cif->cred --;
     pthread_mutex_unlock(&cm->coremodel_mutex);
-
-    return 0;
+    return due;
 }
 
-void coremodel_eth_ready(void *eth)
+long long coremodel_timer_next(void *priv)
 {
-    coremodel_ready_int(eth);
+    struct coremodel *cm = priv;
+    long long res;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    res = coremodel_timer_clamp(cm, -1);
+    if(cm->timer_fd < 0)
+        res = coremodel_connect_wait(cm, res);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return res;
 }
 
-static void coremodel_advance_if(struct coremodel_if *cif)
+/* Arm a timer, or disarm it for a zero deadline; must be called with
+ * coremodel_mutex held. */
+static void coremodel_timer_set(struct coremodel_timer *tmr, uint64_t deadline_ns, uint64_t period_ns)
 {
-    struct coremodel_rxbuf *rxb, **prxb;
-    int res;
+    struct coremodel_wheel *w = tmr->cm->wheel;
 
-    /* Defer processing packets on this cif */
-    if(cif->defer_pkt)
+    coremodel_timer_unlink(w, tmr);
+    tmr->expires = deadline_ns;
+    tmr->period = period_ns;
+    if(!deadline_ns)
         return;
-
-    for(prxb=&cif->rxbufs; *prxb; ) {
-        rxb = *prxb;
-        switch(cif->type) {
-        case COREMODEL_UART:
-            res = coremodel_advance_if_uart(cif, &rxb->pkt);
-            break;
-        case COREMODEL_I2C:
-            res = coremodel_advance_if_i2c(cif, &rxb->pkt);
-            break;
-        case COREMODEL_SPI:
-            res = coremodel_advance_if_spi(cif, &rxb->pkt);
-            break;
-        case COREMODEL_GPIO:
-            res = coremodel_advance_if_gpio(cif, &rxb->pkt);
-            break;
-        case COREMODEL_USBH:
-            res = coremodel_advance_if_usbh(cif, &rxb->pkt);
-            break;
-        case COREMODEL_CAN:
-            res = coremodel_advance_if_can(cif, &rxb->pkt);
-            break;
-        case COREMODEL_ETH:
-            res = coremodel_advance_if_eth(cif, &rxb->pkt);
-            break;
-        case COREMODEL_EVENT:
-            res = coremodel_advance_if_event(cif, &rxb->pkt);
-            break;
-        default:
-            res = 0;
-        }
-        if(res > 0)
-            break;
-        if(res == 0) {
-            if(!rxb->next)
-                cif->erxbufs = prxb;
-            *prxb = rxb->next;
-            free(rxb);
-            prxb = &cif->rxbufs;
-            continue;
-        }
-        if(res == -2) {
-            prxb = &cif->rxbufs;
-            continue;
-        }
-        prxb = &rxb->next;
-    }
+    coremodel_timer_link(w, tmr);
+    if(w->sleep_us && (deadline_ns + 999) / 1000 < w->sleep_us)
+        coremodel_wake(tmr->cm);
 }
 
-static int coremodel_process_packet(struct coremodel *cm, struct coremodel_packet *pkt)
+void *coremodel_timer_add(void *priv, uint64_t deadline_ns, uint64_t period_ns, void (*cb)(void *priv), void *cbpriv)
 {
-    struct coremodel_if *cif;
-    struct coremodel_rxbuf *rxb;
+    struct coremodel *cm = priv;
+    struct coremodel_timer *tmr;
+    struct coremodel_wheel *w;
 
-    if(pkt->conn == CONN_QUERY) {
-        if(cm->query)
-            switch(pkt->pkt) {
-            case PKT_QUERY_RSP_LIST:
-                return coremodel_process_list_response(cm, pkt);
-            case PKT_QUERY_RSP_CONN:
-                return coremodel_process_conn_response(cm, pkt);
-            }
-        return 0;
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    if(!cm->wheel) {
+        cm->wheel = calloc(1, sizeof(*cm->wheel));
+        if(cm->wheel) {
+            cm->wheel->now = coremodel_get_microtime();
+            /* The loop may be asleep without having seen a wheel yet */
+            cm->wheel->sleep_us = UINT64_MAX;
+        }
+    }
+    w = cm->wheel;
+    tmr = w ? calloc(1, sizeof(*tmr)) : NULL;
+    if(!tmr) {
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        fprintf(stderr, "[coremodel] Memory allocation error.\n");
+        return NULL;
     }
 
-    for(cif=cm->ifs; cif; cif=cif->next)
-        if(cif->conn == pkt->conn)
-            break;
-    if(!cif)
-        return 0;
+    tmr->cm = cm;
+    tmr->cb = cb;
+    tmr->priv = cbpriv;
+    tmr->tnext = w->timers;
+    if(tmr->tnext)
+        tmr->tnext->tpprev = &tmr->tnext;
+    tmr->tpprev = &w->timers;
+    w->timers = tmr;
 
-    rxb = calloc(1, sizeof(*rxb) + pkt->len - 8);
-    if(!rxb)
-        return 1;
-    memcpy(&rxb->pkt, pkt, pkt->len);
-    *cif->erxbufs = rxb;
-    cif->erxbufs = &(rxb->next);
+    coremodel_timer_set(tmr, deadline_ns, period_ns);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    return tmr;
+}
 
-    cm->defer_pkt |= cif->defer_pkt = (cm->conn_if == cif);
-    coremodel_advance_if(cif);
-    return 0;
+void coremodel_timer_mod(void *timer, uint64_t deadline_ns, uint64_t period_ns)
+{
+    struct coremodel_timer *tmr = timer;
+    struct coremodel *cm = tmr->cm;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_timer_set(tmr, deadline_ns, period_ns);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
 }
 
-static void coremodel_process_rxq(void *priv)
+static void coremodel_timer_free(struct coremodel_wheel *w, struct coremodel_timer *tmr)
 {
-    struct coremodel *cm = priv;
-    unsigned len, dlen, offs, step;
-    uint8_t pkt[MAX_PKT], *buf;
+    coremodel_timer_unlink(w, tmr);
+    *tmr->tpprev = tmr->tnext;
+    if(tmr->tnext)
+        tmr->tnext->tpprev = tmr->tpprev;
+    free(tmr);
+}
 
-    while(cm->rxqwp - cm->rxqrp >= 8) {
-        offs = cm->rxqrp % RX_BUF;
-        if(cm->rxqrp == RX_BUF - 1) {
-            len = cm->rxq[RX_BUF - 1];
-            len |= 256 * cm->rxq[0];
-        } else
-            len = *(uint16_t *)(cm->rxq + offs);
-        dlen = (len + 3) & ~3;
-        if(cm->rxqwp - cm->rxqrp < dlen)
-            break;
+void coremodel_timer_del(void *timer)
+{
+    struct coremodel_timer *tmr = timer;
+    struct coremodel *cm;
 
-        if(dlen > MAX_PKT) {
-            cm->rxqrp += dlen;
-            continue;
-        }
+    if(!tmr)
+        return;
+    cm = tmr->cm;
 
-        step = RX_BUF - offs;
-        if(step < dlen) {
-            memcpy(pkt, cm->rxq + offs, step);
-            memcpy(pkt + step, cm->rxq, dlen - step);
-            buf = pkt;
-        } else
-            buf = cm->rxq + offs;
-        if(coremodel_process_packet(cm, (void *)buf))
-            break;
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    coremodel_timer_free(cm->wheel, tmr);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
 
-        cm->rxqrp += dlen;
-    }
+static void coremodel_timer_free_all(struct coremodel *cm)
+{
+    if(!cm->wheel)
+        return;
+    while(cm->wheel->timers)
+        coremodel_timer_free(cm->wheel, cm->wheel->timers);
+    free(cm->wheel);
+    cm->wheel = NULL;
 }
 
-static void coremodel_defer_pkt_flush(struct coremodel *cm)
+/* Busy-poll mode: service the connection with non-blocking reads, dropping
+ * the mutex between polls, until it has been idle for spin_us or the loop is
+ * due to return. A wake-up is picked up from wake_pending instead of the fd.
+ * Returns error flag.
+ */
+static int coremodel_spin(struct coremodel *cm, long long usec, long long end_us, unsigned query)
 {
-    struct coremodel_if *cif;
+    uint64_t now_us, moved;
+    unsigned wkflag;
+    int res = 0;
 
-    cif = cm->ifs;
-    while(cif){
-        if(cif->defer_pkt){
-            cif->defer_pkt = 0;
-            coremodel_advance_if(cif);
+    while(!query || cm->query) {
+        pthread_mutex_lock(&cm->coremodel_mutex);
+        now_us = coremodel_get_microtime();
+        if(!cm->opts.spin_us || now_us - cm->active_us >= cm->opts.spin_us || (usec >= 0 && (long long)now_us > end_us) ||
+           (cm->fd < 0 && !cm->lb) || cm->connecting) {
+            pthread_mutex_unlock(&cm->coremodel_mutex);
+            break;
         }
 
-        cif = cif->next;
+        coremodel_prepare_int(cm);
+        cm->coremodel_need_wake = 0;
+        moved = cm->stats.rx_reads + cm->stats.tx_writes;
+        wkflag = __atomic_load_n(&cm->wake_pending, __ATOMIC_ACQUIRE);
+        res = coremodel_process_int(cm, 1, cm->txbufs != NULL, wkflag);
+        cm->stats.spin_polls ++;
+        if(cm->stats.rx_reads + cm->stats.tx_writes != moved)
+            cm->stats.spin_hits ++;
+        pthread_mutex_unlock(&cm->coremodel_mutex);
+        if(res)
+            break;
+        sched_yield();
     }
+    return res;
 }
 
-int coremodel_preparefds(void *priv, int nfds, fd_set *readfds, fd_set *writefds)
+static int coremodel_mainloop_int(struct coremodel *cm, long long usec, unsigned query)
 {
-    struct coremodel *cm = priv;
+    long long now_us = coremodel_get_microtime();
+    long long end_us = now_us + usec;
+    fd_set readfds, writefds;
+    struct timeval tv = { 0, 0 };
+    long long tmo;
+    int res, nfds;
 
+#ifdef __linux__
     pthread_mutex_lock(&cm->coremodel_mutex);
+    res = coremodel_epoll_init(cm);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+    if(!res) {
+        while((usec < 0 || end_us >= now_us) && (!query || cm->query)) {
+            res = coremodel_spin(cm, usec, end_us, query);
+            if(res)
+                return res;
+            if(query && !cm->query)
+                break;
+            now_us = coremodel_get_microtime();
+            if(usec >= 0 && end_us < now_us)
+                break;
+            res = coremodel_wait_events(cm, coremodel_connect_wait(cm, usec >= 0 ? end_us - now_us : -1));
+            if(res)
+                return res;
+            now_us = coremodel_get_microtime();
+        }
+        return 0;
+    }
+#endif
 
-    if(cm->fd < 0) {
+    while((usec < 0 || end_us >= now_us) && (!query || cm->query)) {
+        res = coremodel_spin(cm, usec, end_us, query);
+        if(res)
+            return res;
+        if(query && !cm->query)
+            break;
+        now_us = coremodel_get_microtime();
+        if(usec >= 0 && end_us < now_us)
+            break;
+        tmo = coremodel_connect_wait(cm, usec >= 0 ? end_us - now_us : -1);
+        FD_ZERO(&writefds);
+        FD_ZERO(&readfds);
+        pthread_mutex_lock(&cm->coremodel_mutex);
+        coremodel_cb_wait(cm);
+        nfds = coremodel_preparefds(cm, 0, &readfds, &writefds);
+        tmo = coremodel_timer_clamp(cm, tmo);
         pthread_mutex_unlock(&cm->coremodel_mutex);
-        return nfds;
+        if(tmo >= 0) {
+            tv.tv_sec = tmo / 1000000;
+            tv.tv_usec = tmo % 1000000;
+        }
+        select(nfds, &readfds, &writefds, NULL, tmo >= 0 ? &tv : NULL);
+        res = coremodel_processfds(cm, &readfds, &writefds);
+        if(res)
+            return res;
+        now_us = coremodel_get_microtime();
     }
+    return 0;
+}
 
-    FD_SET(cm->coremodel_wake_fd[0], readfds);
-    if(cm->coremodel_wake_fd[0] >= nfds)
-        nfds = cm->coremodel_wake_fd[0] + 1;
-    cm->coremodel_need_wake = 1;
+int coremodel_mainloop(void *priv, long long usec)
+{
+    return coremodel_mainloop_int(priv, usec, 0);
+}
 
-    if(cm->rxqwp - cm->rxqrp < RX_BUF) {
-        FD_SET(cm->fd, readfds);
-        if(cm->fd >= nfds)
-            nfds = cm->fd + 1;
+struct coremodel_reactor {
+    int epfd;
+    unsigned running;
+    uint64_t due;                   /* earliest timer on the timed list */
+
+    struct coremodel_reactor_conn {
+        struct coremodel_reactor_conn *next;
+        struct coremodel *cm;
+        void (*error)(void *priv, void *cm, int err);
+        void *priv;
+        uint64_t due;               /* its earliest timer, UINT64_MAX for none */
+        struct coremodel_reactor_conn *tnext, **tpprev;
+    } *conns, *dead;
+    struct coremodel_reactor_conn *timed;   /* connections with timers armed */
+};
+
+/* Note when a connection's next timer is due. Only connections with timers
+ * armed are kept on the timed list, and the reactor only walks it once the
+ * earliest of them is due. */
+static void coremodel_reactor_timed(struct coremodel_reactor *rct, struct coremodel_reactor_conn *rcn, uint64_t due)
+{
+    rcn->due = due;
+    if(due == UINT64_MAX) {
+        if(rcn->tpprev) {
+            *rcn->tpprev = rcn->tnext;
+            if(rcn->tnext)
+                rcn->tnext->tpprev = rcn->tpprev;
+            rcn->tnext = NULL;
+            rcn->tpprev = NULL;
+        }
+        return;
     }
-    if(cm->txbufs) {
-        FD_SET(cm->fd, writefds);
-        if(cm->fd >= nfds)
-            nfds = cm->fd + 1;
+    if(!rcn->tpprev) {
+        rcn->tnext = rct->timed;
+        if(rcn->tnext)
+            rcn->tnext->tpprev = &rcn->tnext;
+        rcn->tpprev = &rct->timed;
+        rct->timed = rcn;
     }
-    cm->txflag = 0;
+    if(due < rct->due)
+        rct->due = due;
+}
 
-    /* If we deferred some packets, flush them */
-    if(cm->defer_pkt){
-        coremodel_defer_pkt_flush(cm);
-        cm->defer_pkt = 0;
+/* Run the timers that are due on every connection, and find the next one. */
+static void coremodel_reactor_timers(struct coremodel_reactor *rct)
+{
+    struct coremodel_reactor_conn *rcn, *nrcn;
+    uint64_t now = coremodel_get_microtime(), due;
+
+    rct->due = UINT64_MAX;
+    for(rcn=rct->timed; rcn; rcn=nrcn) {
+        nrcn = rcn->tnext;
+        if(rcn->due <= now) {
+            due = coremodel_timer_service(rcn->cm, 1);
+            /* A callback may have removed the connection */
+            if(rcn->cm)
+                coremodel_reactor_timed(rct, rcn, due);
+        } else if(rcn->due < rct->due)
+            rct->due = rcn->due;
     }
-
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return nfds;
 }
 
-int coremodel_processfds(void *priv, fd_set *readfds, fd_set *writefds)
+coremodel_reactor_t *coremodel_reactor_create(void)
 {
-    struct coremodel *cm = priv;
-    struct coremodel_txbuf *txb;
-    unsigned offs, tx_flag;
-    int step, res;
-    char tmp[16];
+    struct coremodel_reactor *rct;
 
-    pthread_mutex_lock(&cm->coremodel_mutex);
+    rct = calloc(1, sizeof(*rct));
+    if(!rct)
+        return NULL;
+    rct->due = UINT64_MAX;
 
-    cm->coremodel_need_wake = 0;
-    if(cm->fd < 0) {
-        errno = ENOTCONN;
-        goto err_lock;
+#ifdef __linux__
+    rct->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(rct->epfd < 0) {
+        free(rct);
+        return NULL;
     }
+#else
+    rct->epfd = -1;
+#endif
+    return rct;
+}
 
-    if(FD_ISSET(cm->coremodel_wake_fd[0], readfds)) {
-        while(1) {
-            res = read(cm->coremodel_wake_fd[0], &tmp, sizeof(tmp));
-            if(res <= 0)
-                break;
-        }
+int coremodel_reactor_add(coremodel_reactor_t *rct, void *priv, void (*error)(void *priv, void *cm, int err), void *errpriv)
+{
+    struct coremodel_reactor_conn *rcn;
+#ifdef __linux__
+    struct epoll_event eevt = { .events = EPOLLIN };
+    int fd;
+#endif
+
+    rcn = calloc(1, sizeof(*rcn));
+    if(!rcn)
+        return -ENOMEM;
+    rcn->cm = priv;
+    rcn->error = error;
+    rcn->priv = errpriv;
+    rcn->due = UINT64_MAX;
+
+#ifdef __linux__
+    fd = coremodel_epoll_fd(priv);
+    if(fd < 0) {
+        free(rcn);
+        return fd;
     }
+    eevt.data.ptr = rcn;
+    if(epoll_ctl(rct->epfd, EPOLL_CTL_ADD, fd, &eevt)) {
+        free(rcn);
+        return -errno;
+    }
+#endif
 
-    if(FD_ISSET(cm->fd, readfds))
-        while(1) {
-            step = RX_BUF - (cm->rxqwp - cm->rxqrp);
-            if(!step)
-                break;
-            offs = cm->rxqwp % RX_BUF;
-            if(step > RX_BUF - offs)
-                step = RX_BUF - offs;
-            res = read(cm->fd, cm->rxq + offs, step);
-            if(res == 0) {
-                close(cm->fd);
-                cm->fd = -1;
-                errno = ECONNRESET;
-                goto err_lock;
-            }
-            if(res < 0) {
-                if(errno == EINTR)
-                    continue;
-                if(errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
+    rcn->next = rct->conns;
+    rct->conns = rcn;
+    coremodel_reactor_timed(rct, rcn, coremodel_timer_service(priv, 0));
+    return 0;
+}
 
-                close(cm->fd);
-                cm->fd = -1;
-                goto err_lock;
-            }
-            cm->rxqwp += res;
+static void coremodel_reactor_remove_int(struct coremodel_reactor *rct, struct coremodel_reactor_conn *rcn)
+{
+    struct coremodel_reactor_conn **prcn;
+
+    for(prcn=&rct->conns; *prcn; prcn=&(*prcn)->next)
+        if(*prcn == rcn) {
+            *prcn = rcn->next;
+            break;
         }
 
-    coremodel_process_rxq(priv);
-    tx_flag = cm->txbufs && !cm->txflag;
+#ifdef __linux__
+    if(rcn->cm->epfd >= 0)
+        epoll_ctl(rct->epfd, EPOLL_CTL_DEL, rcn->cm->epfd, NULL);
+#endif
+    rcn->cm = NULL;
+    /* A walk of the timed list may have been cut short; redo it */
+    if(rcn->tpprev)
+        rct->due = 0;
+    coremodel_reactor_timed(rct, rcn, UINT64_MAX);
+
+    /* Events for this connection may still be pending in the current batch */
+    if(rct->running) {
+        rcn->next = rct->dead;
+        rct->dead = rcn;
+    } else
+        free(rcn);
+}
 
-    if(FD_ISSET(cm->fd, writefds) || tx_flag)
-        while(cm->txbufs) {
-            txb = cm->txbufs;
-            step = txb->size - txb->rptr;
-            offs = txb->rptr;
-            res = write(cm->fd, txb->buf + offs, step);
-            if(res == 0) {
-                close(cm->fd);
-                cm->fd = -1;
-                errno = ECONNRESET;
-                goto err_lock;
-            }
-            if(res < 0) {
-                if(errno == EINTR)
-                    continue;
-                if(errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
-                close(cm->fd);
-                cm->fd = -1;
-                goto err_lock;
-            }
-            txb->rptr += res;
-            if(txb->rptr >= txb->size) {
-                cm->txbufs = txb->next;
-                if(!cm->txbufs)
-                    cm->etxbufs = &cm->txbufs;
-                free(txb);
-            }
+void coremodel_reactor_remove(coremodel_reactor_t *rct, void *priv)
+{
+    struct coremodel_reactor_conn *rcn;
+
+    for(rcn=rct->conns; rcn; rcn=rcn->next)
+        if(rcn->cm == priv) {
+            coremodel_reactor_remove_int(rct, rcn);
+            return;
         }
+}
 
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return 0;
+static void coremodel_reactor_error(struct coremodel_reactor *rct, struct coremodel_reactor_conn *rcn, int err)
+{
+    void (*error)(void *priv, void *cm, int err) = rcn->error;
+    void *cm = rcn->cm, *priv = rcn->priv;
 
-err_lock:
-    pthread_mutex_unlock(&cm->coremodel_mutex);
-    return -errno;
+    coremodel_reactor_remove_int(rct, rcn);
+    if(error)
+        error(priv, cm, err);
 }
 
-static uint64_t coremodel_get_microtime(void)
+#ifdef __linux__
+static int coremodel_reactor_poll(struct coremodel_reactor *rct, long long timeout)
 {
-    struct timespec tsp;
-    clock_gettime(CLOCK_MONOTONIC, &tsp);
-    return tsp.tv_sec * 1000000ul + (tsp.tv_nsec / 1000ul);
-}
+    struct epoll_event eevts[64];
+    struct coremodel_reactor_conn *rcn;
+    int idx, nevts, res;
 
-static int coremodel_mainloop_int(struct coremodel *cm, long long usec, unsigned query)
+    nevts = coremodel_epoll_wait(rct->epfd, eevts, sizeof(eevts) / sizeof(eevts[0]), timeout);
+    if(nevts < 0)
+        return -errno;
+
+    for(idx=0; idx<nevts; idx++) {
+        rcn = eevts[idx].data.ptr;
+        if(!rcn->cm)
+            continue;
+        res = coremodel_process_events(rcn->cm);
+        if(res)
+            coremodel_reactor_error(rct, rcn, res);
+        else if(rcn->cm)
+            coremodel_reactor_timed(rct, rcn, coremodel_timer_service(rcn->cm, 0));
+    }
+    return 0;
+}
+#else
+static int coremodel_reactor_poll(struct coremodel_reactor *rct, long long timeout)
 {
-    long long now_us = coremodel_get_microtime();
-    long long end_us = now_us + usec;
+    struct coremodel_reactor_conn *rcn, *nrcn;
     fd_set readfds, writefds;
-    struct timeval tv = { 0, 0 };
-    int res;
+    struct timeval tv;
+    int nfds = 0, res;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    for(rcn=rct->conns; rcn; rcn=rcn->next)
+        if(rcn->cm)
+            nfds = coremodel_preparefds(rcn->cm, nfds, &readfds, &writefds);
+
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+    if(select(nfds, &readfds, &writefds, NULL, timeout >= 0 ? &tv : NULL) < 0)
+        return -errno;
+
+    /* An error callback may remove any connection, which moves it to the
+     * dead list; the rest are picked up again on the next pass */
+    for(rcn=rct->conns; rcn; rcn=nrcn) {
+        nrcn = rcn->next;
+        if(!rcn->cm)
+            continue;
+        res = coremodel_processfds(rcn->cm, &readfds, &writefds);
+        if(res)
+            coremodel_reactor_error(rct, rcn, res);
+        else if(rcn->cm)
+            coremodel_reactor_timed(rct, rcn, coremodel_timer_service(rcn->cm, 0));
+    }
+    return 0;
+}
+#endif
 
-    while((usec < 0 || end_us >= now_us) && (!query || cm->query)) {
-        if(usec >= 0) {
-            tv.tv_sec = (end_us - now_us) / 1000000ull;
-            tv.tv_usec = (end_us - now_us) % 1000000ull;
+int coremodel_reactor_run(coremodel_reactor_t *rct, long long usec)
+{
+    long long now_us = coremodel_get_microtime();
+    long long end_us = now_us + usec, tmo;
+    struct coremodel_reactor_conn *rcn;
+    int res = 0;
+
+    rct->running = 1;
+    while(usec < 0 || end_us >= now_us) {
+        if(!rct->conns) {
+            res = -ENOTCONN;
+            break;
+        }
+        /* Timers run whether or not their connection is ready */
+        if(rct->due <= (uint64_t)now_us) {
+            coremodel_reactor_timers(rct);
+            now_us = coremodel_get_microtime();
+        }
+        tmo = usec >= 0 ? end_us - now_us : -1;
+        if(rct->due != UINT64_MAX && (tmo < 0 || rct->due < (uint64_t)(now_us + tmo)))
+            tmo = rct->due > (uint64_t)now_us ? rct->due - now_us : 0;
+        res = coremodel_reactor_poll(rct, tmo);
+        while(rct->dead) {
+            rcn = rct->dead;
+            rct->dead = rcn->next;
+            free(rcn);
         }
-        FD_ZERO(&writefds);
-        FD_ZERO(&readfds);
-        int nfds = coremodel_preparefds(cm, 0, &readfds, &writefds);
-        if(nfds < 0)
-            return nfds;
-        select(nfds, &readfds, &writefds, NULL, usec >= 0 ? &tv : NULL);
-        res = coremodel_processfds(cm, &readfds, &writefds);
         if(res)
-            return res;
+            break;
         now_us = coremodel_get_microtime();
     }
-    return 0;
+    rct->running = 0;
+    return res;
 }
 
-int coremodel_mainloop(void *priv, long long usec)
+void coremodel_reactor_destroy(coremodel_reactor_t *rct)
 {
-    return coremodel_mainloop_int(priv, usec, 0);
+    while(rct->conns)
+        coremodel_reactor_remove_int(rct, rct->conns);
+    if(rct->epfd >= 0)
+        close(rct->epfd);
+    free(rct);
+}
+
+void coremodel_set_spin(void *priv, unsigned usec)
+{
+    struct coremodel *cm = priv;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    cm->opts.spin_us = usec;
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+void coremodel_batch_begin(void *priv)
+{
+    struct coremodel *cm = priv;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    cm->batch_depth ++;
+}
+
+void coremodel_batch_commit(void *priv)
+{
+    struct coremodel *cm = priv;
+
+    if(cm->batch_depth && !--cm->batch_depth)
+        coremodel_batch_queue(cm);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
+}
+
+void coremodel_get_stats(void *priv, coremodel_stats_t *stats)
+{
+    struct coremodel *cm = priv;
+
+    pthread_mutex_lock(&cm->coremodel_mutex);
+    *stats = cm->stats;
+    stats->tx_queued = __atomic_load_n(&cm->tx_qbytes, __ATOMIC_RELAXED);
+    stats->tx_queued_packets = __atomic_load_n(&cm->tx_qpkts, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cm->coremodel_mutex);
 }
 
 void coremodel_detach(void *handle)
 {
     struct coremodel_packet pkt = { .len = 8, .conn = CONN_QUERY, .pkt = PKT_QUERY_REQ_DISC };
     struct coremodel_if *cif = handle, **pcif;
-    struct coremodel_rxbuf *rxb;
     struct coremodel *cm;
 
     if(!cif)
@@ -1534,59 +4559,102 @@ void coremodel_detach(void *handle)
     cm = cif->cm;
 
     pthread_mutex_lock(&cm->coremodel_mutex);
+    coremodel_cb_wait(cm);
+    coremodel_drain_submit(cm);
     for(pcif=&cif->cm->ifs; *pcif; )
         if(*pcif == cif)
             *pcif = cif->next;
         else
             pcif= &((*pcif)->next);
-
-    while(cif->rxbufs) {
-        rxb = cif->rxbufs;
-        cif->rxbufs = rxb->next;
-        free(rxb);
+    if(cif->rdy)
+        for(pcif=&cm->rdy_ifs; *pcif; pcif=&(*pcif)->rnext)
+            if(*pcif == cif) {
+                *pcif = cif->rnext;
+                break;
+            }
+    if(cif->conn != CONN_QUERY && coremodel_conn_lookup(cm, cif->conn) == cif)
+        coremodel_conn_map_set(cm, cif->conn, NULL);
+    coremodel_free_rx(cm, cif);
+    if(cif->type == COREMODEL_CAN) {
+        free(cif->rxring);
+        cif->rxring = NULL;
     }
 
-    pkt.hflag = cif->conn;
-    coremodel_push_packet(cif->cm, &pkt, NULL);
-    free(cif);
+    if(cif->conn != CONN_QUERY) {
+        pkt.hflag = cif->conn;
+        coremodel_push_packet(cif->cm, &pkt, NULL);
+    }
+    if(coremodel_attach_queued(cm, cif))
+        cif->detached = 1;
+    else {
+        free(cif->req);
+        free(cif);
+    }
     pthread_mutex_unlock(&cm->coremodel_mutex);
 }
 
 void coremodel_disconnect(void *priv)
 {
     struct coremodel *cm = priv;
-    struct coremodel_txbuf *txb;
+    struct coremodel_if *cif;
+    unsigned idx;
 
     while(cm->ifs)
         coremodel_detach(cm->ifs);
-    close(cm->fd);
-    cm->fd = -1;
+    coremodel_drain_submit(cm);
+    cm->xport->close(cm);
+    coremodel_free_ai(cm);
+    cm->connecting = 0;
 
-    close(cm->coremodel_wake_fd[0]);
-    close(cm->coremodel_wake_fd[1]);
-    cm->coremodel_wake_fd[0] = cm->coremodel_wake_fd[1] = -1;
+    coremodel_wake_close(cm);
 
-    while(cm->txbufs) {
-        txb = cm->txbufs;
-        cm->txbufs = txb->next;
-        free(txb);
+    if(cm->epfd >= 0) {
+        close(cm->epfd);
+        cm->epfd = -1;
     }
-    cm->etxbufs = &cm->txbufs;
 
-    cm->rxqwp = cm->rxqrp = 0;
+    coremodel_discard_tx(cm);
+    if(cm->batch) {
+        coremodel_buf_free(cm, cm->batch);
+        cm->batch = NULL;
+        cm->batch_pkts = 0;
+    }
+    coremodel_pool_drain(cm);
+
+    cm->rxqwp = cm->rxqrp = cm->rxq_skip = 0;
 
     coremodel_free_list(cm->device_list);
     cm->device_list = NULL;
     cm->device_list_size = 0;
 
-    free(cm->conn_if);
-    cm->conn_if = NULL;
+    while(cm->conn_if) {
+        cif = cm->conn_if;
+        cm->conn_if = cif->qnext;
+        cif->qnext = NULL;
+        if(cif->detached) {
+            free(cif->req);
+            free(cif);
+        }
+    }
+    cm->econn_if = &cm->conn_if;
 
-    cm->query = 0;
-    coremodel_fini(cm);
-    pthread_mutex_destroy(&cm->coremodel_mutex);
-    pthread_mutexattr_destroy(&cm->coremodel_mutex_attr);
+    if(cm->timer_fd >= 0) {
+        close(cm->timer_fd);
+        cm->timer_fd = -1;
+    }
+    coremodel_timer_free_all(cm);
+    free(cm->target);
+    cm->target = NULL;
+
+    for(idx=0; idx<sizeof(cm->conn_map)/sizeof(cm->conn_map[0]); idx++) {
+        free(cm->conn_map[idx]);
+        cm->conn_map[idx] = NULL;
+    }
 
     cm->coremodel_need_wake = 0;
     cm->query = 0;
+    pthread_cond_destroy(&cm->cb_cond);
+    pthread_mutex_destroy(&cm->coremodel_mutex);
+    pthread_mutexattr_destroy(&cm->coremodel_mutex_attr);
+    coremodel_fini(cm);
 }
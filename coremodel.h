@@ -20,6 +20,105 @@
  */
 int coremodel_connect(void **cm, const char *target);
 
+/* Socket tuning. A zero field leaves the system default. Each field can be
+ * overridden with the environment variable named next to it. */
+typedef struct {
+    int sndbuf;                 /* SO_SNDBUF in bytes (COREMODEL_SNDBUF) */
+    int rcvbuf;                 /* SO_RCVBUF in bytes (COREMODEL_RCVBUF) */
+    int busy_poll;              /* SO_BUSY_POLL in microseconds
+                                   (COREMODEL_BUSY_POLL) */
+    int quickack;               /* re-arm TCP_QUICKACK after every read
+                                   (COREMODEL_QUICKACK) */
+    int priority;               /* SO_PRIORITY (COREMODEL_PRIORITY) */
+    int tos;                    /* IP_TOS, or IPV6_TCLASS for IPv6
+                                   (COREMODEL_TOS) */
+} coremodel_sockopts_t;
+
+/* Connection options. Zero-initialize and set the fields of interest; a
+ * zero field selects the default. */
+typedef struct {
+    unsigned rx_ring_size;      /* receive ring size in bytes; rounded up to a
+                                   power of two of at least 64 KiB, and mapped
+                                   as a mirrored ring where supported */
+    unsigned timeout_ms;        /* give up connecting after this long; 0 waits
+                                   as long as the system does */
+    int family;                 /* AF_INET or AF_INET6 to restrict the address
+                                   family, or 0 (AF_UNSPEC) for either */
+    unsigned nonblock;          /* return as soon as the connection has been
+                                   started; it completes in the event loop */
+    unsigned reconnect_ms;      /* reconnect mode: when the connection fails,
+                                   retry this often and attach every interface
+                                   again; 0 reports the failure instead */
+    void (*link)(void *priv, int up, int err);
+                                /* reconnect mode: called from the event loop
+                                   when the connection goes down, with error
+                                   flag err, and once it is back up with every
+                                   interface attached again */
+    void *link_priv;            /* passed to link */
+    coremodel_sockopts_t sock;  /* socket tuning */
+    unsigned spin_us;           /* busy-poll mode: once data has moved, keep
+                                   polling without blocking for this long
+                                   before sleeping in the event loop; trades
+                                   CPU time for latency */
+    unsigned tx_limit;          /* transmit queue limit in bytes: the functions
+                                   that send data to the VM refuse a packet
+                                   that would take the queue past it; 0 for
+                                   no limit */
+    unsigned tx_limit_packets;  /* transmit queue limit in packets */
+    unsigned tx_low;            /* low watermarks: after a packet was refused,
+                                   writable is called once the queue has */
+    unsigned tx_low_packets;    /* drained down to both; 0 for half the limit */
+    void (*writable)(void *priv);
+                                /* called from the event loop when there is
+                                   room in the transmit queue again */
+    void *writable_priv;        /* passed to writable */
+    unsigned write_through;     /* write packets to the socket from the calling
+                                   thread when nothing is queued ahead of
+                                   them, instead of leaving them for the loop */
+} coremodel_connect_opts_t;
+
+/* Connect to a VM with options. With nonblock set, the instance can be used
+ * right away: packets are queued until the connection is up, and a failed
+ * connection is reported as an error by the event loop functions.
+ *  target      string like "10.10.0.3:1900", "[fd00::3]:1900", "fd00::3", or
+ *              "unix:/path/to/socket" for a unix domain socket
+ *  opts        connection options, or NULL for defaults
+ * Returns error flag.
+ */
+int coremodel_connect_ex(void **cm, const char *target, const coremodel_connect_opts_t *opts);
+
+/* Read back the socket tuning the system actually granted. Buffer sizes are
+ * as reported by getsockopt(2), which on Linux is twice the size requested;
+ * options that do not apply to the socket read as zero.
+ * Returns error flag.
+ */
+int coremodel_get_sockopts(void *cm, coremodel_sockopts_t *sock);
+
+/* Connect to an in-process peer instead of a VM, mostly for tests. The peer
+ * speaks the CoreModel protocol through a pair of byte queues, without system
+ * calls other than waking the event loop when it has something to do.
+ *  peer        set to the handle of the other end
+ *  opts        connection options, or NULL for defaults; only rx_ring_size
+ *              and spin_us apply
+ * Returns error flag.
+ */
+int coremodel_connect_loopback(void **cm, void **peer, const coremodel_connect_opts_t *opts);
+
+/* Read bytes sent by the instance to the loopback peer. May be called from
+ * any thread, but only one at a time.
+ * Returns number of bytes read, 0 if none are queued, or error flag once the
+ * instance has been disconnected. */
+int coremodel_loopback_read(void *peer, void *buf, unsigned len);
+
+/* Send bytes from the loopback peer to the instance. May be called from any
+ * thread, but only one at a time.
+ * Returns number of bytes queued, less than len if the queue is full, or
+ * error flag once the instance has been disconnected. */
+int coremodel_loopback_write(void *peer, const void *buf, unsigned len);
+
+/* Close the loopback peer; the instance sees the connection reset. */
+void coremodel_loopback_close(void *peer);
+
 /* Enumerates devices available in VM.
  * Returns invalid-terminated array of device structs. The array, as well as
  * names in it, is allocated by malloc(3). */
@@ -47,6 +146,28 @@ coremodel_device_list_t *coremodel_list_subdevices(void *priv, int type, const c
 /* Frees a device list */
 void coremodel_free_list(coremodel_device_list_t *list);
 
+/* One interface to attach with coremodel_attach_batch. The fields mirror the
+ * arguments of the matching coremodel_attach_* function. */
+typedef struct {
+    int type;                   /* one of COREMODEL_* constants */
+    const char *name;           /* device name; for COREMODEL_EVENT, the event name */
+    unsigned addr;              /* I2C address, SPI chip select, GPIO pin or USB port */
+    const char *subname;        /* SPI chip select or GPIO pin name, used instead of addr if not NULL */
+    const void *func;           /* set of function callbacks matching type */
+    void *priv;                 /* priv value to pass to each callback */
+    uint16_t flags;             /* I2C/SPI flags, or USB speed */
+    void *handle;               /* set to the interface handle, or NULL on failure */
+} coremodel_attach_req_t;
+
+/* Attach several interfaces at once. All connection requests are sent before
+ * waiting for the first response, so the whole batch costs one round trip.
+ *  cm          coremodel instance
+ *  reqs        array of interfaces to attach; handle is filled in for each
+ *  count       number of entries in reqs
+ * Returns number of interfaces attached, or error flag.
+ */
+int coremodel_attach_batch(void *cm, coremodel_attach_req_t *reqs, unsigned count);
+
 /* UART */
 
 typedef struct {
@@ -73,7 +194,8 @@ void *coremodel_attach_uart(void *cm, const char *name, const coremodel_uart_fun
  *  len         number of bytes to send to the Rx interface
  *  data        data to send
  * Returns a >0 number when this many bytes were accepted, or 0 to signal stall
- * of the Rx interface (CoreModel will call func->rxrdy to un-stall it). */
+ * of the Rx interface (CoreModel will call func->rxrdy to un-stall it) or a
+ * full transmit queue (CoreModel will call opts->writable). */
 int coremodel_uart_rx(void *uart, unsigned len, uint8_t *data);
 
 /* Unstall a stalled Tx interface (signal that CoreModel can once again call
@@ -158,6 +280,26 @@ void *coremodel_attach_spi(void *cm, const char *name, unsigned csel, const core
  * Returns handle of SPI interface, or NULL on failure. */
 void *coremodel_attach_spi_name(void *cm, const char *name, const char *cselname, const coremodel_spi_func_t *func, void *priv, uint16_t flags);
 
+/* Attach to a virtual SPI bus with a transfer size limit. A packet from the VM
+ * is passed to func->xfr in pieces of at most max_xfr bytes, and answered in
+ * one packet of the same size once all of it has been transferred; the
+ * default is 256 bytes. A packet must fit in the receive ring to reach the
+ * model, which holds 4 KiB unless the connection was opened with a larger
+ * rx_ring_size; larger packets are dropped and counted in rx_dropped. If
+ * there is no memory for the response, the packet is transferred in pieces
+ * of the default size instead.
+ *  cm          coremodel instance
+ *  name        name of the SPI bus, depends on the VM
+ *  csel        chip select index, if cselname is NULL
+ *  cselname    chip select name, or NULL
+ *  func        set of function callbacks to attach
+ *  priv        priv value to pass to each callback
+ *  flags       behavior flags of device
+ *  max_xfr     most bytes to pass to one func->xfr call, or 0 for the
+ *              default; clamped to the data in the largest packet
+ * Returns handle of SPI interface, or NULL on failure. */
+void *coremodel_attach_spi_ex(void *cm, const char *name, unsigned csel, const char *cselname, const coremodel_spi_func_t *func, void *priv, uint16_t flags, unsigned max_xfr);
+
 /* Unstall a stalled interface (signal that CoreModel can once again call
  * func->xfr).
  *  spi         handle of SPI interface
@@ -192,8 +334,43 @@ void *coremodel_attach_gpio_name(void *cm, const char *name, const char *pinname
 /* Set a tri-state driver on a GPIO pin.
  *  pin         handle of GPIO interface
  *  drven       driver enable
- *  mvolt       voltage to drive (if enabled) in mV */
-void coremodel_gpio_set(void *pin, unsigned drven, int mvolt);
+ *  mvolt       voltage to drive (if enabled) in mV
+ * Returns 0 on success, 1 if the transmit queue is full or the pin is not
+ * connected. */
+int coremodel_gpio_set(void *pin, unsigned drven, int mvolt);
+
+typedef struct {
+    /* Called by CoreModel with the pins of a bank that were updated since the
+     * last call, once per batch of received data. Pins are numbered by their
+     * position in the pins array given to coremodel_attach_gpio_bank.
+     *  changed     bitmap of updated pins, bit (n & 63) of word n / 64
+     *  mvolt       voltage of every pin of the bank in mV */
+    void (*notify)(void *priv, const uint64_t *changed, const int *mvolt);
+} coremodel_gpio_bank_func_t;
+
+/* Attach to several pins of a virtual GPIO bank at once. All connection
+ * requests are sent before waiting for the first response.
+ *  cm          coremodel instance
+ *  name        name of the GPIO bank, depends on the VM
+ *  pins        pin indices within bank
+ *  count       number of entries in pins
+ *  func        set of function callbacks to attach
+ *  priv        priv value to pass to each callback
+ * Returns handle of GPIO bank, or NULL if any pin failed to attach. */
+void *coremodel_attach_gpio_bank(void *cm, const char *name, const unsigned *pins, unsigned count, const coremodel_gpio_bank_func_t *func, void *priv);
+
+/* Set tri-state drivers on several pins of a GPIO bank, with one write.
+ *  bank        handle of GPIO bank
+ *  mask        bitmap of pins to set, numbered as in notify
+ *  drven       bitmap of driver enables
+ *  mvolt       voltage to drive (if enabled) in mV, for every pin of the bank
+ * Returns 0 on success, 1 if the transmit queue is full, in which case no pin
+ * is set. Pins that are not connected are skipped. */
+int coremodel_gpio_set_multi(void *bank, const uint64_t *mask, const uint64_t *drven, const int *mvolt);
+
+/* Detach a GPIO bank and all its pins.
+ *  bank        handle of GPIO bank */
+void coremodel_detach_gpio_bank(void *bank);
 
 /* USB Host (connect a local USB Device to a Host inside VM) */
 
@@ -282,11 +459,25 @@ void *coremodel_attach_can(void *cm, const char *name, const coremodel_can_func_
  */
 int coremodel_can_rx_busy(void *can);
 
+/*
+ * Set how many packets coremodel_can_rx may queue behind the one the VM has
+ * not completed yet. Queued packets are sent from the event loop as each one
+ * completes, with func->rxcomplete called once per packet in the order they
+ * were queued; a reconnect drops them. A packet that cannot be sent when its
+ * turn comes, for lack of memory, stays at the head of the queue and goes out
+ * ahead of the next packet sent. Call before sending packets.
+ *  can         handle of CAN interface
+ *  depth       number of packets to queue, or 0 to allow one in flight only
+ * Returns 0 on success, 1 if packets are queued or memory ran out.
+ */
+int coremodel_can_set_rx_depth(void *can, unsigned depth);
+
 /* Send a packet to CAN bus.
  *  can         handle of CAN interface
  *  ctrl        control word
  *  data        optional data (if ctrl.DLC != 0)
- * Returns 0 on success, 1 if bus is not available because previous packet hasn't been completed yet. */
+ * Returns 0 on success, 1 if bus is not available because previous packet hasn't been completed yet
+ * (and the queue set with coremodel_can_set_rx_depth is full) or the transmit queue is full. */
 int coremodel_can_rx(void *can, uint64_t *ctrl, uint8_t *data);
 
 /* Unstall a stalled interface (signal that CoreModel can once again call func->tx).
@@ -316,6 +507,7 @@ void *coremodel_attach_eth(void *cm, const char *name, const coremodel_eth_func_
  *  len         number of bytes to send to the Rx interface
  *  data        data to send
  * Returns 0 on success, 1 if bus is not available because previous packet hasn't been completed yet
+ * or the transmit queue is full
  */
 int coremodel_eth_rx(void *eth, unsigned len, uint8_t *data);
 
@@ -338,6 +530,23 @@ int coremodel_preparefds(void *cm, int nfds, fd_set *readfds, fd_set *writefds);
  */
 int coremodel_processfds(void *cm, fd_set *readfds, fd_set *writefds);
 
+#ifdef __linux__
+/* Get an epoll(7) file descriptor that becomes readable whenever the
+ * connection needs servicing. It can be added to the caller's own event loop
+ * instead of using coremodel_preparefds/coremodel_processfds. The descriptor
+ * is owned by the coremodel instance and closed by coremodel_disconnect.
+ *  cm          coremodel instance
+ * Returns file descriptor, or negative error.
+ */
+int coremodel_epoll_fd(void *cm);
+
+/* Process pending events on the coremodel epoll fd; does not block.
+ *  cm          coremodel instance
+ * Returns error flag.
+ */
+int coremodel_process_events(void *cm);
+#endif
+
 /* Simple implementation of a main loop.
  *  cm          coremodel instance
  *  usec        time to spend in loop, in microseconds; negative means forever
@@ -345,7 +554,145 @@ int coremodel_processfds(void *cm, fd_set *readfds, fd_set *writefds);
  */
 int coremodel_mainloop(void *cm, long long usec);
 
-/* Detach any interface.
+/* Current time on the clock timers use, CLOCK_MONOTONIC, in nanoseconds. */
+uint64_t coremodel_time_ns(void);
+
+/* Add a timer that runs on the thread servicing the connection, from the main
+ * loop, the reactor, or the file descriptor functions, one at a time with the
+ * interface callbacks.
+ *  cm          coremodel instance
+ *  deadline_ns when to fire first, as coremodel_time_ns(); 0 adds the timer
+ *              disarmed
+ *  period_ns   interval between later firings; 0 for a one-shot timer. A
+ *              periodic timer that falls behind skips the periods it missed
+ *  cb          function to call
+ *  priv        parameter to cb
+ * Returns timer handle, or NULL on failure.
+ */
+void *coremodel_timer_add(void *cm, uint64_t deadline_ns, uint64_t period_ns, void (*cb)(void *priv), void *priv);
+
+/* Re-arm a timer, replacing its deadline and period; a zero deadline disarms
+ * it. May be called from the timer callback.
+ *  timer       timer handle
+ *  deadline_ns when to fire next
+ *  period_ns   interval between later firings; 0 for a one-shot timer
+ */
+void coremodel_timer_mod(void *timer, uint64_t deadline_ns, uint64_t period_ns);
+
+/* Remove and free a timer. May be called from the timer callback; from
+ * another thread, waits for a callback running there to return. Timers left
+ * are freed by coremodel_disconnect.
+ *  timer       timer handle
+ */
+void coremodel_timer_del(void *timer);
+
+/* Time until the earliest timer is due, for event loops that wait on the
+ * file descriptor functions; they must not sleep longer than this. Where the
+ * system has no timer file descriptor, the connect timeout and the next
+ * reconnect attempt count as timers.
+ *  cm          coremodel instance
+ * Returns microseconds, or -1 if no timer is armed.
+ */
+long long coremodel_timer_next(void *cm);
+
+/* Reactor: drive many coremodel instances from one thread. Only
+ * connections that are ready are serviced on each wakeup. A reactor must be
+ * used from a single thread; connections may be added or removed from within
+ * callbacks. */
+typedef struct coremodel_reactor coremodel_reactor_t;
+
+/* Create a reactor.
+ * Returns reactor, or NULL on failure. */
+coremodel_reactor_t *coremodel_reactor_create(void);
+
+/* Add a coremodel instance to a reactor.
+ *  rct         reactor
+ *  cm          coremodel instance
+ *  error       called when the connection fails; the instance has already
+ *              been removed from the reactor and may be disconnected (optional)
+ *  priv        priv value to pass to error callback
+ * Returns error flag.
+ */
+int coremodel_reactor_add(coremodel_reactor_t *rct, void *cm, void (*error)(void *priv, void *cm, int err), void *priv);
+
+/* Remove a coremodel instance from a reactor.
+ *  rct         reactor
+ *  cm          coremodel instance
+ */
+void coremodel_reactor_remove(coremodel_reactor_t *rct, void *cm);
+
+/* Service all connections of a reactor.
+ *  rct         reactor
+ *  usec        time to spend in loop, in microseconds; negative means forever
+ * Returns error flag (-ENOTCONN once no connections are left).
+ */
+int coremodel_reactor_run(coremodel_reactor_t *rct, long long usec);
+
+/* Free a reactor. Connections are removed but not disconnected. */
+void coremodel_reactor_destroy(coremodel_reactor_t *rct);
+
+/* Connection statistics. */
+typedef struct {
+    uint64_t pool_hits;         /* packet buffers reused from the connection pool */
+    uint64_t pool_misses;       /* packet buffers that had to be allocated */
+    uint64_t tx_packets;        /* packets queued for transmission */
+    uint64_t tx_writes;         /* write system calls on the socket */
+    uint64_t tx_submitted;      /* packets handed over by producers while another thread held the connection */
+    uint64_t rx_packets;        /* packets received */
+    uint64_t rx_reads;          /* read system calls on the socket */
+    uint64_t rx_copies;         /* received packets queued because the interface was busy */
+    uint64_t wakes;             /* wake-ups signalled to the loop thread */
+    uint64_t wakes_elided;      /* wake-ups skipped because one was already pending */
+    uint64_t reconnects;        /* outages recovered from in reconnect mode */
+    uint64_t last_outage_us;    /* last outage, from the drop until every
+                                   interface was attached again */
+    uint64_t last_reattach_us;  /* part of it spent re-attaching interfaces */
+    uint64_t spin_polls;        /* non-blocking polls in busy-poll mode */
+    uint64_t spin_hits;         /* of those, polls that moved data */
+    uint64_t timers_fired;      /* timer callbacks made */
+    uint64_t timer_overruns;    /* periods skipped by timers that fell behind */
+    uint64_t tx_queued;         /* bytes in the transmit queue now */
+    uint64_t tx_queued_packets; /* packets in the transmit queue now */
+    uint64_t tx_queued_max;     /* most bytes the transmit queue has held */
+    uint64_t tx_full;           /* packets refused because the transmit queue was full */
+    uint64_t tx_batches;        /* buffers of packets queued by batches */
+    uint64_t tx_direct;         /* packets written by the calling thread in write-through mode */
+    uint64_t rx_dropped;        /* received packets dropped for being larger than the receive ring */
+} coremodel_stats_t;
+
+/* Change the busy-poll budget of a connection, as spin_us in
+ * coremodel_connect_opts_t. Takes effect the next time the loop would sleep.
+ *  cm          coremodel instance
+ *  usec        time to keep polling after data has moved; 0 to always block
+ */
+void coremodel_set_spin(void *cm, unsigned usec);
+
+/* Read connection statistics.
+ *  cm          coremodel instance
+ *  stats       structure to fill in
+ */
+void coremodel_get_stats(void *cm, coremodel_stats_t *stats);
+
+/* Open a transmit batch. Packets sent to the VM by this thread until the
+ * matching commit are staged in one buffer and queued together, with a single
+ * write and wake-up, and no other packet is sent in between. Batches nest:
+ * begin and commit are counted, so a helper that opens its own batch may be
+ * called inside another one, and only the outermost commit queues the
+ * packets. The instance is locked for the batch: producer calls from other
+ * threads go ahead without waiting, and are sent before or after it, while a
+ * batch on another thread or the loop waits for the commit. Inside a batch,
+ * only call the functions that send data to the VM and the ready functions.
+ *  cm          coremodel instance
+ */
+void coremodel_batch_begin(void *cm);
+
+/* Close a transmit batch opened by this thread.
+ *  cm          coremodel instance
+ */
+void coremodel_batch_commit(void *cm);
+
+/* Detach any interface. Waits for a callback running on another thread to
+ * return, so none is made for the handle afterwards.
  *  handle      handle of UART/I2C/SPI/GPIO interface */
 void coremodel_detach(void *handle);
 
@@ -372,13 +719,17 @@ void *coremodel_attach_event_name(void *cm, const char *evtname, const coremodel
 /* Send a signal to an event.
  *  evt         handle of event interface
  *  data0/1     event data
- *  chgonly     only signal event if data changed */
-void coremodel_event_signal(void *evt, uint64_t data0, uint64_t data1, unsigned chgonly);
+ *  chgonly     only signal event if data changed
+ * Returns 0 on success, 1 if the transmit queue is full or the event is not
+ * connected. */
+int coremodel_event_signal(void *evt, uint64_t data0, uint64_t data1, unsigned chgonly);
 
 /* Send a signal to an event.
  *  evt         handle of event interface
  *  data0/1     event data
- *  op          atomic opcode; if EVENT_OP_RESP is set, atresp will be called later with event data from before the atomic */
+ *  op          atomic opcode; if EVENT_OP_RESP is set, atresp will be called later with event data from before the atomic
+ * Returns 0 on success, 1 if the transmit queue is full or the event is not
+ * connected. */
 #define EVENT_OP_XCHG                   0
 #define EVENT_OP_ADD                    1
 #define EVENT_OP_SUB                    2
@@ -389,16 +740,18 @@ void coremodel_event_signal(void *evt, uint64_t data0, uint64_t data1, unsigned
 #define EVENT_OP_MAX                    7
 #define EVENT_OP_SUBMIN                 8
 #define EVENT_OP_RESP                   0x40
-void coremodel_event_atomic(void *evt, uint64_t data0, uint64_t data1, unsigned op);
+int coremodel_event_atomic(void *evt, uint64_t data0, uint64_t data1, unsigned op);
 
 /* Set value of a wire-type event.
  *  evt         handle of event interface
- *  value       value to put on the wire: LOW, HIGH, LOW | PULSE (pulsed low then back high), HIGH | PULSE (pulsed high then back low), TOGGLE; also | FORCE to force event update */
+ *  value       value to put on the wire: LOW, HIGH, LOW | PULSE (pulsed low then back high), HIGH | PULSE (pulsed high then back low), TOGGLE; also | FORCE to force event update
+ * Returns 0 on success, 1 if the transmit queue is full or the event is not
+ * connected. */
 #define EVENT_WIRE_VALUE_LOW            0x0000
 #define EVENT_WIRE_VALUE_HIGH           0x0001
 #define EVENT_WIRE_VALUE_PULSE          0x0002
 #define EVENT_WIRE_VALUE_TOGGLE         0x4000
 #define EVENT_WIRE_VALUE_FORCE          0x8000
-void event_signal_wire(void *evt, unsigned val);
+int event_signal_wire(void *evt, unsigned val);
 
 #endif
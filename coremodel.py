@@ -35,6 +35,40 @@ class coremodel_device_list_t(ctypes.Structure):
         ("num",         ctypes.c_int, 32)
     ]
 
+LINK = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int, ctypes.c_int)
+TIMER = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+WRITABLE = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+
+class coremodel_sockopts_t(ctypes.Structure):
+    _fields_ = [
+        ("sndbuf",    ctypes.c_int),
+        ("rcvbuf",    ctypes.c_int),
+        ("busy_poll", ctypes.c_int),
+        ("quickack",  ctypes.c_int),
+        ("priority",  ctypes.c_int),
+        ("tos",       ctypes.c_int)
+    ]
+
+class coremodel_connect_opts_t(ctypes.Structure):
+    _fields_ = [
+        ("rx_ring_size", ctypes.c_uint32),
+        ("timeout_ms",   ctypes.c_uint32),
+        ("family",       ctypes.c_int),
+        ("nonblock",     ctypes.c_uint32),
+        ("reconnect_ms", ctypes.c_uint32),
+        ("link",         LINK),
+        ("link_priv",    ctypes.c_void_p),
+        ("sock",         coremodel_sockopts_t),
+        ("spin_us",      ctypes.c_uint32),
+        ("tx_limit",     ctypes.c_uint32),
+        ("tx_limit_packets", ctypes.c_uint32),
+        ("tx_low",       ctypes.c_uint32),
+        ("tx_low_packets", ctypes.c_uint32),
+        ("writable",     WRITABLE),
+        ("writable_priv", ctypes.c_void_p),
+        ("write_through", ctypes.c_uint32)
+    ]
+
 UART_TX = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint8))
 UART_BRK = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
 UART_RXRDY = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
@@ -80,6 +114,13 @@ class coremodel_gpio_func_t(ctypes.Structure):
         ("notify", GPIO_NOTIFY)
     ]
 
+GPIO_BANK_NOTIFY = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_int32))
+
+class coremodel_gpio_bank_func_t(ctypes.Structure):
+    _fields_ = [
+        ("notify", GPIO_BANK_NOTIFY)
+    ]
+
 USB_RST = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
 USB_XFR = ctypes.CFUNCTYPE(ctypes.c_int32, ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint8, ctypes.POINTER(ctypes.c_uint8), ctypes.c_uint32, ctypes.c_uint8)
 
@@ -162,7 +203,7 @@ class coremodel_event_func_t(ctypes.Structure):
 
 class CoreModel(threading.Thread):
 
-    def __init__(self, name, address, port, path):
+    def __init__(self, name, address, port, path, reconnect_ms=0, link=None, spin_us=0, tx_limit=0, tx_limit_packets=0, writable=None, write_through=0):
 
         super().__init__(name=name)
 
@@ -172,6 +213,17 @@ class CoreModel(threading.Thread):
         self.connection = 1
         self.path = path
         self.attached_objs = list()
+        self.reconnect_ms = reconnect_ms
+        self.link = link
+        self.link_cb = LINK(self._link)
+        self.spin_us = spin_us
+        self.tx_limit = tx_limit
+        self.tx_limit_packets = tx_limit_packets
+        self.writable = writable
+        self.writable_cb = WRITABLE(self._writable)
+        self.write_through = write_through
+        self.timers = dict()
+        self.error = 0
 
         self.cycle_time = 100000 # 100ms
         self.stop_event = threading.Event()
@@ -187,6 +239,9 @@ class CoreModel(threading.Thread):
         self.libcm.coremodel_connect.argtypes = [ctypes.POINTER(ctypes.c_void_p), ctypes.c_char_p]
         self.libcm.coremodel_connect.restype = ctypes.c_int
 
+        self.libcm.coremodel_connect_ex.argtypes = [ctypes.POINTER(ctypes.c_void_p), ctypes.c_char_p, ctypes.POINTER(coremodel_connect_opts_t)]
+        self.libcm.coremodel_connect_ex.restype = ctypes.c_int
+
         self.libcm.coremodel_list.argtypes = [ctypes.c_void_p]
         self.libcm.coremodel_list.restype = ctypes.POINTER(coremodel_device_list_t)
 
@@ -220,6 +275,8 @@ class CoreModel(threading.Thread):
 
         self.libcm.coremodel_attach_spi.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32, ctypes.POINTER(coremodel_spi_func_t), ctypes.c_void_p, ctypes.c_uint16]
         self.libcm.coremodel_attach_spi.restype = ctypes.c_void_p
+        self.libcm.coremodel_attach_spi_ex.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32, ctypes.c_char_p, ctypes.POINTER(coremodel_spi_func_t), ctypes.c_void_p, ctypes.c_uint16, ctypes.c_uint32]
+        self.libcm.coremodel_attach_spi_ex.restype = ctypes.c_void_p
 
         self.libcm.coremodel_spi_ready.argtypes = [ctypes.c_void_p]
 
@@ -230,6 +287,16 @@ class CoreModel(threading.Thread):
         self.libcm.coremodel_attach_gpio_name.restype = ctypes.c_void_p
 
         self.libcm.coremodel_gpio_set.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int32]
+        self.libcm.coremodel_gpio_set.restype = ctypes.c_int32
+
+        self.libcm.coremodel_attach_gpio_bank.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_uint32, ctypes.POINTER(coremodel_gpio_bank_func_t), ctypes.c_void_p]
+        self.libcm.coremodel_attach_gpio_bank.restype = ctypes.c_void_p
+
+        self.libcm.coremodel_gpio_set_multi.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_int32)]
+        self.libcm.coremodel_gpio_set_multi.restype = ctypes.c_int32
+
+        self.libcm.coremodel_detach_gpio_bank.argtypes = [ctypes.c_void_p]
+        self.libcm.coremodel_detach_gpio_bank.restype = None
 
         self.libcm.coremodel_attach_usbh.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32, ctypes.POINTER(coremodel_usbh_func_t), ctypes.c_void_p, ctypes.c_uint32]
         self.libcm.coremodel_attach_usbh.restype = ctypes.c_void_p
@@ -243,6 +310,9 @@ class CoreModel(threading.Thread):
         self.libcm.coremodel_can_rx.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint8)]
         self.libcm.coremodel_can_rx.restype = ctypes.c_int32
 
+        self.libcm.coremodel_can_set_rx_depth.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        self.libcm.coremodel_can_set_rx_depth.restype = ctypes.c_int32
+
         self.libcm.coremodel_can_ready.argtypes = [ctypes.c_void_p]
         self.libcm.coremodel_can_ready.restype = None
 
@@ -256,10 +326,28 @@ class CoreModel(threading.Thread):
         self.libcm.coremodel_attach_event_name.restype = ctypes.c_void_p
 
         self.libcm.coremodel_event_signal.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint32]
-        self.libcm.coremodel_event_signal.restype = None
+        self.libcm.coremodel_event_signal.restype = ctypes.c_int32
 
         self.libcm.coremodel_event_atomic.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint32]
-        self.libcm.coremodel_event_atomic.restype = None
+        self.libcm.coremodel_event_atomic.restype = ctypes.c_int32
+
+        self.libcm.coremodel_time_ns.argtypes = []
+        self.libcm.coremodel_time_ns.restype = ctypes.c_uint64
+
+        self.libcm.coremodel_timer_add.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64, TIMER, ctypes.c_void_p]
+        self.libcm.coremodel_timer_add.restype = ctypes.c_void_p
+
+        self.libcm.coremodel_timer_mod.argtypes = [ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64]
+        self.libcm.coremodel_timer_mod.restype = None
+
+        self.libcm.coremodel_timer_del.argtypes = [ctypes.c_void_p]
+        self.libcm.coremodel_timer_del.restype = None
+
+        self.libcm.coremodel_batch_begin.argtypes = [ctypes.c_void_p]
+        self.libcm.coremodel_batch_begin.restype = None
+
+        self.libcm.coremodel_batch_commit.argtypes = [ctypes.c_void_p]
+        self.libcm.coremodel_batch_commit.restype = None
 
         self._connect(self.address, self.port)
 
@@ -275,7 +363,18 @@ class CoreModel(threading.Thread):
         self.addressport = self.address + ':' + self.port
 
         try:
-            self.connection = self.libcm.coremodel_connect(ctypes.pointer(self.cm) , ctypes.c_char_p(self.addressport.encode('utf-8')))
+            if self.reconnect_ms or self.spin_us or self.tx_limit or self.tx_limit_packets or self.write_through:
+                opts = coremodel_connect_opts_t()
+                opts.reconnect_ms = self.reconnect_ms
+                opts.link = self.link_cb
+                opts.spin_us = self.spin_us
+                opts.tx_limit = self.tx_limit
+                opts.tx_limit_packets = self.tx_limit_packets
+                opts.writable = self.writable_cb
+                opts.write_through = self.write_through
+                self.connection = self.libcm.coremodel_connect_ex(ctypes.pointer(self.cm) , ctypes.c_char_p(self.addressport.encode('utf-8')), ctypes.pointer(opts))
+            else:
+                self.connection = self.libcm.coremodel_connect(ctypes.pointer(self.cm) , ctypes.c_char_p(self.addressport.encode('utf-8')))
         except Exception as e:
             print(str(e))
             sys.exit(1)
@@ -314,6 +413,14 @@ class CoreModel(threading.Thread):
                     self.devlist_spi = ctypes.cast(self.devlist_spi, ctypes.POINTER(coremodel_device_list_t))
             i += 1
 
+    def _link(self, priv, up, err):
+        if self.link:
+            self.link(up, err)
+
+    def _writable(self, priv):
+        if self.writable:
+            self.writable()
+
     def device_list(self):
 
         if self.devlist is None:
@@ -376,12 +483,29 @@ class CoreModel(threading.Thread):
     def _gpio_set(self, driven, mvolt):
 
         if self.handle is None:
-            return
+            return 1
         self.driven = driven
         self.mvolt = mvolt
         c_driven = ctypes.c_uint32(driven)
         c_mvolt = ctypes.c_int32(mvolt)
-        self._set(self.handle, c_driven.value, c_mvolt.value)
+        return self._set(self.handle, c_driven.value, c_mvolt.value)
+
+    def _gpio_set_multi(self, pins):
+
+        if self.handle is None:
+            return 1
+        n = len(self.pin)
+        words = (n + 63) // 64
+        mask = (ctypes.c_uint64 * words)()
+        drven = (ctypes.c_uint64 * words)()
+        mvolt = (ctypes.c_int32 * n)()
+        for pin, (driven, mv) in pins.items():
+            i = self.pin.index(pin)
+            mask[i >> 6] |= 1 << (i & 63)
+            if driven:
+                drven[i >> 6] |= 1 << (i & 63)
+            mvolt[i] = mv
+        return self._set_multi(self.handle, mask, drven, mvolt)
 
     def _usbh_ready(self, ep, tkn):
 
@@ -423,13 +547,13 @@ class CoreModel(threading.Thread):
         c_data0 = ctypes.c_uint64(data0)
         c_data1 = ctypes.c_uint64(data1)
         c_change = ctypes.c_uint32(change)
-        self._event_signal(self.handle, c_data0.value, c_data1.value, c_change.value)
+        return self._event_signal(self.handle, c_data0.value, c_data1.value, c_change.value)
 
     def _evt_atom(self, data0, data1, op):
         c_data0 = ctypes.c_uint64(data0)
         c_data1 = ctypes.c_uint64(data1)
         c_op = ctypes.c_uint32(op)
-        self._event_atomic(self.handle, c_data0.value, c_data1.value, c_op.value)
+        return self._event_atomic(self.handle, c_data0.value, c_data1.value, c_op.value)
 
     def attach(self, obj):
 
@@ -440,7 +564,7 @@ class CoreModel(threading.Thread):
                     if self.devlist_gpio is not None:
                         j = 0
                         f = 0
-                        if type(obj.pin) is int:
+                        if type(obj.pin) is int or type(obj.pin) is list:
                             break
                         while self.devlist_gpio[j].type != COREMODEL_INVALID:
                             if self.devlist_evt[j].name:
@@ -510,7 +634,10 @@ class CoreModel(threading.Thread):
             cs = ctypes.c_uint32(obj.cs)
             flags = ctypes.c_uint16(obj.flags)
 
-            obj.handle = self.libcm.coremodel_attach_spi(self.cm, obj.name.encode('utf-8'), cs.value, ctypes.pointer(obj.spi_func), priv,flags.value)
+            if obj.max_xfr:
+                obj.handle = self.libcm.coremodel_attach_spi_ex(self.cm, obj.name.encode('utf-8'), cs.value, None, ctypes.pointer(obj.spi_func), priv, flags.value, obj.max_xfr)
+            else:
+                obj.handle = self.libcm.coremodel_attach_spi(self.cm, obj.name.encode('utf-8'), cs.value, ctypes.pointer(obj.spi_func), priv,flags.value)
 
             if obj.handle is None:
                 raise NameError("Attach SPI Failed")
@@ -520,6 +647,19 @@ class CoreModel(threading.Thread):
                 self.attached_objs.append(obj)
                 obj.cm = self
 
+        elif obj.type == COREMODEL_GPIO and type(obj.pin) is list:
+            obj.gpio_func = coremodel_gpio_bank_func_t(notify = GPIO_BANK_NOTIFY(obj._notify))
+            pins = (ctypes.c_uint32 * len(obj.pin))(*obj.pin)
+            obj.handle = self.libcm.coremodel_attach_gpio_bank(self.cm, obj.name.encode('utf-8'), pins, len(obj.pin), ctypes.pointer(obj.gpio_func), priv)
+
+            if obj.handle is None:
+                raise NameError("Attach GPIO Bank Failed")
+            else:
+                obj._set_multi = self.libcm.coremodel_gpio_set_multi
+                obj.set = MethodType(CoreModel._gpio_set_multi, obj)
+                self.attached_objs.append(obj)
+                obj.cm = self
+
         elif obj.type == COREMODEL_GPIO:
             obj.gpio_func = coremodel_gpio_func_t(notify = GPIO_NOTIFY(obj._notify))
             if type(obj.pin) is int:
@@ -557,6 +697,8 @@ class CoreModel(threading.Thread):
             if obj.handle is None:
                 raise NameError("Attach CAN Failed")
             else:
+                if obj.rx_depth:
+                    self.libcm.coremodel_can_set_rx_depth(obj.handle, obj.rx_depth)
                 obj._ready = self.libcm.coremodel_can_ready
                 obj._rx = self.libcm.coremodel_can_rx
                 obj.ready = MethodType(CoreModel._can_ready, obj)
@@ -597,9 +739,34 @@ class CoreModel(threading.Thread):
 
     def detach(self, obj):
         if obj.handle is not None:
-            self.libcm.coremodel_detach(obj.handle)
+            if obj.type == COREMODEL_GPIO and type(obj.pin) is list:
+                self.libcm.coremodel_detach_gpio_bank(obj.handle)
+            else:
+                self.libcm.coremodel_detach(obj.handle)
             self.attached_objs.remove(obj)
 
+    def timer_add(self, callback, delay_ns, period_ns=0):
+        cb = TIMER(lambda priv: callback())
+        handle = self.libcm.coremodel_timer_add(self.cm, self.libcm.coremodel_time_ns() + max(delay_ns, 1), period_ns, cb, None)
+        if handle is None:
+            raise MemoryError("Failed to add timer")
+        self.timers[handle] = cb
+        return handle
+
+    def timer_mod(self, handle, delay_ns, period_ns=0):
+        self.libcm.coremodel_timer_mod(handle, self.libcm.coremodel_time_ns() + max(delay_ns, 1), period_ns)
+
+    def timer_del(self, handle):
+        if handle in self.timers:
+            self.libcm.coremodel_timer_del(handle)
+            del self.timers[handle]
+
+    def batch_begin(self):
+        self.libcm.coremodel_batch_begin(self.cm)
+
+    def batch_commit(self):
+        self.libcm.coremodel_batch_commit(self.cm)
+
     def run(self):
         while not self.stop_event.is_set():
             ret = 0
@@ -609,9 +776,11 @@ class CoreModel(threading.Thread):
                 else:
                     ret = self.libcm.coremodel_mainloop(self.cm, ctypes.c_longlong(self.cycle_time))
                 if ret < 0:
-                    sys.exit(0)
+                    self.error = ret
+                    return ret
             except KeyboardInterrupt:
                 sys.exit(0)
+        return 0
 
     def mainloop(self):
         try:
@@ -624,7 +793,10 @@ class CoreModel(threading.Thread):
         if self.libcm is not None:
             if self.attached_objs is not None:
                 for obj in self.attached_objs:
-                    self.libcm.coremodel_detach(obj.handle)
+                    if obj.type == COREMODEL_GPIO and type(obj.pin) is list:
+                        self.libcm.coremodel_detach_gpio_bank(obj.handle)
+                    else:
+                        self.libcm.coremodel_detach(obj.handle)
             if self.devlist is not None:
                 self.libcm.coremodel_free_list(self.devlist)
             if self.connection == 0:
@@ -746,11 +918,12 @@ class CoreModelI2C():
         pass
 
 class CoreModelSpi():
-    def __init__(self, busname, cs):
+    def __init__(self, busname, cs, max_xfr=0):
         self.name = busname
         self.type = COREMODEL_SPI
         self.cs = cs
         self.flags = 0
+        self.max_xfr = max_xfr
         self.handle = None
         self.cm = None
 
@@ -810,6 +983,35 @@ class CoreModelGpio():
     def __del__(self):
         pass
 
+class CoreModelGpioBank():
+    def __init__(self, busname, pins):
+        self.name = busname
+        self.type = COREMODEL_GPIO
+        self.pin = list(pins)
+        self.handle = None
+        self.cm = None
+
+    @staticmethod
+    def _notify(obj, changed, mvolt):
+        py_obj = ctypes.cast(obj, ctypes.py_object).value
+        updates = dict()
+        for i, pin in enumerate(py_obj.pin):
+            if changed[i >> 6] & (1 << (i & 63)):
+                updates[pin] = mvolt[i]
+        py_obj.notify(updates)
+
+    def notify(self, updates):
+        pass
+
+    def _set_multi(self):
+        pass  #defined by coremodel
+
+    def set(self, pins):
+        pass  #defined by coremodel
+
+    def __del__(self):
+        pass
+
 class CoreModelUsbh():
     def __init__(self, busname, port, speed):
         self.name = busname
@@ -853,9 +1055,10 @@ class CoreModelUsbh():
         pass
 
 class CoreModelCan():
-    def __init__(self, busname):
+    def __init__(self, busname, rx_depth=0):
         self.name = busname
         self.type = COREMODEL_CAN
+        self.rx_depth = rx_depth
         self.handle = None
         self.cm = None
 
@@ -0,0 +1,116 @@
+/*
+ * CoreModel Benchmark Helpers
+ *
+ * The benchmarks run the VM side through lbvm.h over a UNIX socket, so the
+ * numbers include the socket transport the library uses against a real VM.
+ * The instance runs its main loop on a thread of its own.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lbvm.h"
+
+struct bench {
+    struct sockaddr_un sa;
+    char target[128];
+    int ls;
+    void *cm;
+    pthread_t thread;
+    int stop;
+};
+
+/* Listen on a fresh socket; bench->target is then the target to connect to. */
+static inline void bench_listen(struct bench *bench, const char *name)
+{
+    signal(SIGPIPE, SIG_IGN);
+    bench->sa.sun_family = AF_UNIX;
+    snprintf(bench->sa.sun_path, sizeof(bench->sa.sun_path), "/tmp/coremodel-%s-%d.sock", name, (int)getpid());
+    unlink(bench->sa.sun_path);
+    bench->ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(bench->ls >= 0);
+    CHECK(!bind(bench->ls, (struct sockaddr *)&bench->sa, sizeof(bench->sa)) && !listen(bench->ls, 1));
+    snprintf(bench->target, sizeof(bench->target), "unix:%s", bench->sa.sun_path);
+}
+
+/* Listen on a TCP port of 127.0.0.1 instead, for comparison with the UNIX
+ * socket. */
+static inline void bench_listen_tcp(struct bench *bench)
+{
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(sin);
+
+    signal(SIGPIPE, SIG_IGN);
+    bench->ls = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(bench->ls >= 0);
+    CHECK(!bind(bench->ls, (struct sockaddr *)&sin, sizeof(sin)) && !listen(bench->ls, 1));
+    CHECK(!getsockname(bench->ls, (struct sockaddr *)&sin, &len));
+    snprintf(bench->target, sizeof(bench->target), "127.0.0.1:%u", ntohs(sin.sin_port));
+}
+
+/* Connect an instance and start a VM thread on the accepted socket, so that
+ * interfaces can be attached. */
+static inline void *bench_connect(struct bench *bench, struct lbvm *vm, const coremodel_connect_opts_t *opts)
+{
+    int fd;
+
+    CHECK(!coremodel_connect_ex(&bench->cm, bench->target, opts));
+    fd = accept(bench->ls, NULL, NULL);
+    CHECK(fd >= 0);
+    lbvm_start_fd(vm, fd);
+    return bench->cm;
+}
+
+static inline void *bench_loop(void *arg)
+{
+    struct bench *bench = arg;
+
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_ACQUIRE))
+        coremodel_mainloop(bench->cm, 10000);
+    return NULL;
+}
+
+/* Run the main loop of the instance on its own thread. */
+static inline void bench_start(struct bench *bench)
+{
+    bench->stop = 0;
+    CHECK(!pthread_create(&bench->thread, NULL, bench_loop, bench));
+}
+
+/* Stop the main loop, disconnect and remove the socket. */
+static inline void bench_finish(struct bench *bench, struct lbvm *vm)
+{
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(bench->thread, NULL);
+    coremodel_disconnect(bench->cm);
+    lbvm_stop(vm);
+    close(vm->fd);
+    close(bench->ls);
+    if(bench->sa.sun_path[0])
+        unlink(bench->sa.sun_path);
+}
+
+static inline int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort samples and return the given percentile. */
+static inline uint64_t bench_pct(uint64_t *samples, unsigned num, unsigned pct)
+{
+    qsort(samples, num, sizeof(samples[0]), bench_cmp);
+    return samples[(uint64_t)num * pct / 100 < num ? (uint64_t)num * pct / 100 : num - 1];
+}
+
+#endif
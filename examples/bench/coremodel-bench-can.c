@@ -0,0 +1,131 @@
+/*
+ * CoreModel CAN Replay Benchmark
+ *
+ * Replays classic CAN frames into the VM at the frame rate of a saturated
+ * 1 Mbit/s bus, as a bus log replay does, while the VM acknowledges each
+ * frame at once except every 100th, which it holds for 1 ms. A frame that
+ * coremodel_can_rx cannot take by its slot on the bus is late. Reports late
+ * frames, the worst lateness and the most frames in flight for a few receive
+ * queue depths; depth 0 allows a single frame in flight.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <time.h>
+
+#include "bench.h"
+
+#define PKT_CAN_RX      0x02
+#define PKT_CAN_RX_ACK  0x03
+
+#define NUM_FRAME       8000
+#define FRAME_NS        125000      /* 8-byte frame with stuffing at 1 Mbit/s */
+#define STALL_EVERY     100
+#define STALL_US        1000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned completes, seq, bad;
+
+static void bench_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    uint32_t frame;
+
+    if(pkt != PKT_CAN_RX)
+        return;
+    CHECK(dlen >= 20);
+    memcpy(&frame, data + 16, 4);
+    if(frame != seq)
+        bad ++;
+    seq ++;
+    if(seq % STALL_EVERY == 0)
+        usleep(STALL_US);
+    lbvm_send(vm, conn, PKT_CAN_RX_ACK, bflag, 0, NULL, 0);
+}
+
+static void bench_can_rxcomplete(void *priv, int nak)
+{
+    pthread_mutex_lock(&lock);
+    completes ++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static const coremodel_can_func_t bench_can_func = {
+    .rxcomplete = bench_can_rxcomplete };
+
+/* Wait for a completion after the given count. */
+static void bench_wait(unsigned seen)
+{
+    pthread_mutex_lock(&lock);
+    while(completes == seen)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+static void bench_sleep_until(uint64_t ns)
+{
+    struct timespec tsp = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tsp, NULL))
+        ;
+}
+
+static void bench_run(unsigned depth)
+{
+    static struct lbvm vm;
+    struct bench bench = { 0 };
+    uint64_t ctrl[2] = { 8ul << CAN_CTRL_DLC_SHIFT, 0 }, start, slot, late, worst = 0;
+    unsigned idx, nlate = 0, seen, inflight, peak = 0;
+    uint8_t data[8] = { 0 };
+    void *cm, *can;
+
+    memset(&vm, 0, sizeof(vm));
+    vm.packet = bench_packet;
+    completes = seq = bad = 0;
+    bench_listen(&bench, "bench-can");
+    cm = bench_connect(&bench, &vm, NULL);
+    can = coremodel_attach_can(cm, "can0", &bench_can_func, NULL);
+    CHECK(can);
+    CHECK(!coremodel_can_set_rx_depth(can, depth));
+    bench_start(&bench);
+
+    start = coremodel_time_ns() + 1000000;
+    for(idx=0; idx<NUM_FRAME; idx++) {
+        slot = start + (uint64_t)idx * FRAME_NS;
+        bench_sleep_until(slot);
+        memcpy(data, &idx, 4);
+        for(;;) {
+            seen = __atomic_load_n(&completes, __ATOMIC_ACQUIRE);
+            if(!coremodel_can_rx(can, ctrl, data))
+                break;
+            bench_wait(seen);
+        }
+        late = coremodel_time_ns() - slot;
+        if(late > FRAME_NS)
+            nlate ++;
+        if(late > worst)
+            worst = late;
+        inflight = idx + 1 - __atomic_load_n(&completes, __ATOMIC_ACQUIRE);
+        if(inflight > peak)
+            peak = inflight;
+    }
+    pthread_mutex_lock(&lock);
+    while(completes < NUM_FRAME)
+        pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    bench_finish(&bench, &vm);
+
+    CHECK(!bad);
+    printf("  depth %3u: %5u frames late, worst %6.1f us, at most %3u in flight\n", depth, nlate, worst / 1e3, peak);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("can: %u classic frames every %u us, VM holds every %uth for %u us\n", NUM_FRAME, FRAME_NS / 1000, STALL_EVERY, STALL_US);
+    bench_run(0);
+    bench_run(4);
+    bench_run(32);
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * CoreModel Contention Benchmark
+ *
+ * The VM keeps a UART busy whose tx callback takes 2 ms, as a model that
+ * logs every byte might, while a producer thread sets a GPIO pin every
+ * 250 us. Reports how long coremodel_gpio_set takes to return and how long
+ * the update takes to reach the VM while the slow callback runs.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#define PKT_UART_TX     0x00
+#define PKT_GPIO_FORCE  0x01
+
+#define NUM_SET         4000
+#define SLOW_US         2000
+#define FEED_US         2500
+#define SET_US          250
+
+static uint64_t sent[NUM_SET], call[NUM_SET], wire[NUM_SET];
+static unsigned slow_calls, rcvd;
+static int done;
+static void *gpio;
+
+static void bench_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(conn != 1 || pkt != PKT_GPIO_FORCE || hflag >= NUM_SET)
+        return;
+    wire[hflag] = coremodel_time_ns() - sent[hflag];
+    __atomic_add_fetch(&rcvd, 1, __ATOMIC_RELEASE);
+}
+
+static int bench_uart_tx(void *priv, unsigned len, uint8_t *data)
+{
+    slow_calls ++;
+    usleep(SLOW_US);
+    return len;
+}
+
+static const coremodel_uart_func_t bench_uart_func = {
+    .tx = bench_uart_tx };
+static const coremodel_gpio_func_t bench_gpio_func = { 0 };
+
+static void *bench_producer(void *arg)
+{
+    unsigned idx;
+
+    for(idx=0; idx<NUM_SET; idx++) {
+        sent[idx] = coremodel_time_ns();
+        coremodel_gpio_set(gpio, 1, idx);
+        call[idx] = coremodel_time_ns() - sent[idx];
+        usleep(SET_US);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void bench_report(const char *what, uint64_t *samples)
+{
+    printf("  %-16s p50 %8.1f us, p99 %8.1f us, max %8.1f us\n", what, bench_pct(samples, NUM_SET, 50) / 1e3,
+           bench_pct(samples, NUM_SET, 99) / 1e3, bench_pct(samples, NUM_SET, 100) / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    struct bench bench = { 0 };
+    pthread_t thread;
+    uint8_t byte = 0;
+    uint64_t end;
+    void *cm;
+
+    vm.packet = bench_packet;
+    bench_listen(&bench, "bench-contend");
+    cm = bench_connect(&bench, &vm, NULL);
+    CHECK(coremodel_attach_uart(cm, "uart0", &bench_uart_func, NULL));
+    gpio = coremodel_attach_gpio(cm, "gpio0", 0, &bench_gpio_func, NULL);
+    CHECK(gpio);
+    bench_start(&bench);
+
+    CHECK(!pthread_create(&thread, NULL, bench_producer, NULL));
+    while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        lbvm_send(&vm, 0, PKT_UART_TX, 0, 0, &byte, 1);
+        byte ++;
+        usleep(FEED_US);
+    }
+    pthread_join(thread, NULL);
+    end = lbvm_time_us() + 1000000;
+    while(__atomic_load_n(&rcvd, __ATOMIC_ACQUIRE) < NUM_SET && lbvm_time_us() < end)
+        usleep(1000);
+    CHECK(rcvd == NUM_SET);
+    bench_finish(&bench, &vm);
+
+    printf("contend: %u pin updates against %u callbacks of %u us\n", NUM_SET, slow_calls, SLOW_US);
+    bench_report("gpio_set call", call);
+    bench_report("gpio_set to VM", wire);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * CoreModel Dispatch Benchmark
+ *
+ * Attaches 1, 64 and 1024 GPIO pins and has the VM send voltage updates to
+ * them in a scattered order, then reports the time the main loop takes per
+ * packet it hands to a notify callback. The VM writes each batch before the
+ * clock starts, so the figure is the cost of reading and dispatching alone;
+ * it should not grow with the number of interfaces.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#define PKT_GPIO_UPDATE 0x00
+
+#define NUM_PACKET      (1u << 20)
+#define BATCH           512         /* packets written to the socket at once */
+
+static const unsigned bench_counts[] = { 1, 64, 1024 };
+
+static unsigned notified;
+
+static void bench_gpio_notify(void *priv, int mvolt)
+{
+    notified ++;
+}
+
+static const coremodel_gpio_func_t bench_gpio_func = {
+    .notify = bench_gpio_notify };
+
+static void bench_run(unsigned count)
+{
+    static struct lbvm vm;
+    static uint8_t buf[BATCH * 8];
+    struct bench bench = { 0 };
+    unsigned idx, sent, conn, rnd = 1;
+    uint64_t start, total = 0;
+    void *cm;
+
+    memset(&vm, 0, sizeof(vm));
+    notified = 0;
+    bench_listen(&bench, "bench-dispatch");
+    cm = bench_connect(&bench, &vm, NULL);
+    for(idx=0; idx<count; idx++)
+        CHECK(coremodel_attach_gpio(cm, "gpio0", idx, &bench_gpio_func, NULL));
+    /* The pins have their connections; the socket is driven from here now */
+    lbvm_stop(&vm);
+    CHECK(vm.conns == count);
+
+    for(sent=0; sent<NUM_PACKET; sent+=BATCH) {
+        for(idx=0; idx<BATCH; idx++) {
+            rnd = rnd * 1103515245 + 12345;
+            conn = (rnd >> 16) % count;
+            buf[idx * 8] = 8;
+            buf[idx * 8 + 1] = 0;
+            buf[idx * 8 + 2] = conn;
+            buf[idx * 8 + 3] = conn >> 8;
+            buf[idx * 8 + 4] = PKT_GPIO_UPDATE;
+            buf[idx * 8 + 5] = 0;
+            buf[idx * 8 + 6] = idx;
+            buf[idx * 8 + 7] = 0;
+        }
+        CHECK(write(vm.fd, buf, sizeof(buf)) == sizeof(buf));
+
+        start = coremodel_time_ns();
+        while(notified < sent + BATCH)
+            coremodel_mainloop(cm, 0);
+        total += coremodel_time_ns() - start;
+    }
+
+    coremodel_disconnect(cm);
+    close(vm.fd);
+    close(bench.ls);
+    unlink(bench.sa.sun_path);
+
+    printf("  %4u interfaces: %6.1f ns/packet\n", count, (double)total / NUM_PACKET);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned idx;
+
+    printf("dispatch: %u GPIO updates to pins in scattered order\n", NUM_PACKET);
+    for(idx=0; idx<sizeof(bench_counts)/sizeof(bench_counts[0]); idx++)
+        bench_run(bench_counts[idx]);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * CoreModel I2C Round-Trip Benchmark
+ *
+ * Plays a VM reading a 2-byte register from an I2C device: START, WRITE of
+ * the register address and READ, each answered by the model before the next
+ * is sent. Reports the latency of the whole read with the main loop blocking
+ * and with it busy-polling for spin_us after each packet. The VM side always
+ * busy-polls, as a vCPU spinning on a status register does, so that the
+ * difference is the wake-up of the main loop alone. That needs a CPU for each
+ * side.
+ *
+ * Usage: coremodel-bench-i2c [think_us]
+ *   think_us   time the VM spends between reads (default 0)
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+#define PKT_I2C_START   0x00
+#define PKT_I2C_WRITE   0x01
+#define PKT_I2C_READ    0x02
+#define PKT_I2C_STOP    0x03
+#define PKT_I2C_DONE    0x04
+
+#define NUM_READ        20000
+
+static unsigned dones;
+
+static void bench_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt == PKT_I2C_DONE)
+        dones ++;
+}
+
+static int bench_i2c_start(void *priv)
+{
+    return 1;
+}
+
+static int bench_i2c_read(void *priv, unsigned len, uint8_t *data)
+{
+    unsigned idx;
+
+    for(idx=0; idx<len; idx++)
+        data[idx] = 0x40 + idx;
+    return len;
+}
+
+static const coremodel_i2c_func_t bench_i2c_func = {
+    .start = bench_i2c_start,
+    .read = bench_i2c_read };
+
+/* Send one packet and wait for its DONE. */
+static void bench_xfer(struct lbvm *vm, unsigned pkt, unsigned bflag, unsigned idx, const void *data, unsigned dlen)
+{
+    unsigned want = dones + 1;
+    int res;
+
+    lbvm_send(vm, 0, pkt, bflag, idx, data, dlen);
+    while(dones < want) {
+        res = lbvm_poll(vm);
+        CHECK(res >= 0);
+        if(!res)
+            sched_yield();
+    }
+}
+
+static double bench_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void bench_run(unsigned spin_us, unsigned think_us)
+{
+    static struct lbvm vm;
+    static uint64_t lat[NUM_READ];
+    coremodel_connect_opts_t opts = { .spin_us = spin_us };
+    struct bench bench = { 0 };
+    coremodel_stats_t stats;
+    uint64_t start, sum = 0;
+    uint8_t reg = 0x10;
+    double cpu;
+    unsigned idx;
+    void *cm;
+
+    memset(&vm, 0, sizeof(vm));
+    vm.packet = bench_packet;
+    bench_listen(&bench, "bench-i2c");
+    cm = bench_connect(&bench, &vm, &opts);
+    CHECK(coremodel_attach_i2c(cm, "i2c0", 0x50, &bench_i2c_func, NULL, 0));
+    lbvm_stop(&vm);
+    vm.spin = 1;
+    bench_start(&bench);
+
+    cpu = bench_cpu();
+    for(idx=0; idx<NUM_READ; idx++) {
+        if(think_us)
+            for(start=lbvm_time_us(); lbvm_time_us()-start<think_us; )
+                ;
+        start = coremodel_time_ns();
+        bench_xfer(&vm, PKT_I2C_START, 1, idx, NULL, 0);
+        bench_xfer(&vm, PKT_I2C_WRITE, 1, idx, &reg, 1);
+        bench_xfer(&vm, PKT_I2C_READ, 2, idx, NULL, 0);
+        lat[idx] = coremodel_time_ns() - start;
+        sum += lat[idx];
+        lbvm_send(&vm, 0, PKT_I2C_STOP, 0, idx, NULL, 0);
+    }
+    cpu = bench_cpu() - cpu;
+
+    coremodel_get_stats(cm, &stats);
+    bench_finish(&bench, &vm);
+
+    printf("  spin_us %3u: mean %6.1f us, p50 %6.1f us, p99 %6.1f us; %.2f s CPU, %llu of %llu spin polls hit\n",
+           spin_us, sum / 1e3 / NUM_READ, bench_pct(lat, NUM_READ, 50) / 1e3, bench_pct(lat, NUM_READ, 99) / 1e3,
+           cpu, (unsigned long long)stats.spin_hits, (unsigned long long)stats.spin_polls);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned think_us = argc > 1 ? atoi(argv[1]) : 0;
+
+    printf("i2c: %u register reads of 3 round trips, VM thinks %u us between reads\n", NUM_READ, think_us);
+    if(sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        printf("  only one CPU: both sides take turns on it, so busy-polling cannot cut the wake-up\n");
+    bench_run(0, think_us);
+    bench_run(50, think_us);
+    return 0;
+}
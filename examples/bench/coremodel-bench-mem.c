@@ -0,0 +1,90 @@
+/*
+ * CoreModel Memory Benchmark
+ *
+ * Attaches thousands of handles of each interface type and reports the heap
+ * taken per handle, as counted by the C library allocator.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define BENCH_HEAP 1
+#endif
+
+static const coremodel_gpio_func_t bench_gpio_func = { 0 };
+static const coremodel_event_func_t bench_event_func = { 0 };
+static const coremodel_uart_func_t bench_uart_func = { 0 };
+static const coremodel_can_func_t bench_can_func = { 0 };
+static const coremodel_i2c_func_t bench_i2c_func = { 0 };
+static const coremodel_spi_func_t bench_spi_func = { 0 };
+static const coremodel_usbh_func_t bench_usbh_func = { 0 };
+
+static const struct {
+    const char *name;
+    unsigned num;
+} bench_types[] = {
+    { "gpio", 10000 },
+    { "event", 5000 },
+    { "uart", 1000 },
+    { "can", 1000 },
+    { "i2c", 1000 },
+    { "spi", 1000 },
+    { "usbh", 1000 } };
+
+static size_t bench_heap(void)
+{
+#ifdef BENCH_HEAP
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static void *bench_attach(void *cm, unsigned type, unsigned idx)
+{
+    switch(type) {
+    case 0: return coremodel_attach_gpio(cm, "gpio0", idx & 511, &bench_gpio_func, NULL);
+    case 1: return coremodel_attach_event_name(cm, "evt0", &bench_event_func, NULL);
+    case 2: return coremodel_attach_uart(cm, "uart0", &bench_uart_func, NULL);
+    case 3: return coremodel_attach_can(cm, "can0", &bench_can_func, NULL);
+    case 4: return coremodel_attach_i2c(cm, "i2c0", idx & 127, &bench_i2c_func, NULL, 0);
+    case 5: return coremodel_attach_spi(cm, "spi0", idx & 3, &bench_spi_func, NULL, 0);
+    case 6: return coremodel_attach_usbh(cm, "usb0", 0, &bench_usbh_func, NULL, 0);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    struct bench bench = { 0 };
+    unsigned type, idx;
+    size_t heap;
+    void *cm;
+
+#ifndef BENCH_HEAP
+    printf("mem: needs mallinfo2 from glibc 2.33 or later\n");
+    return 0;
+#endif
+
+    bench_listen(&bench, "bench-mem");
+    cm = bench_connect(&bench, &vm, NULL);
+
+    printf("mem: heap per attached handle\n");
+    for(type=0; type<sizeof(bench_types)/sizeof(bench_types[0]); type++) {
+        heap = bench_heap();
+        for(idx=0; idx<bench_types[type].num; idx++)
+            CHECK(bench_attach(cm, type, idx));
+        printf("  %-6s %6u handles: %7.1f bytes/handle\n", bench_types[type].name, bench_types[type].num,
+               (double)(bench_heap() - heap) / bench_types[type].num);
+    }
+
+    /* Handles are left to coremodel_disconnect */
+    bench_start(&bench);
+    bench_finish(&bench, &vm);
+    return 0;
+}
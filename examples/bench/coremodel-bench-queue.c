@@ -0,0 +1,125 @@
+/*
+ * CoreModel Receive Queue Benchmark
+ *
+ * Stalls a CAN interface on its first frame, has the VM send 10000 more with
+ * a stale receive acknowledgement after each, and then unstalls it. The
+ * acknowledgements are handled while the frames stay queued behind the
+ * stalled one. Reports the time to take in the backlog and the time to drain
+ * it once the interface is ready again.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#define PKT_CAN_TX      0x00
+#define PKT_CAN_RX_ACK  0x03
+
+#define NUM_FRAME       10000
+
+static unsigned ntx, stalled;
+
+static int bench_can_tx(void *priv, uint64_t *ctrl, uint8_t *data)
+{
+    if(!stalled) {
+        stalled = 1;
+        return CAN_STALL;
+    }
+    ntx ++;
+    return CAN_ACK;
+}
+
+static const coremodel_can_func_t bench_can_func = {
+    .tx = bench_can_tx };
+
+static uint8_t *wbuf;
+static unsigned wlen;
+
+static void *bench_writer(void *arg)
+{
+    struct lbvm *vm = arg;
+    unsigned done = 0;
+    int res;
+
+    while(done < wlen) {
+        res = write(vm->fd, wbuf + done, wlen - done);
+        if(res < 0 && errno == EINTR)
+            continue;
+        CHECK(res > 0);
+        done += res;
+    }
+    return NULL;
+}
+
+/* Append one packet to the write buffer. */
+static void bench_put(unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, const void *data, unsigned dlen)
+{
+    uint8_t *p = wbuf + wlen;
+
+    p[0] = 8 + dlen;
+    p[1] = (8 + dlen) >> 8;
+    p[2] = conn;
+    p[3] = conn >> 8;
+    p[4] = pkt;
+    p[5] = bflag;
+    p[6] = hflag;
+    p[7] = hflag >> 8;
+    memcpy(p + 8, data, dlen);
+    wlen += (8 + dlen + 3) & ~3;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    struct bench bench = { 0 };
+    uint64_t frame[3] = { 8ul << CAN_CTRL_DLC_SHIFT, 0, 0 }, start, queued, drained;
+    coremodel_stats_t stats;
+    pthread_t thread;
+    unsigned idx, base;
+    void *cm, *can;
+
+    bench_listen(&bench, "bench-queue");
+    cm = bench_connect(&bench, &vm, NULL);
+    can = coremodel_attach_can(cm, "can0", &bench_can_func, NULL);
+    CHECK(can);
+    /* The socket is driven from here now */
+    lbvm_stop(&vm);
+    CHECK(vm.conns == 1);
+
+    wbuf = malloc((NUM_FRAME + 1) * 32 + NUM_FRAME * 8);
+    CHECK(wbuf);
+    for(idx=0; idx<=NUM_FRAME; idx++) {
+        bench_put(0, PKT_CAN_TX, idx & 255, 1, frame, sizeof(frame));
+        if(idx)
+            bench_put(0, PKT_CAN_RX_ACK, 0xEE, 0, NULL, 0);
+    }
+
+    coremodel_get_stats(cm, &stats);
+    base = stats.rx_packets;
+    start = coremodel_time_ns();
+    CHECK(!pthread_create(&thread, NULL, bench_writer, &vm));
+    do {
+        coremodel_mainloop(cm, 1000);
+        coremodel_get_stats(cm, &stats);
+    } while(stats.rx_packets < base + 2 * NUM_FRAME + 1);
+    queued = coremodel_time_ns() - start;
+    pthread_join(thread, NULL);
+    CHECK(stalled && !ntx);
+
+    start = coremodel_time_ns();
+    coremodel_can_ready(can);
+    while(ntx < NUM_FRAME + 1)
+        coremodel_mainloop(cm, 0);
+    drained = coremodel_time_ns() - start;
+
+    coremodel_disconnect(cm);
+    close(vm.fd);
+    close(bench.ls);
+    unlink(bench.sa.sun_path);
+    free(wbuf);
+
+    printf("queue: %u CAN frames behind a stalled one: queued in %.1f ms, drained in %.1f ms\n",
+           NUM_FRAME, queued / 1e6, drained / 1e6);
+    return 0;
+}
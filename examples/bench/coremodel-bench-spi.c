@@ -0,0 +1,92 @@
+/*
+ * CoreModel SPI Bulk Read Benchmark
+ *
+ * Plays a VM reading a SPI flash in packets of a given size, keeping four
+ * packets outstanding, and checks every answer against the flash contents.
+ * Reports MB/s and xfr calls per packet for a few packet and max_xfr sizes.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#define PKT_SPI_TX      0x01
+#define PKT_SPI_RX      0x02
+
+#define FLASH_SIZE      (1u << 20)
+#define TOTAL           (32u << 20)
+#define DEPTH           4
+
+static uint8_t flash[FLASH_SIZE], zeros[65536];
+static unsigned pos, rpos, calls, psize, sent, rcvd, bad;
+
+static void bench_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt != PKT_SPI_RX)
+        return;
+    if(dlen != psize || memcmp(data, flash + (rpos & (FLASH_SIZE - 1)), psize))
+        bad ++;
+    rpos += psize;
+    if(sent < TOTAL / psize) {
+        lbvm_send(vm, 0, PKT_SPI_TX, 0, sent, zeros, psize);
+        sent ++;
+    }
+    __atomic_add_fetch(&rcvd, 1, __ATOMIC_RELEASE);
+}
+
+static int bench_spi_xfr(void *priv, unsigned len, uint8_t *wrdata, uint8_t *rddata)
+{
+    calls ++;
+    memcpy(rddata, flash + (pos & (FLASH_SIZE - 1)), len);
+    pos += len;
+    return len;
+}
+
+static const coremodel_spi_func_t bench_spi_func = {
+    .xfr = bench_spi_xfr };
+
+static void bench_run(unsigned size, unsigned max_xfr)
+{
+    static struct lbvm vm;
+    coremodel_connect_opts_t opts = { .rx_ring_size = 1 << 20 };
+    struct bench bench = { 0 };
+    uint64_t start;
+    void *cm;
+
+    memset(&vm, 0, sizeof(vm));
+    vm.packet = bench_packet;
+    psize = size;
+    pos = rpos = calls = sent = rcvd = bad = 0;
+    bench_listen(&bench, "bench-spi");
+    cm = bench_connect(&bench, &vm, &opts);
+    CHECK(coremodel_attach_spi_ex(cm, "spi0", 0, NULL, &bench_spi_func, NULL, COREMODEL_SPI_BLOCK, max_xfr));
+    bench_start(&bench);
+
+    start = coremodel_time_ns();
+    for(; sent<DEPTH; sent++)
+        lbvm_send(&vm, 0, PKT_SPI_TX, 0, sent, zeros, psize);
+    while(__atomic_load_n(&rcvd, __ATOMIC_ACQUIRE) < TOTAL / psize)
+        usleep(100);
+    start = coremodel_time_ns() - start;
+    bench_finish(&bench, &vm);
+
+    CHECK(!bad);
+    printf("  %5u-byte packets, max_xfr %5u: %7.1f MB/s, %5.1f xfr calls/packet\n", psize, max_xfr ? max_xfr : 256,
+           TOTAL * 1e3 / start, (double)calls / (TOTAL / psize));
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned idx;
+
+    for(idx=0; idx<FLASH_SIZE; idx++)
+        flash[idx] = idx * 7 + (idx >> 8);
+
+    printf("spi: %u MiB read in packets, %u outstanding\n", TOTAL >> 20, DEPTH);
+    bench_run(256, 0);
+    bench_run(4096, 0);
+    bench_run(4096, 4096);
+    bench_run(16384, 16384);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * CoreModel System Call Benchmark
+ *
+ * Sends bursts of 200 GPIO updates each way: from a producer thread with
+ * coremodel_gpio_set, and from the VM as one write per burst. Reports the
+ * socket writes per packet sent and the socket reads per packet received,
+ * from the connection statistics.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "bench.h"
+
+#define PKT_GPIO_UPDATE 0x00
+#define PKT_GPIO_FORCE  0x01
+
+#define NUM_BURST       500
+#define BURST           200
+
+static unsigned forced, notified;
+
+static void bench_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt == PKT_GPIO_FORCE)
+        __atomic_add_fetch(&forced, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_gpio_notify(void *priv, int mvolt)
+{
+    __atomic_add_fetch(&notified, 1, __ATOMIC_RELEASE);
+}
+
+static const coremodel_gpio_func_t bench_gpio_func = {
+    .notify = bench_gpio_notify };
+
+/* Wait for a counter to reach a value. */
+static void bench_wait(unsigned *what, unsigned value)
+{
+    while(__atomic_load_n(what, __ATOMIC_ACQUIRE) < value)
+        usleep(50);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    static uint8_t buf[BURST * 8];
+    struct bench bench = { 0 };
+    coremodel_stats_t base, stats;
+    unsigned burst, idx;
+    void *cm, *gpio;
+
+    vm.packet = bench_packet;
+    bench_listen(&bench, "bench-syscall");
+    cm = bench_connect(&bench, &vm, NULL);
+    gpio = coremodel_attach_gpio(cm, "gpio0", 0, &bench_gpio_func, NULL);
+    CHECK(gpio);
+    CHECK(vm.conns == 1);
+    bench_start(&bench);
+
+    /* To the VM: the loop drains each burst */
+    coremodel_get_stats(cm, &base);
+    for(burst=0; burst<NUM_BURST; burst++) {
+        for(idx=0; idx<BURST; idx++)
+            CHECK(!coremodel_gpio_set(gpio, 1, idx));
+        bench_wait(&forced, (burst + 1) * BURST);
+    }
+    coremodel_get_stats(cm, &stats);
+    printf("syscall: %u bursts of %u GPIO updates\n", NUM_BURST, BURST);
+    printf("  sent:     %6.3f writes/packet (%llu writes for %llu packets)\n",
+           (double)(stats.tx_writes - base.tx_writes) / (stats.tx_packets - base.tx_packets),
+           (unsigned long long)(stats.tx_writes - base.tx_writes), (unsigned long long)(stats.tx_packets - base.tx_packets));
+
+    /* From the VM: one write per burst */
+    for(idx=0; idx<BURST; idx++) {
+        buf[idx * 8] = 8;
+        buf[idx * 8 + 4] = PKT_GPIO_UPDATE;
+        buf[idx * 8 + 6] = idx;
+    }
+    coremodel_get_stats(cm, &base);
+    for(burst=0; burst<NUM_BURST; burst++) {
+        CHECK(write(vm.fd, buf, sizeof(buf)) == sizeof(buf));
+        bench_wait(&notified, (burst + 1) * BURST);
+    }
+    coremodel_get_stats(cm, &stats);
+    printf("  received: %6.3f reads/packet (%llu reads for %llu packets)\n",
+           (double)(stats.rx_reads - base.rx_reads) / (stats.rx_packets - base.rx_packets),
+           (unsigned long long)(stats.rx_reads - base.rx_reads), (unsigned long long)(stats.rx_packets - base.rx_packets));
+
+    bench_finish(&bench, &vm);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * CoreModel Transport Benchmark
+ *
+ * Streams UART data from the VM to the model over TCP on 127.0.0.1, over a
+ * UNIX socket and over the in-process loopback transport, and reports the
+ * throughput of each for small and large packets. The VM side writes from
+ * a thread of its own while the main loop runs on the benchmark thread.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sched.h>
+
+#include "bench.h"
+
+#define PKT_UART_TX     0x00
+
+#define TOTAL_BYTES     (64u << 20)
+#define CHUNK_BYTES     65536
+
+enum { XPORT_TCP, XPORT_UNIX, XPORT_LOOPBACK };
+
+static const char *const bench_names[] = { "tcp", "unix", "loopback" };
+static const unsigned bench_sizes[] = { 64, 1024 };
+
+static uint64_t received;
+
+static int bench_uart_tx(void *priv, unsigned len, uint8_t *data)
+{
+    received += len;
+    return len;
+}
+
+static const coremodel_uart_func_t bench_uart_func = {
+    .tx = bench_uart_tx };
+
+static uint8_t chunk[CHUNK_BYTES];
+static unsigned chunk_len, chunk_payload;
+
+/* VM side: write whole chunks until the total has been sent. */
+static void *bench_writer(void *arg)
+{
+    struct lbvm *vm = arg;
+    uint64_t sent;
+    unsigned done;
+    int res;
+
+    for(sent=0; sent<TOTAL_BYTES; sent+=chunk_payload)
+        for(done=0; done<chunk_len; done+=res) {
+            if(vm->peer)
+                res = coremodel_loopback_write(vm->peer, chunk + done, chunk_len - done);
+            else
+                res = write(vm->fd, chunk + done, chunk_len - done);
+            if(res < 0 && errno == EINTR)
+                res = 0;
+            CHECK(res >= 0);
+            if(!res)
+                sched_yield();
+        }
+    return NULL;
+}
+
+/* Fill the chunk with as many UART packets of the given payload as fit. */
+static void bench_fill(unsigned size)
+{
+    unsigned len = 8 + size, alen = (len + 3) & ~3;
+    uint8_t *p;
+
+    chunk_len = chunk_payload = 0;
+    while(chunk_len + alen <= CHUNK_BYTES) {
+        p = chunk + chunk_len;
+        memset(p, 0, alen);
+        p[0] = len;
+        p[1] = len >> 8;
+        p[4] = PKT_UART_TX;
+        chunk_len += alen;
+        chunk_payload += size;
+    }
+}
+
+static void bench_run(unsigned xport, unsigned size)
+{
+    static struct lbvm vm;
+    struct bench bench = { 0 };
+    uint64_t total, start, elapsed;
+    coremodel_stats_t stats;
+    pthread_t thread;
+    void *cm, *peer = NULL;
+
+    memset(&vm, 0, sizeof(vm));
+    received = 0;
+    switch(xport) {
+    case XPORT_TCP:
+        bench_listen_tcp(&bench);
+        cm = bench_connect(&bench, &vm, NULL);
+        break;
+    case XPORT_UNIX:
+        bench_listen(&bench, "bench-xport");
+        cm = bench_connect(&bench, &vm, NULL);
+        break;
+    default:
+        CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+        lbvm_start(&vm, peer);
+        break;
+    }
+    CHECK(coremodel_attach_uart(cm, "uart0", &bench_uart_func, NULL));
+    /* The connection is on conn 0; the writer takes over the VM side */
+    lbvm_stop(&vm);
+    CHECK(vm.conns == 1);
+
+    bench_fill(size);
+    total = (TOTAL_BYTES + chunk_payload - 1) / chunk_payload * chunk_payload;
+    start = coremodel_time_ns();
+    CHECK(!pthread_create(&thread, NULL, bench_writer, &vm));
+    while(received < total)
+        CHECK(!coremodel_mainloop(cm, 1000));
+    elapsed = coremodel_time_ns() - start;
+    pthread_join(thread, NULL);
+    coremodel_get_stats(cm, &stats);
+
+    coremodel_disconnect(cm);
+    if(peer)
+        coremodel_loopback_close(peer);
+    else {
+        close(vm.fd);
+        close(bench.ls);
+        if(bench.sa.sun_path[0])
+            unlink(bench.sa.sun_path);
+    }
+
+    printf("  %-8s %4u B: %7.1f MB/s, %5.2f Mpkt/s\n", bench_names[xport], size,
+           total * 1e3 / elapsed, (double)stats.rx_packets * 1e3 / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned xport, size;
+
+    printf("xport: %u MiB of UART data from the VM per run\n", TOTAL_BYTES >> 20);
+    for(size=0; size<sizeof(bench_sizes)/sizeof(bench_sizes[0]); size++)
+        for(xport=XPORT_TCP; xport<=XPORT_LOOPBACK; xport++)
+            bench_run(xport, bench_sizes[size]);
+    return 0;
+}
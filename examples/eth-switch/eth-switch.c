@@ -51,6 +51,7 @@ struct switch_state {
     unsigned reload;
     struct client *clients;
     unsigned nclients;
+    coremodel_reactor_t *reactor;
 } g_state;
 
 extern const char *__progname;
@@ -176,8 +177,10 @@ static void client_free(struct client *cli)
 
     if(cli->handle)
         coremodel_detach(cli->handle);
-    if(cli->cm)
+    if(cli->cm) {
+        coremodel_reactor_remove(g_state.reactor, cli->cm);
         coremodel_disconnect(cli->cm);
+    }
     if(cli->name)
         free(cli->name);
     if(cli->tuple)
@@ -293,6 +296,14 @@ static const coremodel_eth_func_t switch_eth_func = {
     .tx = switch_eth_tx
 };
 
+static void switch_client_error(void *priv, void *cm, int err)
+{
+    struct client *cli = priv;
+
+    pr_error("Connection to \'%s\' lost: %s\n", cli->name, strerror(-err));
+    client_free(cli);
+}
+
 static int switch_client_add(const char *cred)
 {
     struct client *cli;
@@ -312,6 +323,9 @@ static int switch_client_add(const char *cred)
     if(!cli->handle)
         goto cleanup;
 
+    if(coremodel_reactor_add(g_state.reactor, cli->cm, switch_client_error, cli))
+        goto cleanup;
+
     cli->next = g_state.clients;
     g_state.clients = cli;
 
@@ -334,6 +348,9 @@ static void switch_cleanup_connections(void)
 static void switch_cleanup(void)
 {
     switch_cleanup_connections();
+    if(g_state.reactor)
+        coremodel_reactor_destroy(g_state.reactor);
+    g_state.reactor = NULL;
 }
 
 static void switch_sigint_handler(int sig, siginfo_t *info, void *ucontext)
@@ -375,59 +392,14 @@ static int switch_parse_args(int argc, char *argv[])
     return 0;
 }
 
-static void ethernet_processfds(fd_set *readfds, fd_set *writefds)
-{
-    struct client *t, *cli;
-
-    cli = g_state.clients;
-    while(cli) {
-        if(coremodel_processfds(cli->cm, readfds, writefds)) {
-            t = cli->next;
-            client_free(t);
-            cli = t;
-            continue;
-        }
-
-        cli = cli->next;
-    }
-}
-
-static int ethernet_preparefds(fd_set *readfds, fd_set *writefds)
-{
-    struct client *cli;
-    int pnfds, nfds;
-
-    cli = g_state.clients;
-    if(!cli)
-        return -1;
-
-    pnfds = nfds = 0;
-    while(cli) {
-        pnfds = nfds;
-
-        /* Keep going even if some clients have trouble; they will be pruned later */
-        if( ((nfds = coremodel_preparefds(cli->cm, nfds, readfds, writefds)) < 0) )
-            nfds = pnfds;
-
-        cli = cli->next;
-    }
-
-    return nfds;
-}
-
 static int ethernet_service_loop(void)
 {
-    fd_set readfds, writefds;
-    int nfds;
+    int res;
 
     while(g_state.run) {
-        FD_ZERO(&writefds);
-        FD_ZERO(&readfds);
-
-        if( ((nfds = ethernet_preparefds(&readfds, &writefds)) < 0) )
+        res = coremodel_reactor_run(g_state.reactor, -1);
+        if(res && res != -EINTR)
             return -1;
-        select(nfds, &readfds, &writefds, NULL, NULL);
-        ethernet_processfds(&readfds, &writefds);
     }
 
     return 0;
@@ -440,6 +412,9 @@ int main(int argc, char *argv[])
     if(switch_install_sigaction())
         goto cleanup;
 
+    if( !(g_state.reactor = coremodel_reactor_create()) )
+        goto cleanup;
+
     if(switch_parse_args(argc, argv) < 0){
         switch_usage();
         goto cleanup;
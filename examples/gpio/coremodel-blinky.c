@@ -17,22 +17,22 @@
 typedef struct coremodel_gpio_state {
 
     struct coremodel_gpio_pin {
-        struct coremodel_gpio_state *state;
-        void *pin_handle; //coremodel_if
+        int bank_idx; //position in bank, -1 if not attached
         int mvolt;
     } pin[PIN_NUM];
 
+    void *bank;
+    unsigned num;
+    unsigned pins[PIN_NUM];
     uint32_t live;
 
 } coremodel_gpio_state_t;
 
-static void test_gpio_notify(void *priv, int mvolt)
+static void test_gpio_update(coremodel_gpio_state_t *state, unsigned pin_idx, int mvolt)
 {
-
-    struct coremodel_gpio_pin *pin = priv;
-    coremodel_gpio_state_t *state = pin->state;
-    unsigned pin_idx = pin - state->pin;
-
+    uint64_t mask[1] = { 0 }, drven[1] = { 0 };
+    int volts[PIN_NUM];
+    int idx;
 
     printf("GPIO[%d] = %d mV\n", pin_idx, mvolt);
     fflush(stdout);
@@ -44,24 +44,37 @@ static void test_gpio_notify(void *priv, int mvolt)
         }
         break;
     case 16:
-        if(state->pin[17].pin_handle){
-            coremodel_gpio_set(state->pin[17].pin_handle, 1, mvolt ? 0 : 3300);
+        idx = state->pin[17].bank_idx;
+        if(idx >= 0){
+            mask[0] = drven[0] = 1ull << idx;
+            volts[idx] = mvolt ? 0 : 3300;
+            coremodel_gpio_set_multi(state->bank, mask, drven, volts);
         }
         break;
     case 17:
         break;
     }
 
-    pin->mvolt = mvolt;
+    state->pin[pin_idx].mvolt = mvolt;
+}
+
+static void test_gpio_notify(void *priv, const uint64_t *changed, const int *mvolt)
+{
+    coremodel_gpio_state_t *state = priv;
+    unsigned idx;
+
+    for(idx=0; idx<state->num; idx++)
+        if(changed[idx >> 6] & (1ull << (idx & 63)))
+            test_gpio_update(state, state->pins[idx], mvolt[idx]);
 }
 
-static const coremodel_gpio_func_t test_gpio_func = {
+static const coremodel_gpio_bank_func_t test_gpio_func = {
     .notify = test_gpio_notify };
 
 int main(int argc, char *argv[])
 {
-    int res, num, idx, *gpios;
-    void *handle;
+    uint64_t mask[1], drven[1] = { 0 };
+    int res, num, idx, *gpios, volts[PIN_NUM] = { 0 };
     void *cm;
 
     coremodel_gpio_state_t *state;
@@ -84,6 +97,15 @@ int main(int argc, char *argv[])
     for(idx=0; idx<num; idx++)
         gpios[idx] = strtoul(argv[3 + idx], NULL, 0);
 
+    for(idx=0; idx<PIN_NUM; idx++)
+        state->pin[idx].bank_idx = -1;
+    for(idx=0; idx<num; idx++) {
+        if((gpios[idx] < 0) || (gpios[idx] >= PIN_NUM) || (state->pin[gpios[idx]].bank_idx >= 0)){
+            continue;
+        }
+        state->pin[gpios[idx]].bank_idx = state->num;
+        state->pins[state->num++] = gpios[idx];
+    }
 
     res = coremodel_connect(&cm ,argv[1]);
     if(res) {
@@ -91,20 +113,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    for(idx=0; idx<num; idx++) {
-        if((gpios[idx] < 0) || (gpios[idx] >= PIN_NUM)){
-            continue;
-        }
-
-        state->pin[gpios[idx]].state = state;
-        handle = coremodel_attach_gpio(cm, argv[2], gpios[idx], &test_gpio_func, &state->pin[gpios[idx]]);
-
-        if(!handle) {
-            fprintf(stderr, "error: failed to attach gpio %d.\n", gpios[idx]);
-            coremodel_disconnect(cm);
-            return 1;
-        }
-        state->pin[gpios[idx]].pin_handle = handle;
+    /* All pins in one round trip; updates arrive together */
+    state->bank = coremodel_attach_gpio_bank(cm, argv[2], state->pins, state->num, &test_gpio_func, state);
+    if(!state->bank) {
+        fprintf(stderr, "error: failed to attach gpios.\n");
+        coremodel_disconnect(cm);
+        return 1;
     }
 
     state->live = 1;
@@ -112,18 +126,14 @@ int main(int argc, char *argv[])
         coremodel_mainloop(cm, 800000);
     }
 
-    for(idx=0; idx<num; idx++) {
-        if((gpios[idx] < 0) || (gpios[idx] >= PIN_NUM)){
-            continue;
-        }
-        if(state->pin[gpios[idx]].pin_handle){
-            coremodel_gpio_set(state->pin[gpios[idx]].pin_handle, 1, 0);
-            coremodel_mainloop(cm, 100000);
-            coremodel_gpio_set(state->pin[gpios[idx]].pin_handle, 0, 0);
-            coremodel_mainloop(cm, 100000);
-            coremodel_detach(state->pin[gpios[idx]].pin_handle);
-        }
-    }
+    mask[0] = (state->num < 64) ? (1ull << state->num) - 1 : ~0ull;
+    drven[0] = mask[0];
+    coremodel_gpio_set_multi(state->bank, mask, drven, volts);
+    coremodel_mainloop(cm, 100000);
+    drven[0] = 0;
+    coremodel_gpio_set_multi(state->bank, mask, drven, volts);
+    coremodel_mainloop(cm, 100000);
+    coremodel_detach_gpio_bank(state->bank);
 
     coremodel_disconnect(cm);
     free(gpios);
@@ -120,6 +120,8 @@ static void adi_adxl36x_irq_update(adi_adxl36x_state_t *state)
 {
     unsigned irql;
 
+    /* Both lines change together when they share a source */
+    coremodel_batch_begin(state->cm);
     for(int idx = 0; idx < 2; idx++){
     irql  = !!((state->status[0] & state->intmapn_lower[idx] & 0x7f) | (state->status[1] & state->intmapn_upper[idx] & 0xbf) | (state->status[0] & state->intmapn_upper[idx] & 0x80));
 
@@ -130,6 +132,7 @@ static void adi_adxl36x_irq_update(adi_adxl36x_state_t *state)
             state->irq_line[idx] = irql;
         }
     }
+    coremodel_batch_commit(state->cm);
 }
 
 #if ADI_ADXL36x_DEBUG
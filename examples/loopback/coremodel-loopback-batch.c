@@ -0,0 +1,87 @@
+/*
+ * CoreModel Loopback Batch Test
+ *
+ * Sends UART data from nested transmit batches and checks that nothing is
+ * queued before the outermost commit, that the packets are then queued as
+ * one buffer, and that the VM receives them all in order.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define NUM_PKT         12
+
+static uint8_t rcvd[NUM_PKT];
+static unsigned nrcvd;
+
+static void test_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    unsigned idx;
+
+    for(idx=0; idx<dlen; idx++) {
+        CHECK(nrcvd < NUM_PKT);
+        rcvd[nrcvd++] = data[idx];
+    }
+}
+
+static const coremodel_uart_func_t test_uart_func = { 0 };
+
+/* A helper that batches its own updates, as models wrapping an interrupt
+ * line change do. */
+static void test_update(void *cm, void *uart, uint8_t *data)
+{
+    coremodel_batch_begin(cm);
+    CHECK(coremodel_uart_rx(uart, 1, data) == 1);
+    (*data) ++;
+    CHECK(coremodel_uart_rx(uart, 1, data) == 1);
+    (*data) ++;
+    coremodel_batch_commit(cm);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    coremodel_stats_t stats;
+    void *cm, *peer, *uart;
+    uint8_t data = 0;
+    unsigned idx;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+    vm.packet = test_packet;
+    lbvm_start(&vm, peer);
+    uart = coremodel_attach_uart(cm, "uart0", &test_uart_func, NULL);
+    CHECK(uart);
+    lbvm_stop(&vm);
+
+    coremodel_batch_begin(cm);
+    for(idx=0; idx<NUM_PKT/4; idx++) {
+        CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+        data ++;
+        test_update(cm, uart, &data);
+        CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+        data ++;
+    }
+    coremodel_get_stats(cm, &stats);
+    CHECK(!stats.tx_queued && !stats.tx_batches);
+    coremodel_batch_commit(cm);
+    coremodel_get_stats(cm, &stats);
+    CHECK(stats.tx_queued_packets == 1 && stats.tx_batches == 1);
+
+    for(idx=0; idx<8 && nrcvd<NUM_PKT; idx++) {
+        coremodel_mainloop(cm, 1000);
+        while(lbvm_poll(&vm) > 0)
+            ;
+    }
+    CHECK(nrcvd == NUM_PKT);
+    for(idx=0; idx<NUM_PKT; idx++)
+        CHECK(rcvd[idx] == idx);
+
+    coremodel_detach(uart);
+    coremodel_disconnect(cm);
+    coremodel_loopback_close(peer);
+
+    printf("loopback-batch: ok, %u packets in one buffer\n", NUM_PKT);
+    return 0;
+}
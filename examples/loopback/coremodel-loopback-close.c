@@ -0,0 +1,48 @@
+/*
+ * CoreModel Loopback Close Test
+ *
+ * Closes the instance side of a loopback pair while packets it sent are
+ * still queued for the peer, then drains them from the peer side.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+
+#include "lbvm.h"
+
+static const coremodel_uart_func_t test_uart_func = { 0 };
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    static uint8_t buf[65536];
+    uint8_t data[64];
+    void *cm, *peer, *uart;
+    unsigned idx, total = 0;
+    int res;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+    lbvm_start(&vm, peer);
+    uart = coremodel_attach_uart(cm, "uart0", &test_uart_func, NULL);
+    CHECK(uart);
+    lbvm_stop(&vm);
+
+    /* Queue data for the peer and let the loop move it into the pair */
+    memset(data, 0x5a, sizeof(data));
+    for(idx=0; idx<16; idx++)
+        CHECK(coremodel_uart_rx(uart, sizeof(data), data) == sizeof(data));
+    coremodel_mainloop(cm, 1000);
+    coremodel_disconnect(cm);
+
+    /* The peer still reads what was queued, then sees the reset */
+    while((res = coremodel_loopback_read(peer, buf, sizeof(buf))) > 0)
+        total += res;
+    CHECK(res == -ECONNRESET);
+    CHECK(total >= 16 * (8 + sizeof(data)));
+    coremodel_loopback_close(peer);
+
+    printf("loopback-close: ok, drained %u bytes after close\n", total);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * CoreModel Connect Deadline Test
+ *
+ * Starts a nonblocking connection with a timeout to a TCP listener whose
+ * accept queue is full, so that its SYN goes unanswered, and checks that the
+ * reactor reports ETIMEDOUT once the timeout has passed rather than when the
+ * system gives up. The loopback transport has no connection to time out.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "lbvm.h"
+
+#define TIMEOUT_MS      200
+#define MAX_FILL        16
+
+static int error_res;
+static uint64_t error_us;
+
+static void test_error(void *priv, void *cm, int err)
+{
+    error_res = err;
+    error_us = lbvm_time_us();
+}
+
+/* Connect without waiting; returns 1 if the connection came up within 100 ms. */
+static int test_fill(int fd, struct sockaddr_in *sa)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(!connect(fd, (struct sockaddr *)sa, sizeof(*sa)))
+        return 1;
+    CHECK(errno == EINPROGRESS);
+    return poll(&pfd, 1, 100) > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    coremodel_connect_opts_t opts = { .timeout_ms = TIMEOUT_MS, .nonblock = 1 };
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t salen = sizeof(sa);
+    int ls, fill[MAX_FILL], nfill, probe, res;
+    coremodel_reactor_t *rct;
+    char target[64];
+    uint64_t start;
+    void *cm;
+
+    ls = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(ls >= 0);
+    CHECK(!bind(ls, (struct sockaddr *)&sa, sizeof(sa)) && !listen(ls, 0));
+    CHECK(!getsockname(ls, (struct sockaddr *)&sa, &salen));
+    snprintf(target, sizeof(target), "127.0.0.1:%u", ntohs(sa.sin_port));
+
+    /* Never accept, and fill the queue until a connection stops coming up */
+    for(nfill=0; ; nfill++) {
+        CHECK(nfill < MAX_FILL);
+        fill[nfill] = socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(fill[nfill] >= 0);
+        if(!test_fill(fill[nfill], &sa))
+            break;
+    }
+    probe = fill[nfill];
+
+    rct = coremodel_reactor_create();
+    CHECK(rct);
+    start = lbvm_time_us();
+    CHECK(!coremodel_connect_ex(&cm, target, &opts));
+    CHECK(!coremodel_reactor_add(rct, cm, test_error, NULL));
+
+    /* Only the deadline can end this; the system retries the SYN for minutes */
+    res = coremodel_reactor_run(rct, 5000000);
+    CHECK(res == -ENOTCONN);
+    CHECK(error_res == -ETIMEDOUT);
+    CHECK(error_us - start >= TIMEOUT_MS * 1000ull);
+    CHECK(error_us - start < TIMEOUT_MS * 1000ull + 500000);
+
+    coremodel_disconnect(cm);
+    coremodel_reactor_destroy(rct);
+    close(probe);
+    while(nfill--)
+        close(fill[nfill]);
+    close(ls);
+
+    printf("loopback-deadline: ok, timed out after %llu ms\n", (unsigned long long)(error_us - start) / 1000);
+    return 0;
+}
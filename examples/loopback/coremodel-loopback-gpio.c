@@ -0,0 +1,98 @@
+/*
+ * CoreModel Loopback GPIO Bank Test
+ *
+ * Attaches a bank of 80 pins, so that its bitmaps take two words, sends a
+ * burst of pin updates from the VM side and checks they arrive as one
+ * notification, then drives a few pins with one call.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define PKT_GPIO_UPDATE 0x00
+#define PKT_GPIO_FORCE  0x01
+
+#define NUM_PIN         80
+
+static const unsigned updated[] = { 3, 64, 79 };
+static unsigned notifies, forces;
+static uint64_t changed[2];
+static int volts[NUM_PIN];
+static int forced[NUM_PIN];
+
+static void test_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt != PKT_GPIO_FORCE)
+        return;
+    CHECK(conn < NUM_PIN);
+    forced[conn] = (bflag & 1) ? (int16_t)hflag : -1;
+    forces ++;
+}
+
+static void test_notify(void *priv, const uint64_t *chg, const int *mvolt)
+{
+    notifies ++;
+    changed[0] |= chg[0];
+    changed[1] |= chg[1];
+    memcpy(volts, mvolt, sizeof(volts));
+}
+
+static const coremodel_gpio_bank_func_t test_bank_func = {
+    .notify = test_notify };
+
+static void test_pump(struct lbvm *vm, void *cm)
+{
+    unsigned idx;
+
+    for(idx=0; idx<4; idx++) {
+        coremodel_mainloop(cm, 500);
+        while(lbvm_poll(vm) > 0)
+            ;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    unsigned pins[NUM_PIN], idx;
+    uint64_t mask[2] = { 0 }, drven[2] = { 0 };
+    int mvolt[NUM_PIN] = { 0 };
+    void *cm, *peer, *bank;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+    vm.packet = test_packet;
+    lbvm_start(&vm, peer);
+    for(idx=0; idx<NUM_PIN; idx++)
+        pins[idx] = NUM_PIN - 1 - idx;
+    bank = coremodel_attach_gpio_bank(cm, "gpio0", pins, NUM_PIN, &test_bank_func, NULL);
+    CHECK(bank);
+    lbvm_stop(&vm);
+    CHECK(vm.conns == NUM_PIN);
+
+    /* Connections are handed out in the order of the pins array */
+    for(idx=0; idx<sizeof(updated)/sizeof(updated[0]); idx++)
+        lbvm_send(&vm, updated[idx], PKT_GPIO_UPDATE, 0, 1000 + updated[idx], NULL, 0);
+    test_pump(&vm, cm);
+    CHECK(notifies == 1);
+    CHECK(changed[0] == 1ull << 3 && changed[1] == (1ull << 0 | 1ull << 15));
+    for(idx=0; idx<sizeof(updated)/sizeof(updated[0]); idx++)
+        CHECK(volts[updated[idx]] == 1000 + updated[idx]);
+
+    /* Drive one pin and release another */
+    mask[0] = 1ull << 1;
+    mask[1] = 1ull << 6;
+    drven[0] = 1ull << 1;
+    mvolt[1] = 3300;
+    CHECK(!coremodel_gpio_set_multi(bank, mask, drven, mvolt));
+    test_pump(&vm, cm);
+    CHECK(forces == 2 && forced[1] == 3300 && forced[70] == -1);
+
+    coremodel_detach_gpio_bank(bank);
+    coremodel_disconnect(cm);
+    coremodel_loopback_close(peer);
+
+    printf("loopback-gpio: ok, %u pins, %u updates in %u notification\n", NUM_PIN, (unsigned)(sizeof(updated)/sizeof(updated[0])), notifies);
+    return 0;
+}
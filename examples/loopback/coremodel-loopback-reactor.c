@@ -0,0 +1,85 @@
+/*
+ * CoreModel Loopback Reactor Timer Test
+ *
+ * Drives many loopback instances from one reactor, each with a timer due at
+ * a different time, and arms one more timer from another thread while the
+ * reactor is asleep.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define NUM_CONN        64
+#define STEP_US         2000
+#define LATE_US         20000
+
+struct conn {
+    void *cm, *peer;
+    uint64_t deadline, fired;
+};
+
+static struct conn conns[NUM_CONN];
+
+static void test_timer(void *priv)
+{
+    struct conn *c = priv;
+
+    __atomic_store_n(&c->fired, lbvm_time_us(), __ATOMIC_RELEASE);
+}
+
+static void *test_reactor(void *arg)
+{
+    coremodel_reactor_run(arg, 300000);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    coremodel_reactor_t *rct;
+    pthread_t thread;
+    uint64_t start, late, worst = 0;
+    unsigned idx;
+
+    rct = coremodel_reactor_create();
+    CHECK(rct);
+    for(idx=0; idx<NUM_CONN; idx++) {
+        CHECK(!coremodel_connect_loopback(&conns[idx].cm, &conns[idx].peer, NULL));
+        CHECK(!coremodel_reactor_add(rct, conns[idx].cm, NULL, NULL));
+    }
+
+    /* Timers armed in reverse order of their connections */
+    start = lbvm_time_us();
+    for(idx=0; idx<NUM_CONN; idx++) {
+        conns[idx].deadline = start + (NUM_CONN - idx) * STEP_US;
+        CHECK(coremodel_timer_add(conns[idx].cm, conns[idx].deadline * 1000, 0, test_timer, &conns[idx]));
+    }
+    coremodel_reactor_run(rct, (NUM_CONN + 5) * STEP_US);
+    for(idx=0; idx<NUM_CONN; idx++) {
+        CHECK(conns[idx].fired >= conns[idx].deadline);
+        late = conns[idx].fired - conns[idx].deadline;
+        CHECK(late < LATE_US);
+        if(late > worst)
+            worst = late;
+    }
+
+    /* An earlier timer armed while the reactor sleeps wakes it up */
+    conns[7].fired = 0;
+    CHECK(!pthread_create(&thread, NULL, test_reactor, rct));
+    usleep(20000);
+    conns[7].deadline = lbvm_time_us() + 10000;
+    CHECK(coremodel_timer_add(conns[7].cm, conns[7].deadline * 1000, 0, test_timer, &conns[7]));
+    usleep(10000 + LATE_US);
+    CHECK(__atomic_load_n(&conns[7].fired, __ATOMIC_ACQUIRE) >= conns[7].deadline);
+    pthread_join(thread, NULL);
+
+    coremodel_reactor_destroy(rct);
+    for(idx=0; idx<NUM_CONN; idx++) {
+        coremodel_disconnect(conns[idx].cm);
+        coremodel_loopback_close(conns[idx].peer);
+    }
+
+    printf("loopback-reactor: ok, %u timers, worst %llu us late\n", NUM_CONN, (unsigned long long)worst);
+    return 0;
+}
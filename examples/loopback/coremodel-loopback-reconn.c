@@ -0,0 +1,142 @@
+/*
+ * CoreModel Reconnect Test
+ *
+ * Connects in reconnect mode over a UNIX socket, drops the connection, and
+ * checks that the interfaces are attached again on the new one, under the
+ * connection indices the new VM hands out, with the link callback told both
+ * times. The loopback transport has no target to connect to again.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lbvm.h"
+
+#define PKT_UART_TX     0x00
+#define PKT_UART_RX     0x01
+
+static unsigned rx_conn, rx_count, tx_bytes, ups, downs;
+static uint8_t rx_byte;
+
+static void test_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt != PKT_UART_RX || !dlen)
+        return;
+    rx_conn = conn;
+    rx_byte = data[0];
+    __atomic_add_fetch(&rx_count, 1, __ATOMIC_RELEASE);
+}
+
+static int test_uart_tx(void *priv, unsigned len, uint8_t *data)
+{
+    __atomic_add_fetch(&tx_bytes, len, __ATOMIC_RELEASE);
+    return len;
+}
+
+static const coremodel_uart_func_t test_uart_func = {
+    .tx = test_uart_tx };
+static const coremodel_gpio_func_t test_gpio_func = { 0 };
+
+static void test_link(void *priv, int up, int err)
+{
+    if(up)
+        __atomic_add_fetch(&ups, 1, __ATOMIC_RELEASE);
+    else
+        __atomic_add_fetch(&downs, 1, __ATOMIC_RELEASE);
+}
+
+static int stop;
+
+static void *test_loop(void *cm)
+{
+    while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+        coremodel_mainloop(cm, 1000);
+    return NULL;
+}
+
+/* Wait for a counter to reach a value; returns 0 on timeout. */
+static int test_wait(unsigned *what, unsigned value)
+{
+    uint64_t end = lbvm_time_us() + 2000000;
+
+    while(__atomic_load_n(what, __ATOMIC_ACQUIRE) < value)
+        if(lbvm_time_us() > end)
+            return 0;
+        else
+            usleep(100);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    coremodel_connect_opts_t opts = { .reconnect_ms = 10, .link = test_link };
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    coremodel_stats_t stats;
+    char target[128];
+    void *cm, *uart, *gpio;
+    pthread_t thread;
+    uint8_t data;
+    int ls, fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "/tmp/coremodel-reconn-%d.sock", (int)getpid());
+    unlink(sa.sun_path);
+    ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(ls >= 0);
+    CHECK(!bind(ls, (struct sockaddr *)&sa, sizeof(sa)) && !listen(ls, 1));
+    snprintf(target, sizeof(target), "unix:%s", sa.sun_path);
+
+    vm.packet = test_packet;
+    CHECK(!coremodel_connect_ex(&cm, target, &opts));
+    fd = accept(ls, NULL, NULL);
+    CHECK(fd >= 0);
+    lbvm_start_fd(&vm, fd);
+    gpio = coremodel_attach_gpio(cm, "gpio0", 3, &test_gpio_func, NULL);
+    uart = coremodel_attach_uart(cm, "uart0", &test_uart_func, NULL);
+    CHECK(gpio && uart);
+    CHECK(!pthread_create(&thread, NULL, test_loop, cm));
+
+    data = 1;
+    CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+    CHECK(test_wait(&rx_count, 1) && rx_conn == 1 && rx_byte == 1);
+
+    /* The VM goes away; the next one numbers its connections differently */
+    lbvm_stop(&vm);
+    close(fd);
+    CHECK(test_wait(&downs, 1));
+    vm.conns = 10;
+    vm.fill = 0;
+    fd = accept(ls, NULL, NULL);
+    CHECK(fd >= 0);
+    lbvm_start_fd(&vm, fd);
+    CHECK(test_wait(&ups, 1));
+    CHECK(vm.conns == 12);
+
+    /* Both directions go through the same handles */
+    data = 2;
+    CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+    CHECK(test_wait(&rx_count, 2) && rx_conn >= 10 && rx_conn < 12 && rx_byte == 2);
+    lbvm_send(&vm, rx_conn, PKT_UART_TX, 0, 0, "hello", 5);
+    CHECK(test_wait(&tx_bytes, 5));
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    coremodel_get_stats(cm, &stats);
+    CHECK(stats.reconnects == 1 && ups == 1 && downs == 1);
+
+    coremodel_detach(uart);
+    coremodel_detach(gpio);
+    coremodel_disconnect(cm);
+    lbvm_stop(&vm);
+    close(fd);
+    close(ls);
+    unlink(sa.sun_path);
+
+    printf("loopback-reconn: ok, re-attached in %llu us\n", (unsigned long long)stats.last_reattach_us);
+    return 0;
+}
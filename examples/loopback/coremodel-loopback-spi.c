@@ -0,0 +1,118 @@
+/*
+ * CoreModel Loopback SPI Test
+ *
+ * Sends SPI transfers larger than the default piece size through the
+ * built-in receive ring, so that they wrap around its end, and checks that
+ * they reach the model in max_xfr pieces and are answered whole. A transfer
+ * too large for the ring is dropped without losing the ones behind it.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define PKT_SPI_TX      0x01
+#define PKT_SPI_RX      0x02
+
+#define MAX_XFR         1024
+#define BIG_XFR         3000
+#define HUGE_XFR        6000
+#define NUM_XFR         16
+
+static uint8_t sent[HUGE_XFR], rcvd[HUGE_XFR];
+static unsigned calls, longest, got_len, got_idx;
+static int stop, got;
+
+static int test_spi_xfr(void *priv, unsigned len, uint8_t *wrdata, uint8_t *rddata)
+{
+    unsigned idx;
+
+    calls ++;
+    if(len > longest)
+        longest = len;
+    for(idx=0; idx<len; idx++)
+        rddata[idx] = ~wrdata[idx];
+    return len;
+}
+
+static const coremodel_spi_func_t test_spi_func = {
+    .xfr = test_spi_xfr };
+
+static void test_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    if(pkt != PKT_SPI_RX)
+        return;
+    memcpy(rcvd, data, dlen < sizeof(rcvd) ? dlen : sizeof(rcvd));
+    got_len = dlen;
+    got_idx = hflag;
+    __atomic_store_n(&got, 1, __ATOMIC_RELEASE);
+}
+
+static void *test_loop(void *cm)
+{
+    while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+        coremodel_mainloop(cm, 1000);
+    return NULL;
+}
+
+/* Send one transfer and wait for its answer; returns 0 if none came. */
+static int test_xfr(struct lbvm *vm, unsigned idx, unsigned len)
+{
+    uint64_t end;
+    unsigned i;
+
+    for(i=0; i<len; i++)
+        sent[i] = i * 7 + idx;
+    __atomic_store_n(&got, 0, __ATOMIC_RELEASE);
+    lbvm_send(vm, 0, PKT_SPI_TX, 0, idx, sent, len);
+    end = lbvm_time_us() + 200000;
+    while(!__atomic_load_n(&got, __ATOMIC_ACQUIRE))
+        if(lbvm_time_us() > end)
+            return 0;
+        else
+            usleep(50);
+    CHECK(got_idx == idx && got_len == len);
+    for(i=0; i<len; i++)
+        CHECK(rcvd[i] == (uint8_t)~sent[i]);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    coremodel_stats_t stats;
+    pthread_t thread;
+    void *cm, *peer, *spi;
+    unsigned idx;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+    vm.packet = test_packet;
+    lbvm_start(&vm, peer);
+    spi = coremodel_attach_spi_ex(cm, "spi0", 0, NULL, &test_spi_func, NULL, COREMODEL_SPI_BLOCK, MAX_XFR);
+    CHECK(spi);
+    CHECK(!pthread_create(&thread, NULL, test_loop, cm));
+
+    /* Packets of 3 KiB in a 4 KiB ring wrap around its end */
+    for(idx=0; idx<NUM_XFR; idx++)
+        CHECK(test_xfr(&vm, idx, BIG_XFR));
+    CHECK(longest == MAX_XFR);
+    CHECK(calls == NUM_XFR * ((BIG_XFR + MAX_XFR - 1) / MAX_XFR));
+
+    /* One that cannot fit is dropped, and the next one still gets through */
+    CHECK(!test_xfr(&vm, NUM_XFR, HUGE_XFR));
+    CHECK(test_xfr(&vm, NUM_XFR + 1, 100));
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    coremodel_get_stats(cm, &stats);
+    CHECK(stats.rx_dropped == 1);
+
+    lbvm_stop(&vm);
+    coremodel_detach(spi);
+    coremodel_disconnect(cm);
+    coremodel_loopback_close(peer);
+
+    printf("loopback-spi: ok, %u transfers of %u bytes in %u calls\n", NUM_XFR, BIG_XFR, calls);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * CoreModel Loopback Timer Test
+ *
+ * Runs a few thousand one-shot timers and a periodic one from the main loop
+ * of a loopback instance, and checks that none fires early or much late,
+ * and that a periodic timer can re-arm and delete itself from its callback.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define NUM_TIMER       4000
+#define SPREAD_US       100000
+#define LATE_US         20000
+#define PERIOD_US       1000
+#define NUM_TICK        50
+
+struct shot {
+    uint64_t deadline, fired;
+};
+
+static struct shot shots[NUM_TIMER];
+static unsigned nfired, ticks;
+static void *tick;
+
+static void test_shot(void *priv)
+{
+    struct shot *shot = priv;
+
+    CHECK(!shot->fired);
+    shot->fired = lbvm_time_us();
+    nfired ++;
+}
+
+static void test_tick(void *priv)
+{
+    ticks ++;
+    /* Halfway through, go twice as fast; at the end, remove the timer */
+    if(ticks == NUM_TICK / 2)
+        coremodel_timer_mod(tick, coremodel_time_ns() + PERIOD_US * 500, PERIOD_US * 500);
+    else if(ticks == NUM_TICK) {
+        coremodel_timer_del(tick);
+        tick = NULL;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    void *cm, *peer;
+    uint64_t start, late, worst = 0, end;
+    unsigned idx;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, NULL));
+    CHECK(coremodel_timer_next(cm) == -1);
+
+    start = lbvm_time_us();
+    srand(1);
+    for(idx=0; idx<NUM_TIMER; idx++) {
+        shots[idx].deadline = start + 1000 + rand() % SPREAD_US;
+        CHECK(coremodel_timer_add(cm, shots[idx].deadline * 1000, 0, test_shot, &shots[idx]));
+    }
+    tick = coremodel_timer_add(cm, (start + PERIOD_US) * 1000, PERIOD_US * 1000, test_tick, NULL);
+    CHECK(tick);
+    CHECK(coremodel_timer_next(cm) <= 1000);
+
+    end = start + SPREAD_US + 2 * LATE_US;
+    while(lbvm_time_us() < end && (nfired < NUM_TIMER || tick))
+        coremodel_mainloop(cm, 10000);
+
+    CHECK(nfired == NUM_TIMER);
+    for(idx=0; idx<NUM_TIMER; idx++) {
+        CHECK(shots[idx].fired >= shots[idx].deadline);
+        late = shots[idx].fired - shots[idx].deadline;
+        CHECK(late < LATE_US);
+        if(late > worst)
+            worst = late;
+    }
+    CHECK(!tick && ticks == NUM_TICK);
+    CHECK(coremodel_timer_next(cm) == -1);
+
+    coremodel_disconnect(cm);
+    coremodel_loopback_close(peer);
+
+    printf("loopback-timer: ok, %u timers, worst %llu us late\n", NUM_TIMER, (unsigned long long)worst);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * CoreModel Loopback Write-Through Test
+ *
+ * Sends UART data in write-through mode and checks that an idle connection
+ * writes it from the calling thread, and that a packet handed over while
+ * another thread held the connection is not overtaken by a later one, here
+ * a CAN frame, written through.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lbvm.h"
+
+#define PKT_CAN_RX      0x02
+
+static uint8_t rcvd[16];
+static unsigned nrcvd;
+static int holding, release;
+
+static void test_packet(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen)
+{
+    unsigned idx;
+
+    /* The CAN interface is the second one attached */
+    if(conn == 1) {
+        CHECK(pkt == PKT_CAN_RX && dlen == 17);
+        data += 16;
+        dlen = 1;
+    }
+    for(idx=0; idx<dlen; idx++) {
+        CHECK(nrcvd < sizeof(rcvd));
+        rcvd[nrcvd++] = data[idx];
+    }
+}
+
+static const coremodel_uart_func_t test_uart_func = { 0 };
+static const coremodel_can_func_t test_can_func = { 0 };
+
+/* Hold the connection, as a batch on another thread does. */
+static void *test_holder(void *cm)
+{
+    coremodel_batch_begin(cm);
+    __atomic_store_n(&holding, 1, __ATOMIC_RELEASE);
+    while(!__atomic_load_n(&release, __ATOMIC_ACQUIRE))
+        usleep(100);
+    coremodel_batch_commit(cm);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct lbvm vm;
+    coremodel_connect_opts_t opts = { .write_through = 1 };
+    coremodel_stats_t stats, base;
+    pthread_t thread;
+    uint64_t ctrl[2] = { 1ul << CAN_CTRL_DLC_SHIFT, 0 };
+    void *cm, *peer, *uart, *can;
+    uint8_t data;
+    unsigned idx;
+
+    CHECK(!coremodel_connect_loopback(&cm, &peer, &opts));
+    vm.packet = test_packet;
+    lbvm_start(&vm, peer);
+    uart = coremodel_attach_uart(cm, "uart0", &test_uart_func, NULL);
+    can = coremodel_attach_can(cm, "can0", &test_can_func, NULL);
+    CHECK(uart && can);
+    lbvm_stop(&vm);
+    CHECK(!coremodel_can_set_rx_depth(can, 4));
+    coremodel_mainloop(cm, 1000);
+
+    /* Idle: written by this thread, with no loop running */
+    coremodel_get_stats(cm, &base);
+    data = 0;
+    CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+    while(lbvm_poll(&vm) > 0)
+        ;
+    CHECK(nrcvd == 1);
+    coremodel_get_stats(cm, &stats);
+    CHECK(stats.tx_direct == base.tx_direct + 1);
+
+    /* Busy: handed over to the loop, and the next packet queues behind it */
+    CHECK(!pthread_create(&thread, NULL, test_holder, cm));
+    while(!__atomic_load_n(&holding, __ATOMIC_ACQUIRE))
+        usleep(100);
+    data = 1;
+    CHECK(coremodel_uart_rx(uart, 1, &data) == 1);
+    __atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    data = 2;
+    CHECK(!coremodel_can_rx(can, ctrl, &data));
+
+    for(idx=0; idx<8 && nrcvd<3; idx++) {
+        coremodel_mainloop(cm, 1000);
+        while(lbvm_poll(&vm) > 0)
+            ;
+    }
+    CHECK(nrcvd == 3);
+    for(idx=0; idx<nrcvd; idx++)
+        CHECK(rcvd[idx] == idx);
+    coremodel_get_stats(cm, &stats);
+    CHECK(stats.tx_submitted == base.tx_submitted + 1);
+
+    coremodel_detach(can);
+    coremodel_detach(uart);
+    coremodel_disconnect(cm);
+    coremodel_loopback_close(peer);
+
+    printf("loopback-wt: ok, %u packets in order, %llu written through\n", nrcvd, (unsigned long long)(stats.tx_direct - base.tx_direct));
+    return 0;
+}
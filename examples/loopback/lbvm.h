@@ -0,0 +1,192 @@
+/*
+ * CoreModel Loopback Test VM
+ *
+ * A minimal VM side of the CoreModel protocol for the loopback examples: it
+ * answers connection requests and hands every other packet to a callback.
+ * It talks to the instance through a loopback peer, or through a connected
+ * socket for tests of the socket transport.
+ *
+ * Copyright (c) 2022-2026 Corellium Inc.
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LBVM_H
+#define _LBVM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <coremodel.h>
+
+#define LBVM_CONN_QUERY         0xFFFF
+#define LBVM_REQ_CONN           0x02
+#define LBVM_RSP_CONN           0x03
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)
+
+struct lbvm {
+    void *peer;                     /* loopback peer, or NULL to use fd */
+    int fd;
+    pthread_t thread;
+    int stop, running;
+    unsigned conns;                 /* connections handed out so far */
+    unsigned delay_us;              /* wait before answering a connection request */
+    unsigned credit;                /* initial credit sent with each connection */
+    unsigned spin;                  /* poll a socket without waiting */
+    /* Called from the VM thread for every packet not on the query connection */
+    void (*packet)(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, uint8_t *data, unsigned dlen);
+    void *priv;
+    unsigned fill;
+    uint8_t buf[131072];
+};
+
+static inline uint64_t lbvm_time_us(void)
+{
+    return coremodel_time_ns() / 1000;
+}
+
+/* Send one packet to the instance; may be called from any thread. */
+static inline void lbvm_send(struct lbvm *vm, unsigned conn, unsigned pkt, unsigned bflag, unsigned hflag, const void *data, unsigned dlen)
+{
+    uint8_t *out;
+    unsigned len = 8 + dlen, alen = (len + 3) & ~3, done = 0;
+    int res;
+
+    out = calloc(1, alen);
+    CHECK(out);
+    out[0] = len;
+    out[1] = len >> 8;
+    out[2] = conn;
+    out[3] = conn >> 8;
+    out[4] = pkt;
+    out[5] = bflag;
+    out[6] = hflag;
+    out[7] = hflag >> 8;
+    if(dlen)
+        memcpy(out + 8, data, dlen);
+    while(done < alen) {
+        if(vm->peer)
+            res = coremodel_loopback_write(vm->peer, out + done, alen - done);
+        else {
+            res = write(vm->fd, out + done, alen - done);
+            if(res < 0 && errno == EINTR)
+                continue;
+        }
+        if(res < 0)
+            break;
+        if(!res)
+            usleep(20);
+        done += res;
+    }
+    free(out);
+}
+
+/* Read what the instance has sent; waits up to timeout_ms for a socket.
+ * Returns the number of bytes read, 0 if none, or a negative error. */
+static inline int lbvm_read(struct lbvm *vm, void *buf, unsigned len, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = vm->fd, .events = POLLIN };
+    int res;
+
+    if(vm->peer)
+        return coremodel_loopback_read(vm->peer, buf, len);
+    res = poll(&pfd, 1, timeout_ms);
+    if(res <= 0)
+        return (res < 0 && errno != EINTR) ? -errno : 0;
+    res = read(vm->fd, buf, len);
+    if(res < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+    return res ? res : -ECONNRESET;
+}
+
+/* Read from the instance and handle every complete packet. Returns the
+ * number of bytes read, or the error from lbvm_read. */
+static inline int lbvm_poll(struct lbvm *vm)
+{
+    unsigned len, alen, conn, offs = 0;
+    uint8_t *p;
+    uint32_t cred;
+    int res;
+
+    res = lbvm_read(vm, vm->buf + vm->fill, sizeof(vm->buf) - vm->fill, (vm->peer || vm->spin) ? 0 : 10);
+    if(res <= 0)
+        return res;
+    vm->fill += res;
+
+    while(vm->fill - offs >= 8) {
+        p = vm->buf + offs;
+        len = p[0] | p[1] << 8;
+        alen = (len + 3) & ~3;
+        if(vm->fill - offs < alen)
+            break;
+        conn = p[2] | p[3] << 8;
+        if(conn == LBVM_CONN_QUERY && p[4] == LBVM_REQ_CONN) {
+            if(vm->delay_us)
+                usleep(vm->delay_us);
+            cred = vm->credit ? vm->credit : 4096;
+            lbvm_send(vm, LBVM_CONN_QUERY, LBVM_RSP_CONN, 0, vm->conns++, &cred, 4);
+        } else if(conn != LBVM_CONN_QUERY && vm->packet)
+            vm->packet(vm, conn, p[4], p[5], p[6] | p[7] << 8, p + 8, len - 8);
+        offs += alen;
+    }
+    memmove(vm->buf, vm->buf + offs, vm->fill - offs);
+    vm->fill -= offs;
+    return res;
+}
+
+static inline void *lbvm_thread(void *arg)
+{
+    struct lbvm *vm = arg;
+    int res;
+
+    while(!__atomic_load_n(&vm->stop, __ATOMIC_ACQUIRE)) {
+        res = lbvm_poll(vm);
+        if(res < 0)
+            break;
+        if(!res && vm->peer)
+            usleep(20);
+    }
+    return NULL;
+}
+
+/* Start the VM thread on a loopback peer. */
+static inline void lbvm_start(struct lbvm *vm, void *peer)
+{
+    vm->peer = peer;
+    vm->fd = -1;
+    vm->stop = 0;
+    vm->running = 1;
+    CHECK(!pthread_create(&vm->thread, NULL, lbvm_thread, vm));
+}
+
+/* Start the VM thread on a connected socket. */
+static inline void lbvm_start_fd(struct lbvm *vm, int fd)
+{
+    vm->peer = NULL;
+    vm->fd = fd;
+    vm->stop = 0;
+    vm->running = 1;
+    CHECK(!pthread_create(&vm->thread, NULL, lbvm_thread, vm));
+}
+
+static inline void lbvm_stop(struct lbvm *vm)
+{
+    if(!vm->running)
+        return;
+    __atomic_store_n(&vm->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(vm->thread, NULL);
+    vm->running = 0;
+}
+
+#endif